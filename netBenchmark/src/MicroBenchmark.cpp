@@ -0,0 +1,347 @@
+// Microbenchmarks for the hjw::net hot path primitives.
+//
+//  message_push/pop  - message<T>::operator<< and >> for a number of fields or one field of a size
+//  owned_message     - building the entry a connection pushes onto the incoming queue
+//  tsqueue           - push_back/pop_front with 1..N producers and one consumer, the
+//                      consumer either spins on empty() or sleeps in wait() on the
+//                      condition variable
+//
+// Each benchmark is calibrated until a run lasts --min-time, then run --repetitions
+// times. The median, min and max ns per operation are reported along with heap
+// allocations and bytes per operation, counted by replacing the global operator new.
+// One result per line, as JSON lines or CSV.
+//
+//  MicroBenchmark --filter tsqueue --producers 8
+
+#include <hjw_net.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace po = boost::program_options;
+
+// every heap allocation in the process goes through here
+static std::atomic<uint64_t> nAllocations{0};
+static std::atomic<uint64_t> nAllocatedBytes{0};
+
+void* operator new(std::size_t nSize) {
+    nAllocations.fetch_add(1, std::memory_order_relaxed);
+    nAllocatedBytes.fetch_add(nSize, std::memory_order_relaxed);
+    if(void* p = std::malloc(nSize ? nSize : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+enum class MicroMsgTypes : uint32_t
+{
+    Data
+};
+
+using micro_message = hjw::net::message<MicroMsgTypes>;
+using micro_owned = hjw::net::owned_message<MicroMsgTypes>;
+
+// keep the optimiser from dropping work whose result is unused
+template <typename T>
+inline void DoNotOptimize(T& value) {
+    asm volatile("" : "+m"(value) : : "memory");
+}
+
+struct micro_config {
+    double fMinTime = 0.2;
+    size_t nRepetitions = 5;
+    size_t nProducers = 4;
+    std::string sFilter;
+    std::string sFormat = "json";
+};
+
+struct micro_result {
+    std::string sName;
+    uint64_t nIterations = 0;
+    double fMedianNs = 0;
+    double fMinNs = 0;
+    double fMaxNs = 0;
+    double fAllocsPerOp = 0;
+    double fBytesPerOp = 0;
+};
+
+// fnBody runs nIterations operations and may be called many times
+using micro_body = std::function<void(uint64_t nIterations)>;
+
+class micro_runner {
+    public:
+        explicit micro_runner(const micro_config& config) : m_oConfig(config) {}
+
+        void Run(const std::string& sName, const micro_body& fnBody) {
+            if(!m_oConfig.sFilter.empty() && sName.find(m_oConfig.sFilter) == std::string::npos)
+                return;
+
+            // grow the iteration count until one run takes long enough to time reliably
+            uint64_t nIterations = 1;
+            for(;;) {
+                double fSeconds = TimeRun(fnBody, nIterations);
+                if(fSeconds >= m_oConfig.fMinTime || nIterations >= (uint64_t(1) << 40))
+                    break;
+                double fScale = fSeconds > 0 ? m_oConfig.fMinTime * 1.4 / fSeconds : 10.0;
+                nIterations = uint64_t(double(nIterations) * std::clamp(fScale, 2.0, 10.0));
+            }
+
+            std::vector<double> vNsPerOp;
+            uint64_t nAllocsBefore = nAllocations.load();
+            uint64_t nBytesBefore = nAllocatedBytes.load();
+            for(size_t i = 0; i < m_oConfig.nRepetitions; i++)
+                vNsPerOp.push_back(TimeRun(fnBody, nIterations) * 1e9 / double(nIterations));
+            double fOps = double(nIterations) * double(m_oConfig.nRepetitions);
+
+            micro_result result;
+            result.sName = sName;
+            result.nIterations = nIterations;
+            std::sort(vNsPerOp.begin(), vNsPerOp.end());
+            result.fMedianNs = vNsPerOp[vNsPerOp.size() / 2];
+            result.fMinNs = vNsPerOp.front();
+            result.fMaxNs = vNsPerOp.back();
+            result.fAllocsPerOp = double(nAllocations.load() - nAllocsBefore) / fOps;
+            result.fBytesPerOp = double(nAllocatedBytes.load() - nBytesBefore) / fOps;
+            Print(result);
+        }
+
+    private:
+        static double TimeRun(const micro_body& fnBody, uint64_t nIterations) {
+            auto tStart = std::chrono::steady_clock::now();
+            fnBody(nIterations);
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+        }
+
+        void Print(const micro_result& r) {
+            std::ostringstream os;
+            os << std::fixed << std::setprecision(2);
+            if(m_oConfig.sFormat == "csv") {
+                if(!m_bHeader) {
+                    std::cout << "name,iterations,median_ns,min_ns,max_ns,allocs_per_op,bytes_per_op\n";
+                    m_bHeader = true;
+                }
+                os << r.sName << "," << r.nIterations << "," << r.fMedianNs << "," << r.fMinNs << ","
+                   << r.fMaxNs << "," << r.fAllocsPerOp << "," << r.fBytesPerOp << "\n";
+            }else {
+                os << "{\"name\":\"" << r.sName << "\",\"iterations\":" << r.nIterations
+                   << ",\"median_ns\":" << r.fMedianNs << ",\"min_ns\":" << r.fMinNs
+                   << ",\"max_ns\":" << r.fMaxNs << ",\"allocs_per_op\":" << r.fAllocsPerOp
+                   << ",\"bytes_per_op\":" << r.fBytesPerOp << "}\n";
+            }
+            std::cout << os.str() << std::flush;
+        }
+
+    private:
+        const micro_config& m_oConfig;
+        bool m_bHeader = false;
+};
+
+// push nFields uint32_t into a fresh message, as code building a message does
+static void MessagePushFields(micro_runner& runner, size_t nFields) {
+    runner.Run("message_push_fields_" + std::to_string(nFields), [nFields](uint64_t nIterations) {
+        for(uint64_t i = 0; i < nIterations; i++) {
+            micro_message msg;
+            for(size_t f = 0; f < nFields; f++)
+                msg << uint32_t(f);
+            DoNotOptimize(msg);
+        }
+    });
+}
+
+// same into a message whose body keeps its capacity, so only the copy is timed
+static void MessagePushFieldsReuse(micro_runner& runner, size_t nFields) {
+    runner.Run("message_push_fields_reuse_" + std::to_string(nFields), [nFields](uint64_t nIterations) {
+        micro_message msg;
+        msg.body.reserve(nFields * sizeof(uint32_t));
+        for(uint64_t i = 0; i < nIterations; i++) {
+            msg.body.clear();
+            for(size_t f = 0; f < nFields; f++)
+                msg << uint32_t(f);
+            DoNotOptimize(msg);
+        }
+    });
+}
+
+// pop nFields back out, the body is grown back with resize each iteration which
+// does not allocate once capacity is there
+static void MessagePopFields(micro_runner& runner, size_t nFields) {
+    runner.Run("message_pop_fields_" + std::to_string(nFields), [nFields](uint64_t nIterations) {
+        micro_message msg;
+        for(size_t f = 0; f < nFields; f++)
+            msg << uint32_t(f);
+        size_t nFull = msg.body.size();
+
+        for(uint64_t i = 0; i < nIterations; i++) {
+            msg.body.resize(nFull);
+            uint32_t nValue = 0;
+            for(size_t f = 0; f < nFields; f++) {
+                msg >> nValue;
+                DoNotOptimize(nValue);
+            }
+        }
+    });
+}
+
+template <size_t N>
+static void MessagePushBytes(micro_runner& runner) {
+    runner.Run("message_push_bytes_" + std::to_string(N), [](uint64_t nIterations) {
+        std::array<uint8_t, N> aData{};
+        for(uint64_t i = 0; i < nIterations; i++) {
+            micro_message msg;
+            msg << aData;
+            DoNotOptimize(msg);
+        }
+    });
+}
+
+template <size_t N>
+static void MessagePopBytes(micro_runner& runner) {
+    runner.Run("message_pop_bytes_" + std::to_string(N), [](uint64_t nIterations) {
+        std::array<uint8_t, N> aData{};
+        micro_message msg;
+        msg << aData;
+        for(uint64_t i = 0; i < nIterations; i++) {
+            msg.body.resize(N);
+            msg >> aData;
+            DoNotOptimize(aData);
+        }
+    });
+}
+
+// what connection::AddToIncomingMessageQueue builds, a copy of the read message plus a
+// reference to the connection. The aliasing constructor gives a real control block
+// without needing a live connection
+static void OwnedMessage(micro_runner& runner, size_t nBody) {
+    auto pOwner = std::make_shared<int>(0);
+    std::shared_ptr<hjw::net::connection<MicroMsgTypes>> pRemote(pOwner, nullptr);
+
+    runner.Run("owned_message_copy_" + std::to_string(nBody), [pRemote, nBody](uint64_t nIterations) {
+        micro_message msg;
+        msg.body.resize(nBody);
+        for(uint64_t i = 0; i < nIterations; i++) {
+            micro_owned owned{pRemote, msg, 0};
+            DoNotOptimize(owned);
+        }
+    });
+
+    runner.Run("owned_message_move_" + std::to_string(nBody), [pRemote, nBody](uint64_t nIterations) {
+        for(uint64_t i = 0; i < nIterations; i++) {
+            micro_message msg;
+            msg.body.resize(nBody);
+            micro_owned owned{pRemote, std::move(msg), 0};
+            DoNotOptimize(owned);
+        }
+    });
+}
+
+// nProducers threads push an iteration's worth of owned messages between them while
+// one consumer drains, either spinning or sleeping on the condition variable
+static void TsQueue(micro_runner& runner, size_t nProducers, bool bWait) {
+    std::string sName = std::string("tsqueue_") + (bWait ? "wait" : "spin") + "_producers_" + std::to_string(nProducers);
+
+    runner.Run(sName, [nProducers, bWait](uint64_t nIterations) {
+        hjw::net::tsqueue<micro_owned> q;
+
+        std::thread consumer([&q, nIterations, bWait]() {
+            uint64_t nTaken = 0;
+            while(nTaken < nIterations) {
+                if(bWait)
+                    q.wait();
+                while(!q.empty()) {
+                    micro_owned owned = q.pop_front();
+                    DoNotOptimize(owned);
+                    nTaken++;
+                }
+            }
+        });
+
+        std::vector<std::thread> vProducers;
+        for(size_t p = 0; p < nProducers; p++) {
+            uint64_t nShare = nIterations / nProducers + (p < nIterations % nProducers ? 1 : 0);
+            vProducers.emplace_back([&q, nShare]() {
+                for(uint64_t i = 0; i < nShare; i++)
+                    q.push_back(micro_owned{});
+            });
+        }
+
+        for(auto& t : vProducers)
+            t.join();
+        consumer.join();
+    });
+}
+
+int main(int argc, char** argv) {
+    micro_config config;
+
+    po::options_description desc("MicroBenchmark options");
+    desc.add_options()
+        ("help,h", "show this help")
+        ("filter", po::value<std::string>(&config.sFilter), "only run benchmarks whose name contains this")
+        ("min-time", po::value<double>(&config.fMinTime)->default_value(0.2), "seconds a calibrated run must last")
+        ("repetitions", po::value<size_t>(&config.nRepetitions)->default_value(5), "timed runs per benchmark")
+        ("producers", po::value<size_t>(&config.nProducers)->default_value(4), "tsqueue producers go 1, 2, 4 .. this")
+        ("format", po::value<std::string>(&config.sFormat)->default_value("json"), "json (one object per line) or csv");
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    }catch(std::exception& e) {
+        std::cerr << e.what() << "\n" << desc << "\n";
+        return 1;
+    }
+
+    if(vm.count("help")) {
+        std::cout << desc << "\n";
+        return 0;
+    }
+
+    if(config.nRepetitions == 0)
+        config.nRepetitions = 1;
+
+    micro_runner runner(config);
+
+    for(size_t nFields : {1, 4, 16, 64}) {
+        MessagePushFields(runner, nFields);
+        MessagePushFieldsReuse(runner, nFields);
+        MessagePopFields(runner, nFields);
+    }
+
+    MessagePushBytes<16>(runner);
+    MessagePushBytes<256>(runner);
+    MessagePushBytes<4096>(runner);
+    MessagePopBytes<16>(runner);
+    MessagePopBytes<256>(runner);
+    MessagePopBytes<4096>(runner);
+
+    for(size_t nBody : {0, 64, 4096})
+        OwnedMessage(runner, nBody);
+
+    for(bool bWait : {false, true}) {
+        for(size_t nProducers = 1; nProducers <= config.nProducers; nProducers *= 2)
+            TsQueue(runner, nProducers, bWait);
+    }
+
+    return 0;
+}
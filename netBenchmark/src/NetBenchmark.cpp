@@ -0,0 +1,478 @@
+// Loopback benchmark for hjw::net.
+//
+// Starts a server_interface and a set of clients in one process and runs
+//
+//  echo    - every connection keeps --window messages in flight, the server sends each
+//            one straight back. Latency is the round trip
+//  fanout  - a publisher keeps --window messages in flight, the server sends each one
+//            to every connection. Latency is publish to delivery
+//  stream  - every connection sends one way as fast as the server takes them, the server
+//            acks every nAckEvery messages so queues stay bounded. Latency is send to
+//            the server's OnMessage
+//
+// for each payload size and prints one result per line, as JSON lines or CSV, so runs
+// of different builds can be diffed. Transport, socket options and connection count
+// are all flags, build with HJW_NET_IO_URING to compare reactors.
+//
+//  NetBenchmark --scenario echo --sizes 64,4096 --clients 4 --stripes 250
+//  NetBenchmark --transport shm --format csv
+
+#include <hjw_net.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace po = boost::program_options;
+
+enum class BenchMsgTypes : uint32_t
+{
+    Echo,
+    Broadcast,
+    Stream,
+    StreamAck
+};
+
+// pushed last onto every benchmark message so it is popped first
+struct bench_stamp {
+    uint64_t nSentNs = 0;
+    uint32_t nAck = 0; // stream only, the server acks messages with this set
+};
+
+// streaming messages per ack, so a window of 1 keeps this many in flight
+constexpr uint32_t nAckEvery = 64;
+
+// everything a single run records, handlers only record while bRecording is set
+struct bench_stats {
+    std::atomic<bool> bRunning{true};
+    std::atomic<bool> bRecording{false};
+    hjw::net::metric_counter nMessages;
+    hjw::net::metric_counter nBytes;
+    hjw::net::metric_histogram hLatencyNs;
+
+    void Record(const hjw::net::message<BenchMsgTypes>& msg, uint64_t nSentNs) {
+        if(!bRecording.load(std::memory_order_relaxed))
+            return;
+        nMessages.Add();
+        nBytes.Add(int64_t(msg.size()));
+        hLatencyNs.Record(hjw::net::MetricNow() - nSentNs);
+    }
+};
+
+struct bench_config {
+    std::string sTransport = "tcp";
+    std::string sPath = "/tmp/hjw_net_bench.sock";
+    uint16_t nPort = 60500;
+    std::vector<std::string> vScenarios;
+    std::vector<size_t> vSizes;
+    size_t nClients = 1;
+    size_t nStripes = 1;
+    size_t nWindow = 1;
+    double fSeconds = 2.0;
+    double fWarmup = 0.5;
+    std::string sFormat = "json";
+    hjw::net::socket_options oSocketOptions;
+    hjw::net::latency_config oLatency;
+    hjw::net::worker_config oWorkers;
+
+    hjw::net::transport Transport() const {
+        if(sTransport == "local")
+            return hjw::net::transport::local;
+        if(sTransport == "shm")
+            return hjw::net::transport::shm;
+        return hjw::net::transport::tcp;
+    }
+};
+
+static hjw::net::message<BenchMsgTypes> MakeMessage(BenchMsgTypes id, size_t nPayload, uint32_t nAck = 0) {
+    hjw::net::message<BenchMsgTypes> msg;
+    msg.header.id = id;
+    msg.body.resize(nPayload > sizeof(bench_stamp) ? nPayload - sizeof(bench_stamp) : 0);
+    msg << bench_stamp{hjw::net::MetricNow(), nAck};
+    return msg;
+}
+
+class bench_server : public hjw::net::server_interface<BenchMsgTypes> {
+    public:
+        bench_server(uint16_t nPort) : hjw::net::server_interface<BenchMsgTypes>(nPort) {}
+
+        bench_server(const std::string& sPath, hjw::net::transport eTransport)
+            : hjw::net::server_interface<BenchMsgTypes>(sPath, eTransport) {}
+
+        // dispatch on a thread of our own until StopPump
+        void StartPump() {
+            m_tPump = std::thread([this]() {
+                while(m_bPump.load(std::memory_order_relaxed)) {
+                    if(m_qMessagesIn.wait_for(std::chrono::milliseconds(50)))
+                        update();
+                }
+            });
+        }
+
+        void StopPump() {
+            m_bPump = false;
+            if(m_tPump.joinable())
+                m_tPump.join();
+        }
+
+        void SetStats(bench_stats* pStats) {
+            m_pStats.store(pStats);
+        }
+
+        size_t Validated() const {
+            return m_nValidated.load();
+        }
+
+        void OnClientValidated(std::shared_ptr<hjw::net::connection<BenchMsgTypes>> client) override {
+            m_nValidated++;
+        }
+
+    protected:
+        bool OnClientConnection(std::shared_ptr<hjw::net::connection<BenchMsgTypes>> client) override {
+            return true;
+        }
+
+        void OnMessage(std::shared_ptr<hjw::net::connection<BenchMsgTypes>> client,
+                       const hjw::net::message<BenchMsgTypes>& msg) override {
+            switch(msg.header.id) {
+                case BenchMsgTypes::Echo:
+                    client->Send(msg);
+                    break;
+
+                case BenchMsgTypes::Broadcast:
+                    MessageAllClients(msg);
+                    break;
+
+                case BenchMsgTypes::Stream:
+                {
+                    // msg is const, read the stamp in place rather than copying to pop it
+                    bench_stamp stamp;
+                    std::memcpy(&stamp, msg.body.data() + msg.body.size() - sizeof(stamp), sizeof(stamp));
+
+                    if(bench_stats* pStats = m_pStats.load(std::memory_order_relaxed))
+                        pStats->Record(msg, stamp.nSentNs);
+
+                    if(stamp.nAck) {
+                        hjw::net::message<BenchMsgTypes> ack;
+                        ack.header.id = BenchMsgTypes::StreamAck;
+                        client->Send(ack);
+                    }
+                }
+                break;
+
+                default:
+                break;
+            }
+        }
+
+    private:
+        std::thread m_tPump;
+        std::atomic<bool> m_bPump{true};
+        std::atomic<bench_stats*> m_pStats{nullptr};
+        std::atomic<size_t> m_nValidated{0};
+};
+
+// replies are handled on the client's context thread, which also sends the next message
+class bench_client : public hjw::net::client_interface<BenchMsgTypes> {
+    public:
+        bench_client(bench_stats& stats, size_t nPayload) : m_oStats(stats), m_nPayload(nPayload) {}
+
+        // replies are handled on the context thread, stop it before the members go
+        ~bench_client() {
+            Disconnect();
+        }
+
+        // the fanout publisher paces itself on its own copy of each broadcast
+        void SetPublisher() {
+            m_bPublisher = true;
+        }
+
+        void Start(const std::string& sScenario, size_t nWindow) {
+            size_t nInFlight = nWindow * StripeCount();
+
+            if(sScenario == "echo") {
+                for(size_t i = 0; i < nInFlight; i++)
+                    Send(MakeMessage(BenchMsgTypes::Echo, m_nPayload));
+            }else if(sScenario == "fanout") {
+                if(m_bPublisher)
+                    for(size_t i = 0; i < nWindow; i++)
+                        Send(MakeMessage(BenchMsgTypes::Broadcast, m_nPayload));
+            }else if(sScenario == "stream") {
+                for(size_t i = 0; i < nInFlight; i++)
+                    SendStreamBatch();
+            }
+        }
+
+    protected:
+        bool OnMessage(hjw::net::message<BenchMsgTypes>& msg) override {
+            bool bRunning = m_oStats.bRunning.load(std::memory_order_relaxed);
+
+            switch(msg.header.id) {
+                case BenchMsgTypes::Echo:
+                {
+                    bench_stamp stamp;
+                    msg >> stamp;
+                    m_oStats.Record(msg, stamp.nSentNs);
+                    if(bRunning) {
+                        msg << bench_stamp{hjw::net::MetricNow(), 0};
+                        Send(msg);
+                    }
+                }
+                break;
+
+                case BenchMsgTypes::Broadcast:
+                {
+                    bench_stamp stamp;
+                    msg >> stamp;
+                    m_oStats.Record(msg, stamp.nSentNs);
+                    if(m_bPublisher && bRunning) {
+                        msg << bench_stamp{hjw::net::MetricNow(), 0};
+                        Send(msg);
+                    }
+                }
+                break;
+
+                case BenchMsgTypes::StreamAck:
+                    if(bRunning)
+                        SendStreamBatch();
+                break;
+
+                default:
+                break;
+            }
+            return true;
+        }
+
+    private:
+        // nAckEvery messages, the last one asks for the ack that releases the next batch
+        void SendStreamBatch() {
+            for(uint32_t i = 1; i <= nAckEvery; i++)
+                Send(MakeMessage(BenchMsgTypes::Stream, m_nPayload, i == nAckEvery));
+        }
+
+    private:
+        bench_stats& m_oStats;
+        size_t m_nPayload;
+        bool m_bPublisher = false;
+};
+
+// one line per run, numbers only so they diff cleanly across builds
+static void PrintResult(const bench_config& config, const std::string& sScenario, size_t nPayload,
+                        size_t nConnections, double fSeconds, const bench_stats& stats, bool& bHeader) {
+    hjw::net::histogram_snapshot h = stats.hLatencyNs.Snapshot();
+    int64_t nMessages = stats.nMessages.Value();
+    int64_t nBytes = stats.nBytes.Value();
+    double fMsgsPerSec = fSeconds > 0 ? double(nMessages) / fSeconds : 0.0;
+    double fMBPerSec = fSeconds > 0 ? double(nBytes) / fSeconds / 1e6 : 0.0;
+
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(2);
+
+    if(config.sFormat == "csv") {
+        if(!bHeader) {
+            std::cout << "scenario,transport,reactor,payload,connections,window,nodelay,cork,sndbuf,rcvbuf,busy_poll,"
+                         "threads,seconds,messages,msgs_per_sec,mb_per_sec,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n";
+            bHeader = true;
+        }
+        os << sScenario << "," << config.sTransport << "," << hjw::net::ReactorName() << ","
+           << nPayload << "," << nConnections << "," << config.nWindow << ","
+           << config.oSocketOptions.bNoDelay << "," << config.oSocketOptions.bCork << ","
+           << config.oSocketOptions.nSendBuffer << "," << config.oSocketOptions.nReceiveBuffer << ","
+           << config.oLatency.bBusyPoll << "," << config.oWorkers.nThreads << ","
+           << fSeconds << "," << nMessages << ","
+           << fMsgsPerSec << "," << fMBPerSec << "," << h.Mean() << ","
+           << h.Percentile(0.5) << "," << h.Percentile(0.99) << "," << h.Percentile(0.999) << ","
+           << h.Percentile(1.0) << "\n";
+    }else {
+        os << "{\"scenario\":\"" << sScenario << "\",\"transport\":\"" << config.sTransport
+           << "\",\"reactor\":\"" << hjw::net::ReactorName() << "\",\"payload\":" << nPayload
+           << ",\"connections\":" << nConnections << ",\"window\":" << config.nWindow
+           << ",\"nodelay\":" << config.oSocketOptions.bNoDelay << ",\"cork\":" << config.oSocketOptions.bCork
+           << ",\"sndbuf\":" << config.oSocketOptions.nSendBuffer << ",\"rcvbuf\":" << config.oSocketOptions.nReceiveBuffer
+           << ",\"busy_poll\":" << config.oLatency.bBusyPoll << ",\"threads\":" << config.oWorkers.nThreads
+           << ",\"seconds\":" << fSeconds
+           << ",\"messages\":" << nMessages << ",\"msgs_per_sec\":" << fMsgsPerSec
+           << ",\"mb_per_sec\":" << fMBPerSec << ",\"mean_ns\":" << h.Mean()
+           << ",\"p50_ns\":" << h.Percentile(0.5) << ",\"p99_ns\":" << h.Percentile(0.99)
+           << ",\"p999_ns\":" << h.Percentile(0.999) << ",\"max_ns\":" << h.Percentile(1.0) << "}\n";
+    }
+
+    std::cout << os.str() << std::flush;
+}
+
+// connect everything, wait for the server to validate it all, then measure
+static bool RunScenario(bench_server& server, const bench_config& config, const std::string& sScenario,
+                        size_t nPayload, bool& bHeader) {
+    auto pStats = std::make_unique<bench_stats>();
+    server.SetStats(pStats.get());
+
+    bool bLocal = config.Transport() != hjw::net::transport::tcp;
+    size_t nStripes = bLocal ? 1 : config.nStripes;
+    size_t nValidatedBefore = server.Validated();
+
+    std::vector<std::unique_ptr<bench_client>> vClients;
+    size_t nClients = config.nClients + (sScenario == "fanout" ? 1 : 0);
+    for(size_t i = 0; i < nClients; i++) {
+        auto pClient = std::make_unique<bench_client>(*pStats, nPayload);
+        pClient->SetSocketOptions(config.oSocketOptions);
+        pClient->SetLatency(config.oLatency);
+
+        // the extra fanout client is the publisher and only needs the one connection
+        bool bPublisher = sScenario == "fanout" && i == config.nClients;
+        if(bPublisher)
+            pClient->SetPublisher();
+
+        bool bConnected = bLocal ? pClient->ConnectLocal(config.sPath, config.Transport())
+                                 : pClient->Connect("127.0.0.1", config.nPort, bPublisher ? 1 : nStripes);
+        if(!bConnected) {
+            std::cerr << "connect failed\n";
+            return false;
+        }
+        vClients.push_back(std::move(pClient));
+    }
+
+    // sending before the handshake completes would interleave with it
+    size_t nConnections = config.nClients * nStripes + (sScenario == "fanout" ? 1 : 0);
+    auto tDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+    while(server.Validated() - nValidatedBefore < nConnections) {
+        if(std::chrono::steady_clock::now() > tDeadline) {
+            std::cerr << "only " << server.Validated() - nValidatedBefore << " of " << nConnections << " connections validated\n";
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    for(auto& pClient : vClients)
+        pClient->Start(sScenario, config.nWindow);
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(config.fWarmup));
+
+    pStats->bRecording = true;
+    auto tStart = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(config.fSeconds));
+    pStats->bRecording = false;
+    double fElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+
+    // let whatever is in flight land before tearing the clients down
+    pStats->bRunning = false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    for(auto& pClient : vClients)
+        pClient->Disconnect();
+    vClients.clear();
+    server.SetStats(nullptr);
+
+    PrintResult(config, sScenario, nPayload, nConnections, fElapsed, *pStats, bHeader);
+    return true;
+}
+
+// thousands of connections need more descriptors than the usual soft limit
+static void RaiseFileLimit() {
+    rlimit limit;
+    if(::getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static std::vector<std::string> SplitList(const std::string& sList) {
+    std::vector<std::string> vItems;
+    std::stringstream ss(sList);
+    std::string sItem;
+    while(std::getline(ss, sItem, ','))
+        if(!sItem.empty())
+            vItems.push_back(sItem);
+    return vItems;
+}
+
+int main(int argc, char** argv) {
+    bench_config config;
+    std::string sScenarios;
+    std::string sSizes;
+    int nNoDelay = 1;
+
+    po::options_description desc("NetBenchmark options");
+    desc.add_options()
+        ("help,h", "show this help")
+        ("scenario", po::value<std::string>(&sScenarios)->default_value("echo,fanout,stream"), "comma separated: echo, fanout, stream")
+        ("sizes", po::value<std::string>(&sSizes)->default_value("16,64,256,1024,4096,16384"), "comma separated payload sizes in bytes")
+        ("transport", po::value<std::string>(&config.sTransport)->default_value("tcp"), "tcp, local or shm")
+        ("port", po::value<uint16_t>(&config.nPort)->default_value(60500), "tcp port")
+        ("path", po::value<std::string>(&config.sPath)->default_value("/tmp/hjw_net_bench.sock"), "socket path for local and shm")
+        ("clients", po::value<size_t>(&config.nClients)->default_value(1), "client interfaces, each with its own context thread")
+        ("stripes", po::value<size_t>(&config.nStripes)->default_value(1), "tcp connections per client")
+        ("window", po::value<size_t>(&config.nWindow)->default_value(1), "messages in flight per connection")
+        ("seconds", po::value<double>(&config.fSeconds)->default_value(2.0), "measured time per run")
+        ("warmup", po::value<double>(&config.fWarmup)->default_value(0.5), "unmeasured time before each run")
+        ("format", po::value<std::string>(&config.sFormat)->default_value("json"), "json (one object per line) or csv")
+        ("nodelay", po::value<int>(&nNoDelay)->default_value(1), "TCP_NODELAY")
+        ("cork", po::bool_switch(&config.oSocketOptions.bCork), "cork sockets around write batches")
+        ("sndbuf", po::value<int>(&config.oSocketOptions.nSendBuffer)->default_value(0), "SO_SNDBUF, 0 for the default")
+        ("rcvbuf", po::value<int>(&config.oSocketOptions.nReceiveBuffer)->default_value(0), "SO_RCVBUF, 0 for the default")
+        ("backlog", po::value<int>(&config.oSocketOptions.nBacklog)->default_value(0), "listen backlog, 0 for the default")
+        ("busy-poll", po::bool_switch(&config.oLatency.bBusyPoll), "spin context threads on poll()")
+        ("quickack", po::bool_switch(&config.oLatency.bQuickAck), "TCP_QUICKACK")
+        ("threads", po::value<size_t>(&config.oWorkers.nThreads)->default_value(1), "server worker threads, connections are balanced across them");
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    }catch(std::exception& e) {
+        std::cerr << e.what() << "\n" << desc << "\n";
+        return 1;
+    }
+
+    if(vm.count("help")) {
+        std::cout << desc << "\n";
+        return 0;
+    }
+
+    config.oSocketOptions.bNoDelay = nNoDelay != 0;
+    config.vScenarios = SplitList(sScenarios);
+    for(auto& sSize : SplitList(sSizes))
+        config.vSizes.push_back(std::stoul(sSize));
+
+    // per connection logging would swamp the results
+    hjw::net::SetLogLevel(hjw::net::log_level::warn);
+    RaiseFileLimit();
+
+    std::unique_ptr<bench_server> pServer;
+    if(config.Transport() == hjw::net::transport::tcp)
+        pServer = std::make_unique<bench_server>(config.nPort);
+    else
+        pServer = std::make_unique<bench_server>(config.sPath, config.Transport());
+
+    pServer->SetSocketOptions(config.oSocketOptions);
+    pServer->SetLatency(config.oLatency);
+    pServer->SetWorkers(config.oWorkers);
+    if(!pServer->Start())
+        return 1;
+    pServer->StartPump();
+
+    bool bHeader = false;
+    int nResult = 0;
+    for(auto& sScenario : config.vScenarios) {
+        for(size_t nPayload : config.vSizes) {
+            if(!RunScenario(*pServer, config, sScenario, nPayload, bHeader)) {
+                nResult = 1;
+                break;
+            }
+        }
+    }
+
+    pServer->StopPump();
+    pServer->Stop();
+    hjw::net::FlushLog();
+    return nResult;
+}
@@ -0,0 +1,384 @@
+// Load generator for a hjw::net server speaking the SimpleServer protocol.
+//
+// Connections are opened in blocks, each block is one client_interface striped over
+// --block connections, so every block costs one context thread and 20000 connections
+// at the default block size take 20 threads.
+//
+// The run ramps up to --connections over --ramp-up seconds, holds for --hold seconds
+// and ramps back down over --ramp-down seconds. The ramp moves a block at a time, a
+// block opens once a whole --block of connections is due, or the rest at the peak. While connected each connection sends
+// --rate messages a second, raised by --rate-step every --step-seconds, picked from the
+// --mix of pings, message-alls and custom messages.
+//
+// Sending is open loop: every message has a time it is meant to go out at, whether or
+// not earlier replies have come back, and that intended time is what the message
+// carries. Latency of an echoed message is measured from it, so time the generator
+// spent stalled behind a slow server counts against the server rather than vanishing
+// (coordinated omission).
+//
+// One JSON line per --interval seconds and a summary line at the end.
+//
+//  LoadClient --host 127.0.0.1 --port 60000 --connections 20000 --rate 2 --rate-step 2
+
+#include <hjw_net.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace po = boost::program_options;
+
+enum class CustomMsgTypes : uint32_t // so each type id is 4 bytes
+{
+    ServerAccept,
+    ServerDeny,
+    ServerPing,
+    MessageAll,
+    ServerMessage
+};
+
+struct load_config {
+    std::string sHost = "127.0.0.1";
+    uint16_t nPort = 60000;
+    size_t nConnections = 1000;
+    size_t nBlock = 1000;
+    double fRampUp = 10.0;
+    double fHold = 30.0;
+    double fRampDown = 5.0;
+    double fRate = 1.0;
+    double fRateStep = 0.0;
+    double fStepSeconds = 10.0;
+    double fInterval = 1.0;
+    unsigned nPingWeight = 100;
+    unsigned nAllWeight = 0;
+    unsigned nCustomWeight = 0;
+    uint32_t nCustomId = 100;
+    size_t nCustomSize = 64;
+    std::chrono::microseconds tTick{1000};
+};
+
+// shared by every block, all recording is sharded per thread
+struct load_stats {
+    std::atomic<double> fRate{0.0};
+    hjw::net::metric_counter nSent;
+    hjw::net::metric_counter nSkipped;
+    hjw::net::metric_counter nEchoed;
+    hjw::net::metric_counter nBroadcasts;
+    hjw::net::metric_histogram hLatencyNs;
+};
+
+// one block of connections on one context thread, sending on a timer
+class load_client : public hjw::net::client_interface<CustomMsgTypes> {
+    public:
+        load_client(const load_config& config, load_stats& stats, uint32_t nSeed)
+            : m_oConfig(config), m_oStats(stats), m_oRandom(nSeed), m_oTimer(m_oContext) {}
+
+        ~load_client() {
+            Disconnect();
+        }
+
+        bool Start(size_t nConnections) {
+            if(!Connect(m_oConfig.sHost, m_oConfig.nPort, nConnections))
+                return false;
+
+            asio::post(m_oContext, [this]() {
+                m_nNextNs = hjw::net::MetricNow();
+                Tick();
+            });
+            return true;
+        }
+
+    protected:
+        bool OnMessage(hjw::net::message<CustomMsgTypes>& msg) override {
+            if(msg.header.id == CustomMsgTypes::ServerMessage) {
+                m_oStats.nBroadcasts.Add();
+                return true;
+            }
+
+            bool bEchoed = msg.header.id == CustomMsgTypes::ServerPing || uint32_t(msg.header.id) == m_oConfig.nCustomId;
+            if(bEchoed && msg.body.size() >= sizeof(uint64_t)) {
+                uint64_t nIntendedNs = 0;
+                msg >> nIntendedNs;
+                uint64_t nNow = hjw::net::MetricNow();
+                m_oStats.hLatencyNs.Record(nNow > nIntendedNs ? nNow - nIntendedNs : 0);
+                m_oStats.nEchoed.Add();
+            }
+            return true;
+        }
+
+    private:
+        // ASYNC - send everything whose intended time has passed, then re-arm
+        void Tick() {
+            double fRate = m_oStats.fRate.load(std::memory_order_relaxed) * double(StripeCount());
+            uint64_t nNow = hjw::net::MetricNow();
+
+            if(fRate > 0) {
+                uint64_t nGapNs = std::max<uint64_t>(1, uint64_t(1e9 / fRate));
+
+                // a generator that fell far behind catches up over several ticks rather than
+                // starving the context, the intended times still say when each message was due
+                for(size_t i = 0; i < 10000 && m_nNextNs <= nNow; i++) {
+                    SendOne(m_nNextNs);
+                    m_nNextNs += nGapNs;
+                }
+            }else {
+                m_nNextNs = nNow;
+            }
+
+            m_oTimer.expires_after(m_oConfig.tTick);
+            m_oTimer.async_wait([this](std::error_code ec) {
+                if(!ec)
+                    Tick();
+            });
+        }
+
+        void SendOne(uint64_t nIntendedNs) {
+            if(!IsConnected()) {
+                m_oStats.nSkipped.Add();
+                return;
+            }
+
+            unsigned nTotal = m_oConfig.nPingWeight + m_oConfig.nAllWeight + m_oConfig.nCustomWeight;
+            unsigned nPick = std::uniform_int_distribution<unsigned>(0, nTotal - 1)(m_oRandom);
+
+            hjw::net::message<CustomMsgTypes> msg;
+            if(nPick < m_oConfig.nPingWeight) {
+                msg.header.id = CustomMsgTypes::ServerPing;
+                msg << nIntendedNs;
+            }else if(nPick < m_oConfig.nPingWeight + m_oConfig.nAllWeight) {
+                msg.header.id = CustomMsgTypes::MessageAll;
+            }else {
+                msg.header.id = CustomMsgTypes(m_oConfig.nCustomId);
+                msg.body.resize(m_oConfig.nCustomSize > sizeof(uint64_t) ? m_oConfig.nCustomSize - sizeof(uint64_t) : 0);
+                msg << nIntendedNs;
+            }
+
+            Send(msg);
+            m_oStats.nSent.Add();
+        }
+
+    private:
+        const load_config& m_oConfig;
+        load_stats& m_oStats;
+        std::minstd_rand m_oRandom;
+        asio::steady_timer m_oTimer;
+
+        // intended send time of the next message
+        uint64_t m_nNextNs = 0;
+};
+
+// histogram_snapshot has no subtraction, the interval is the difference of two snapshots
+static hjw::net::histogram_snapshot Difference(const hjw::net::histogram_snapshot& now,
+                                               const hjw::net::histogram_snapshot& before) {
+    hjw::net::histogram_snapshot diff;
+    for(size_t i = 0; i < hjw::net::histogram_snapshot::nBuckets; i++)
+        diff.aBuckets[i] = now.aBuckets[i] - before.aBuckets[i];
+    diff.nCount = now.nCount - before.nCount;
+    diff.nSum = now.nSum - before.nSum;
+    return diff;
+}
+
+static void PrintLine(const char* sKind, double fElapsed, size_t nConnections, double fRate, double fSeconds,
+                      int64_t nSent, int64_t nSkipped, int64_t nEchoed, int64_t nBroadcasts,
+                      const hjw::net::histogram_snapshot& h) {
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(2)
+       << "{\"kind\":\"" << sKind << "\",\"elapsed\":" << fElapsed << ",\"connections\":" << nConnections
+       << ",\"rate_per_connection\":" << fRate << ",\"sent\":" << nSent << ",\"skipped\":" << nSkipped
+       << ",\"echoed\":" << nEchoed << ",\"broadcasts\":" << nBroadcasts
+       << ",\"sent_per_sec\":" << (fSeconds > 0 ? double(nSent) / fSeconds : 0.0)
+       << ",\"echoed_per_sec\":" << (fSeconds > 0 ? double(nEchoed) / fSeconds : 0.0)
+       << ",\"mean_ns\":" << h.Mean() << ",\"p50_ns\":" << h.Percentile(0.5)
+       << ",\"p99_ns\":" << h.Percentile(0.99) << ",\"p999_ns\":" << h.Percentile(0.999)
+       << ",\"max_ns\":" << h.Percentile(1.0) << "}\n";
+    std::cout << os.str() << std::flush;
+}
+
+// thousands of connections need more descriptors than the usual soft limit
+static void RaiseFileLimit() {
+    rlimit limit;
+    if(::getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// connections wanted at fElapsed into the run
+static size_t TargetConnections(const load_config& config, double fElapsed) {
+    double fTotal = double(config.nConnections);
+    if(fElapsed < config.fRampUp)
+        return size_t(fTotal * fElapsed / config.fRampUp) + 1;
+    fElapsed -= config.fRampUp;
+    if(fElapsed < config.fHold)
+        return config.nConnections;
+    fElapsed -= config.fHold;
+    if(fElapsed < config.fRampDown)
+        return size_t(fTotal * (1.0 - fElapsed / config.fRampDown));
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    load_config config;
+    std::string sMix;
+    unsigned nTickUs = 1000;
+
+    po::options_description desc("LoadClient options");
+    desc.add_options()
+        ("help,h", "show this help")
+        ("host", po::value<std::string>(&config.sHost)->default_value("127.0.0.1"), "server address")
+        ("port", po::value<uint16_t>(&config.nPort)->default_value(60000), "server port")
+        ("connections", po::value<size_t>(&config.nConnections)->default_value(1000), "connections at the peak")
+        ("block", po::value<size_t>(&config.nBlock)->default_value(1000), "connections per context thread")
+        ("ramp-up", po::value<double>(&config.fRampUp)->default_value(10.0), "seconds to reach --connections")
+        ("hold", po::value<double>(&config.fHold)->default_value(30.0), "seconds at the peak")
+        ("ramp-down", po::value<double>(&config.fRampDown)->default_value(5.0), "seconds back to none")
+        ("rate", po::value<double>(&config.fRate)->default_value(1.0), "messages per second per connection")
+        ("rate-step", po::value<double>(&config.fRateStep)->default_value(0.0), "added to --rate every --step-seconds")
+        ("step-seconds", po::value<double>(&config.fStepSeconds)->default_value(10.0), "seconds between rate steps")
+        ("mix", po::value<std::string>(&sMix)->default_value("ping=100"), "weights, e.g. ping=80,all=5,custom=15")
+        ("custom-id", po::value<uint32_t>(&config.nCustomId)->default_value(100), "message id of custom messages")
+        ("custom-size", po::value<size_t>(&config.nCustomSize)->default_value(64), "body size of custom messages")
+        ("tick-us", po::value<unsigned>(&nTickUs)->default_value(1000), "send timer period in microseconds")
+        ("interval", po::value<double>(&config.fInterval)->default_value(1.0), "seconds between report lines");
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+    }catch(std::exception& e) {
+        std::cerr << e.what() << "\n" << desc << "\n";
+        return 1;
+    }
+
+    if(vm.count("help")) {
+        std::cout << desc << "\n";
+        return 0;
+    }
+
+    config.nPingWeight = 0;
+    std::stringstream ssMix(sMix);
+    std::string sEntry;
+    while(std::getline(ssMix, sEntry, ',')) {
+        size_t nEquals = sEntry.find('=');
+        if(nEquals == std::string::npos)
+            continue;
+        std::string sName = sEntry.substr(0, nEquals);
+        unsigned nWeight = unsigned(std::stoul(sEntry.substr(nEquals + 1)));
+        if(sName == "ping")
+            config.nPingWeight = nWeight;
+        else if(sName == "all")
+            config.nAllWeight = nWeight;
+        else if(sName == "custom")
+            config.nCustomWeight = nWeight;
+    }
+    if(config.nPingWeight + config.nAllWeight + config.nCustomWeight == 0) {
+        std::cerr << "--mix needs at least one non zero weight\n";
+        return 1;
+    }
+
+    config.nBlock = std::max<size_t>(config.nBlock, 1);
+    config.tTick = std::chrono::microseconds(std::max(nTickUs, 1u));
+
+    hjw::net::SetLogLevel(hjw::net::log_level::warn);
+    RaiseFileLimit();
+
+    load_stats stats;
+    stats.fRate = config.fRate;
+
+    std::vector<std::unique_ptr<load_client>> vBlocks;
+    size_t nConnected = 0;
+    uint32_t nSeed = 1;
+
+    // a block that fails to connect is retried after a doubling wait, the run gives up after a few
+    const unsigned nMaxFailures = 5;
+    unsigned nFailures = 0;
+    auto tNextConnect = std::chrono::steady_clock::now();
+
+    auto tStart = std::chrono::steady_clock::now();
+    auto tLastReport = tStart;
+    auto tInterval = std::chrono::duration<double>(config.fInterval);
+    int64_t nLastSent = 0, nLastSkipped = 0, nLastEchoed = 0, nLastBroadcasts = 0;
+    hjw::net::histogram_snapshot hLast;
+
+    double fTotal = config.fRampUp + config.fHold + config.fRampDown;
+    for(;;) {
+        double fElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+
+        // open or drop whole blocks to follow the ramp
+        size_t nTarget = std::min(TargetConnections(config, fElapsed), config.nConnections);
+        while(nConnected < nTarget && std::chrono::steady_clock::now() >= tNextConnect) {
+            size_t nCount = std::min(config.nBlock, nTarget - nConnected);
+            if(nCount < config.nBlock && fElapsed < config.fRampUp)
+                break;
+
+            auto pBlock = std::make_unique<load_client>(config, stats, nSeed++);
+            if(!pBlock->Start(nCount)) {
+                if(++nFailures >= nMaxFailures) {
+                    std::cerr << "connect failed " << nFailures << " times, giving up\n";
+                    hjw::net::FlushLog();
+                    return 1;
+                }
+                auto tBackoff = std::chrono::milliseconds(100) * (1u << nFailures);
+                std::cerr << "connect failed, retrying in " << tBackoff.count() << " ms\n";
+                tNextConnect = std::chrono::steady_clock::now() + tBackoff;
+                break;
+            }
+            nFailures = 0;
+            nConnected += nCount;
+            vBlocks.push_back(std::move(pBlock));
+        }
+        while(!vBlocks.empty() && nConnected - vBlocks.back()->StripeCount() >= nTarget) {
+            nConnected -= vBlocks.back()->StripeCount();
+            vBlocks.pop_back();
+        }
+
+        // rate only climbs while holding at the peak
+        if(config.fRateStep > 0 && fElapsed > config.fRampUp && config.fStepSeconds > 0) {
+            double fSteps = std::floor(std::min(fElapsed - config.fRampUp, config.fHold) / config.fStepSeconds);
+            stats.fRate = config.fRate + fSteps * config.fRateStep;
+        }
+
+        auto tNow = std::chrono::steady_clock::now();
+        if(tNow - tLastReport >= tInterval) {
+            int64_t nSent = stats.nSent.Value();
+            int64_t nSkipped = stats.nSkipped.Value();
+            int64_t nEchoed = stats.nEchoed.Value();
+            int64_t nBroadcasts = stats.nBroadcasts.Value();
+            hjw::net::histogram_snapshot h = stats.hLatencyNs.Snapshot();
+
+            PrintLine("interval", fElapsed, nConnected, stats.fRate.load(),
+                      std::chrono::duration<double>(tNow - tLastReport).count(),
+                      nSent - nLastSent, nSkipped - nLastSkipped, nEchoed - nLastEchoed,
+                      nBroadcasts - nLastBroadcasts, Difference(h, hLast));
+
+            nLastSent = nSent; nLastSkipped = nSkipped; nLastEchoed = nEchoed; nLastBroadcasts = nBroadcasts;
+            hLast = h;
+            tLastReport = tNow;
+        }
+
+        if(fElapsed >= fTotal && vBlocks.empty())
+            break;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    double fElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+    PrintLine("summary", fElapsed, 0, stats.fRate.load(), fElapsed, stats.nSent.Value(), stats.nSkipped.Value(),
+              stats.nEchoed.Value(), stats.nBroadcasts.Value(), stats.hLatencyNs.Snapshot());
+
+    hjw::net::FlushLog();
+    return 0;
+}
@@ -0,0 +1,90 @@
+// Replays a recording made with server_interface::StartRecording against a live server.
+//
+// Messages the recorded server received are sent again from one client, striped so
+// each recorded connection keeps its own stripe and its messages stay in order. The
+// gaps between messages follow the recording, divided by --speed, or are dropped
+// entirely with --speed 0.
+//
+// Message ids are replayed as plain 32 bit values, so any protocol whose id enum is
+// uint32_t based can be replayed.
+//
+//  ReplayClient --file capture.rec --host 127.0.0.1 --port 60000 --stripes 16 --speed 2
+
+#include <hjw_net.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+namespace po = boost::program_options;
+
+enum class ReplayMsgTypes : uint32_t {};
+
+int main(int argc, char** argv) {
+    std::string sFile;
+    std::string sHost;
+    uint16_t nPort = 60000;
+    size_t nStripes = 1;
+    double fSpeed = 1.0;
+    std::string sDirection;
+
+    po::options_description desc("ReplayClient options");
+    desc.add_options()
+        ("help,h", "show this help")
+        ("file", po::value<std::string>(&sFile)->required(), "recording to replay")
+        ("host", po::value<std::string>(&sHost)->default_value("127.0.0.1"), "server address")
+        ("port", po::value<uint16_t>(&nPort)->default_value(60000), "server port")
+        ("stripes", po::value<size_t>(&nStripes)->default_value(1), "connections to spread recorded connections over")
+        ("speed", po::value<double>(&fSpeed)->default_value(1.0), "1 original pace, 2 twice as fast, 0 no waiting")
+        ("direction", po::value<std::string>(&sDirection)->default_value("in"), "in (sent to the recorded server) or out");
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        if(vm.count("help")) {
+            std::cout << desc << "\n";
+            return 0;
+        }
+        po::notify(vm);
+    }catch(std::exception& e) {
+        std::cerr << e.what() << "\n" << desc << "\n";
+        return 1;
+    }
+
+    hjw::net::message_replayer<ReplayMsgTypes> replayer;
+    if(!replayer.Open(sFile)) {
+        hjw::net::FlushLog();
+        return 1;
+    }
+
+    hjw::net::client_interface<ReplayMsgTypes> client;
+    if(!client.Connect(sHost, nPort, nStripes)) {
+        hjw::net::FlushLog();
+        return 1;
+    }
+
+    hjw::net::record_direction eDirection = sDirection == "out" ? hjw::net::record_direction::out
+                                                                : hjw::net::record_direction::in;
+
+    auto tStart = std::chrono::steady_clock::now();
+    size_t nFrames = replayer.Replay(
+        [&](const hjw::net::record_frame& frame, hjw::net::message<ReplayMsgTypes>& msg) {
+            // library control traffic belongs to the original connections
+            if(msg.header.flags & hjw::net::header_flag::control)
+                return;
+            client.Send(msg, frame.nConnection);
+        }, fSpeed, eDirection);
+    double fSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+
+    // Disconnect drops anything still queued, write it all out first
+    bool bFlushed = client.Flush(std::chrono::seconds(30));
+    client.Disconnect();
+
+    std::cout << "replayed " << nFrames << " messages in " << fSeconds << "s\n";
+    if(!bFlushed)
+        std::cerr << "connection closed or timed out before every message was written\n";
+    hjw::net::FlushLog();
+    return bFlushed ? 0 : 1;
+}
@@ -104,8 +104,9 @@ int main() {
 
     while(!bQuit) {
         if(c.IsConnected()) {
-            if(!c.Incoming().empty()) {
-                auto msg = c.Incoming().pop_front().msg;
+            // sleep until a message arrives, waking now and then to notice quit
+            if(auto msgIn = c.WaitForMessage(std::chrono::milliseconds(100))) {
+                auto& msg = *msgIn;
 
                 switch(msg.header.id) {
                     case CustomMsgTypes::ServerAccept:
@@ -5,8 +5,20 @@
 #include "net_message.hpp"
 #include "net_tsQueue.hpp"
 #include "net_connection.hpp"
+#include "net_udp.hpp"
+#include "net_multicast.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <optional>
+#include <unordered_map>
 #include <exception>
 #include <string>
+#include <thread>
 #include <type_traits>
 
 namespace hjw {
@@ -20,39 +32,128 @@ namespace hjw {
                     // set up asio socket with context
                 }
 
+                // OnMessage, OnSession and OnControlMessage run on the context thread, which is only
+                // stopped here, after a derived class's members are already gone. A class that
+                // overrides them must call Disconnect() in its own destructor
                 virtual ~client_interface() {
                     Disconnect();
                 }
 
             public:
-                // Allow clinet to connect to a server
-                bool Connect(const std::string& host, const uint16_t port) {
+                // Allow clinet to connect to a server. With nStripes above one the client opens that many
+                // connections, Send spreads messages across them and replies from all of them land in
+                // Incoming(). The server sees one logical session, see connection::GetSession. The
+                // first connection is issued the session's token once validated, so a striped
+                // Connect waits up to tStripeWait for it before opening the rest
+                bool Connect(const std::string& host, const uint16_t port, size_t nStripes = 1) {
 
                     try {
+                        // the context is stopped after a previous Disconnect
+                        m_oContext.restart();
+
                         // resolve hostname/ip-address into tangiable physical address
                         asio::ip::tcp::resolver resolver(m_oContext);
                         asio::ip::tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
 
-                        // create connection
-                        m_pConnection = std::make_unique<connection<T>>(
-                            connection<T>::owner::client,
-                            m_oContext, asio::ip::tcp::socket(m_oContext),
-                            m_qMessagesIn);
+                        // create connection, a striping client asks it for a session token
+                        m_pConnection = CreateConnection(transport_stream(m_oContext));
+                        m_nStripeToken = 0;
+                        if(nStripes > 1)
+                            m_pConnection->SetStripe(uint32_t(nStripes), 0);
+                        else if(m_bResume)
+                            m_pConnection->SetResume(m_nResumeToken, m_nResumeSequence);
 
                         // Connect to the server
                         m_pConnection->ConnectToServer(endpoints);
 
                         // start context thread
-                        m_tContextThread = std::thread([this]() {m_oContext.run();});
+                        m_tContextThread = std::thread([this]() {RunContext(m_oContext, m_oLatency);});
+
+                        if(nStripes > 1) {
+                            // the other stripes present the token the server issued to the first
+                            uint64_t nToken = 0;
+                            {
+                                std::unique_lock<std::mutex> ul(m_muxStripe);
+                                m_cvStripe.wait_for(ul, tStripeWait, [this]() {return m_nStripeToken != 0;});
+                                nToken = m_nStripeToken;
+                            }
+                            if(nToken == 0) {
+                                HJW_LOG_ERROR("Client exception : no stripe token from the server");
+                                Disconnect();
+                                return false;
+                            }
+
+                            for(size_t i = 1; i < nStripes; i++) {
+                                m_vStripes.push_back(CreateConnection(transport_stream(m_oContext)));
+                                m_vStripes.back()->SetStripe(uint32_t(nStripes), nToken);
+                                m_vStripes.back()->ConnectToServer(endpoints);
+                            }
+                        }
 
                     }catch (std::exception& e) {
-                        std::cerr << "Client exception : " << e.what() << "\n";
+                        HJW_LOG_ERROR("Client exception : {}", e.what());
                         return false;
                     }
 
                     return true;
                 }
 
+                // Connect to a server on the same host through its AF_UNIX socket path. With
+                // transport::shm the socket only carries setup, messages then go through
+                // shared memory rings, the server must have been opened with the same transport
+                bool ConnectLocal(const std::string& sPath, transport eTransport = transport::local) {
+
+                    try {
+                        m_oContext.restart();
+
+                        stream_socket socket(m_oContext);
+                        socket.connect(asio::local::stream_protocol::endpoint(sPath));
+
+                        if(eTransport == transport::shm) {
+                            auto pShm = shm_stream::Join(m_oContext, socket);
+                            if(!pShm) {
+                                HJW_LOG_ERROR("Client exception : shared memory setup failed");
+                                return false;
+                            }
+                            m_pConnection = CreateConnection(transport_stream(std::move(socket), std::move(pShm)));
+                        }else {
+                            m_pConnection = CreateConnection(transport_stream(std::move(socket)));
+                        }
+                        if(m_bResume)
+                            m_pConnection->SetResume(m_nResumeToken, m_nResumeSequence);
+
+                        // stream is already connected, go straight to validation
+                        m_pConnection->ConnectToServer();
+
+                        // start context thread
+                        m_tContextThread = std::thread([this]() {RunContext(m_oContext, m_oLatency);});
+
+                    }catch (std::exception& e) {
+                        HJW_LOG_ERROR("Client exception : {}", e.what());
+                        return false;
+                    }
+
+                    return true;
+                }
+
+                // Wait up to tTimeout for every message sent so far to be handed to the socket.
+                // Disconnect drops whatever is still queued, so call this first to send it all.
+                // False if messages are left when the time runs out or the connection drops
+                bool Flush(std::chrono::milliseconds tTimeout) {
+                    auto tDeadline = std::chrono::steady_clock::now() + tTimeout;
+                    for(;;) {
+                        size_t nUnwritten = m_pConnection ? m_pConnection->Unwritten() : 0;
+                        for(auto& stripe : m_vStripes)
+                            nUnwritten += stripe->IsConnected() ? stripe->Unwritten() : 0;
+
+                        if(nUnwritten == 0)
+                            return true;
+                        if(!IsConnected() || std::chrono::steady_clock::now() >= tDeadline)
+                            return false;
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                }
+
                 // Disconnect from server
                 void Disconnect() {
                     // if connection exists, disconnect
@@ -60,14 +161,26 @@ namespace hjw {
                         // Disconnect from the server
                         m_pConnection->Disconnect();
                     }
+                    for(auto& stripe : m_vStripes)
+                        stripe->Disconnect();
 
                     // stop asio context and join its thread
                     m_oContext.stop();
                     if(m_tContextThread.joinable())
                         m_tContextThread.join();
 
-                    // release unique pointer for connection object
-                    m_pConnection.release();
+                    // run the closes and the aborted reads and writes they leave behind while the
+                    // connections still exist, so a later Connect does not call into freed ones
+                    m_oContext.restart();
+                    m_oContext.poll();
+
+                    // where to pick the session up from on the next Connect
+                    if(m_pConnection && m_bResume)
+                        m_nResumeSequence = m_pConnection->LastSequence();
+
+                    // destroy the connection object, which closes its socket
+                    m_pConnection.reset();
+                    m_vStripes.clear();
                 }
 
                 // Check if a connection is presnet
@@ -78,10 +191,82 @@ namespace hjw {
                         return false;
                 }
 
-                // send message to server
+                // send message to server, round robin over the stripes when there are several,
+                // so messages sent this way may arrive out of order
                 void Send(const message<T>& msg) {
-                    if(IsConnected())
-                        m_pConnection->Send(msg);
+                    if(m_vStripes.empty()) {
+                        if(IsConnected())
+                            m_pConnection->Send(msg);
+                        return;
+                    }
+
+                    SendOnStripe(m_nNextStripe.fetch_add(1, std::memory_order_relaxed), msg);
+                }
+
+                // send message on the stripe picked by nKey, messages with the same key keep their order
+                void Send(const message<T>& msg, uint64_t nKey) {
+                    SendOnStripe(std::hash<uint64_t>{}(nKey), msg);
+                }
+
+                // number of connections to the server, one unless striped
+                size_t StripeCount() const {
+                    return m_pConnection ? m_vStripes.size() + 1 : 0;
+                }
+
+                // Open a datagram channel to the server alongside the TCP connection, messages
+                // arriving on it land in the same Incoming() queue. Call after Connect so the
+                // context thread is running
+                bool OpenDatagramChannel(const std::string& host, const uint16_t port, uint16_t nLocalPort = 0, udp_config config = {}) {
+                    m_pDatagramChannel = std::make_unique<udp_channel<T>>(m_oContext, m_qMessagesIn, config);
+                    if(!m_pDatagramChannel->Open(nLocalPort) || !m_pDatagramChannel->Connect(host, port)) {
+                        m_pDatagramChannel.reset();
+                        return false;
+                    }
+                    return true;
+                }
+
+                // send message to server over the datagram channel, delivery is best effort
+                void SendDatagram(const message<T>& msg) {
+                    if(m_pDatagramChannel)
+                        m_pDatagramChannel->Send(msg);
+                }
+
+                udp_channel<T>* DatagramChannel() {
+                    return m_pDatagramChannel.get();
+                }
+
+                // Subscribe to a server multicast stream, gaps are recovered over the TCP
+                // connection so call after Connect. Messages land in Incoming()
+                bool JoinMulticast(const std::string& group, uint16_t port, uint32_t nStream = 0, multicast_config config = {}) {
+                    auto pSubscriber = std::make_unique<multicast_subscriber<T>>(m_oContext, m_qMessagesIn, nStream,
+                                            [this](const message<T>& msg) {Send(msg);}, config);
+                    if(!pSubscriber->Join(group, port))
+                        return false;
+
+                    // subscribers are only looked up on the context thread, add them there
+                    asio::post(m_oContext, [this, nStream, pSubscriber = std::move(pSubscriber)]() mutable {
+                        m_mapSubscribers[nStream] = std::move(pSubscriber);
+                    });
+                    return true;
+                }
+
+                // Configure payload compression, must be called before Connect
+                void SetCompression(const compression_config<T>& config) {
+                    m_oCompression = config;
+                }
+
+                // Configure the context thread run mode and socket options, must be called before Connect
+                void SetLatency(const latency_config& config) {
+                    m_oLatency = config;
+                }
+
+                // Configure the socket profile, must be called before Connect
+                void SetSocketOptions(const socket_options& options) {
+                    m_oSocketOptions = options;
+                }
+
+                const compression_stats& CompressionStats() const {
+                    return m_oCompressionStats;
                 }
 
                 // Retrieve queue of messages from server
@@ -89,6 +274,219 @@ namespace hjw {
                     return m_qMessagesIn;
                 }
 
+                // Handle messages with this id on the context thread as they arrive, they skip
+                // OnMessage and Incoming(). Must be called before Connect
+                void SetHandler(T id, std::function<void(message<T>&)> fnHandler) {
+                    m_mapHandlers[id] = std::move(fnHandler);
+                }
+
+                // Block until a message is queued in Incoming() and take it
+                message<T> WaitForMessage() {
+                    m_qMessagesIn.wait();
+                    return TakeMessage();
+                }
+
+                // Wait at most tTimeout for a queued message
+                template <typename Rep, typename Period>
+                std::optional<message<T>> WaitForMessage(const std::chrono::duration<Rep, Period>& tTimeout) {
+                    if(!m_qMessagesIn.wait_for(tTimeout))
+                        return std::nullopt;
+                    return TakeMessage();
+                }
+
+                // Turn on metrics, must be called before Connect
+                void EnableMetrics() {
+                    m_bMetrics = true;
+                }
+
+                // Totals over the client's connection(s), cheap enough to call often
+                metrics_snapshot MetricsSnapshot() {
+                    metrics_snapshot snapshot = m_oMetrics.Snapshot();
+                    snapshot.nIncomingDepth = int64_t(m_qMessagesIn.count());
+                    return snapshot;
+                }
+
+                // Hand a snapshot to fnDump every tPeriod from the context thread, logs it
+                // by default. Call after Connect
+                void DumpMetrics(std::chrono::milliseconds tPeriod,
+                                 std::function<void(const metrics_snapshot&)> fnDump = nullptr) {
+                    if(!fnDump)
+                        fnDump = [](const metrics_snapshot& s) {std::ostringstream os; os << s; HJW_LOG_INFO("[CLIENT] {}", os.str());};
+
+                    asio::post(m_oContext, [this, tPeriod, fnDump = std::move(fnDump)]() mutable {
+                        m_pMetricsTimer = std::make_unique<asio::steady_timer>(m_oContext);
+                        ScheduleMetricsDump(tPeriod, std::move(fnDump));
+                    });
+                }
+
+                // Record every message in and out of the connection(s) to sPath until StopRecording,
+                // see net_recorder.hpp. Can be started and stopped while connected
+                bool StartRecording(const std::string& sPath) {
+                    return m_oRecorder.Open(sPath);
+                }
+
+                void StopRecording() {
+                    m_oRecorder.Close();
+                }
+
+                const message_recorder<T>& Recorder() const {
+                    return m_oRecorder;
+                }
+
+                // Ask the server for a journaled session, see net_journal.hpp. After a drop, Disconnect
+                // then Connect again and only the messages missed in between are resent. A token
+                // and sequence saved by an earlier process can be passed in. Must be called before
+                // Connect, striped connections are not journaled
+                void EnableResume(uint64_t nToken = 0, uint64_t nLastSequence = 0) {
+                    m_bResume = true;
+                    m_nResumeToken = nToken;
+                    m_nResumeSequence = nLastSequence;
+                }
+
+                // token of the journaled session, 0 until the server has named it
+                uint64_t SessionToken() const {
+                    return m_nResumeToken;
+                }
+
+                // last sequenced message received, as of the last Disconnect
+                uint64_t LastSequence() const {
+                    return m_nResumeSequence;
+                }
+
+                // Handle msg on the context thread as though it had just arrived from the server,
+                // handlers and OnMessage first then Incoming(). Used to replay a recording, call after Connect
+                void Inject(message<T> msg) {
+                    asio::post(m_oContext, [this, msg = std::move(msg)]() mutable {
+                        if(!Dispatch(msg))
+                            m_qMessagesIn.push_back({nullptr, std::move(msg), 0});
+                    });
+                }
+
+            private:
+                std::unique_ptr<connection<T>> CreateConnection(transport_stream stream) {
+                    auto pConnection = std::make_unique<connection<T>>(
+                        connection<T>::owner::client,
+                        m_oContext, std::move(stream),
+                        m_qMessagesIn);
+                    pConnection->SetCompression(&m_oCompression, &m_oCompressionStats);
+                    pConnection->SetLatency(&m_oLatency);
+                    pConnection->SetSocketOptions(&m_oSocketOptions);
+                    if(m_bMetrics)
+                        pConnection->SetMetrics(&m_oMetrics);
+                    pConnection->SetRecorder(&m_oRecorder);
+                    pConnection->SetControlHandler(
+                        [this](std::shared_ptr<connection<T>>, message<T>& msg) {
+                            OnControlMessage(msg);
+                        });
+                    pConnection->SetMessageHandler(
+                        [this](message<T>& msg) {
+                            return Dispatch(msg);
+                        });
+                    return pConnection;
+                }
+
+                message<T> TakeMessage() {
+                    auto owned = m_qMessagesIn.pop_front();
+                    HJW_TRACE_INSTANT("dequeue", 0);
+                    if(owned.nReadNs)
+                        m_oMetrics.hReadToDispatchNs.Record(MetricNow() - owned.nReadNs);
+                    return std::move(owned.msg);
+                }
+
+                // ASYNC - re-arms itself until the context stops
+                void ScheduleMetricsDump(std::chrono::milliseconds tPeriod, std::function<void(const metrics_snapshot&)> fnDump) {
+                    m_pMetricsTimer->expires_after(tPeriod);
+                    m_pMetricsTimer->async_wait(
+                        [this, tPeriod, fnDump = std::move(fnDump)](std::error_code ec) mutable {
+                            if(ec)
+                                return;
+                            fnDump(MetricsSnapshot());
+                            ScheduleMetricsDump(tPeriod, std::move(fnDump));
+                        });
+                }
+
+                // per id handlers first, then OnMessage, whatever neither takes is queued
+                bool Dispatch(message<T>& msg) {
+                    auto it = m_mapHandlers.find(msg.header.id);
+                    if(it != m_mapHandlers.end()) {
+                        HJW_TRACE_SCOPE("handler", 0);
+                        it->second(msg);
+                        return true;
+                    }
+
+                    HJW_TRACE_SCOPE("OnMessage", 0);
+                    return OnMessage(msg);
+                }
+
+                // the server has named the session, nLast is the next sequence it will send
+                void OnSessionControl(const control_header& control) {
+                    if(!m_pConnection)
+                        return;
+
+                    resume_result eResult = resume_result(control.nStream);
+                    uint64_t nLost = 0;
+                    if(eResult == resume_result::partial)
+                        nLost = control.nLast - 1 - m_pConnection->LastSequence();
+
+                    m_nResumeToken = control.nFirst;
+                    m_pConnection->ResetSequence(control.nLast);
+                    OnSession(eResult, nLost);
+                }
+
+                // stripe 0 is m_pConnection, skip stripes that have dropped
+                void SendOnStripe(size_t nPick, const message<T>& msg) {
+                    size_t nCount = StripeCount();
+                    for(size_t i = 0; i < nCount; i++) {
+                        size_t nStripe = (nPick + i) % nCount;
+                        connection<T>* pStripe = nStripe == 0 ? m_pConnection.get() : m_vStripes[nStripe - 1].get();
+                        if(pStripe->IsConnected()) {
+                            pStripe->Send(msg);
+                            return;
+                        }
+                    }
+                }
+
+            protected:
+                // Called on the context thread for each message from the server connection(s) without
+                // a handler. Return true once handled, false queues it in Incoming(). Datagram and
+                // multicast messages always go to Incoming()
+                virtual bool OnMessage(message<T>& msg) {
+                    return false;
+                }
+
+                // Called on the context thread when the server has started or resumed the journaled
+                // session, ahead of any resent message. nLost messages are gone for good after a
+                // partial resume, partial and expired both need an application level resync
+                virtual void OnSession(resume_result eResult, uint64_t nLost) {
+
+                }
+
+                // Called on the context thread for header_flag::control messages
+                virtual void OnControlMessage(message<T>& msg) {
+                    if(msg.body.size() < sizeof(control_header))
+                        return;
+
+                    control_header control;
+                    msg >> control;
+
+                    if(control.nType == control_type::session) {
+                        OnSessionControl(control);
+                        return;
+                    }
+
+                    // Connect is waiting to open the other stripes
+                    if(control.nType == control_type::stripe) {
+                        std::scoped_lock lock(m_muxStripe);
+                        m_nStripeToken = control.nFirst;
+                        m_cvStripe.notify_all();
+                        return;
+                    }
+
+                    auto it = m_mapSubscribers.find(control.nStream);
+                    if(it != m_mapSubscribers.end())
+                        it->second->OnControl(control, msg);
+                }
+
             protected:
                 // Client owns its own asio context to handle data transfer
                 asio::io_context m_oContext;
@@ -102,9 +500,51 @@ namespace hjw {
                 // The client has a single instance of connection object, which handles data transfer
                 std::unique_ptr<connection<T>> m_pConnection;
 
+                // further connections to the same server when striping, sharing m_pConnection's session
+                std::vector<std::unique_ptr<connection<T>>> m_vStripes;
+                std::atomic<size_t> m_nNextStripe{0};
+
+                // token the server issued to the first stripe, handed from the context thread to Connect
+                static constexpr std::chrono::seconds tStripeWait{5};
+                std::mutex m_muxStripe;
+                std::condition_variable m_cvStripe;
+                uint64_t m_nStripeToken = 0;
+
+                // Optional best effort channel held next to the TCP connection
+                std::unique_ptr<udp_channel<T>> m_pDatagramChannel;
+
+                // Multicast streams joined by this client, by stream id
+                std::map<uint32_t, std::unique_ptr<multicast_subscriber<T>>> m_mapSubscribers;
+
                 // connection endpoints
                 asio::ip::tcp::endpoint m_oEndpoints;
 
+                // metrics for the connection(s), off until EnableMetrics
+                bool m_bMetrics = false;
+                metrics_registry m_oMetrics;
+                std::unique_ptr<asio::steady_timer> m_pMetricsTimer;
+
+                // capture of the connection(s), idle until StartRecording
+                message_recorder<T> m_oRecorder;
+
+                // journaled session to resume on the next Connect, off until EnableResume
+                bool m_bResume = false;
+                std::atomic<uint64_t> m_nResumeToken{0};
+                uint64_t m_nResumeSequence = 0;
+
+                // per message id handlers, only read on the context thread
+                std::unordered_map<T, std::function<void(message<T>&)>> m_mapHandlers;
+
+                // payload compression settings and counters for the connection
+                compression_config<T> m_oCompression;
+                compression_stats m_oCompressionStats;
+
+                // context thread run mode and socket options for the connection
+                latency_config m_oLatency;
+
+                // socket profile for the connection
+                socket_options m_oSocketOptions;
+
             private:
                 // Thread safe queue of incoming messages from the server
                 tsqueue<owned_message<T>> m_qMessagesIn;
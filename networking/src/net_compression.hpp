@@ -0,0 +1,232 @@
+#ifndef NET_COMPRESSION_H_
+#define NET_COMPRESSION_H_
+
+/**
+ * Optional payload compression for connection<T>.
+ *
+ * A body is compressed on the sending context thread when the message id has been
+ * selected, or the body is above a size threshold, and the peer advertised that it
+ * can inflate during the validation handshake. Compressed bodies are flagged with
+ * header_flag::compressed and carry the raw body size in their first 4 bytes.
+ *
+ * zlib is only used when the build defines HJW_NET_ZLIB, otherwise nothing is ever
+ * compressed and the capability is not advertised.
+ */
+
+#include "net_message.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <unordered_set>
+#include <vector>
+
+#ifdef HJW_NET_ZLIB
+#include <zlib.h>
+#endif
+
+namespace hjw {
+
+    namespace net {
+
+        // capability bits exchanged during the validation handshake
+        namespace capability {
+            constexpr uint32_t compression = 1u << 0; // can inflate header_flag::compressed bodies
+            constexpr uint32_t resume = 1u << 1;      // wants a journaled session, see net_journal.hpp
+        }
+
+        // per server / per client compression settings, shared by all of its connections
+        template <typename T>
+        struct compression_config {
+            bool bEnabled = false;
+
+            // bodies of at least this many bytes are compressed, 0 turns the threshold off
+            uint32_t nMinSize = 1024;
+
+            // bodies of these message ids are compressed whatever their size
+            std::unordered_set<T> setIds;
+
+            // zlib level, 1 is fastest
+            int nLevel = 1;
+
+            bool ShouldCompress(const message<T>& msg) const {
+                if(!bEnabled || msg.body.empty())
+                    return false;
+
+                if(nMinSize > 0 && msg.body.size() >= nMinSize)
+                    return true;
+
+                return setIds.count(msg.header.id) > 0;
+            }
+        };
+
+        // counters are only written from context threads, relaxed ordering is enough
+        struct compression_stats {
+            std::atomic<uint64_t> nCompressed{0};       // messages sent compressed
+            std::atomic<uint64_t> nSkipped{0};          // selected but did not shrink
+            std::atomic<uint64_t> nDecompressed{0};     // messages inflated on receive
+            std::atomic<uint64_t> nRawBytes{0};         // body bytes before deflate
+            std::atomic<uint64_t> nCompressedBytes{0};  // body bytes after deflate
+            std::atomic<uint64_t> nCompressNs{0};       // wall time spent in deflate
+            std::atomic<uint64_t> nDecompressNs{0};     // wall time spent in inflate
+
+            // compressed / raw, lower is better
+            double Ratio() const {
+                uint64_t nRaw = nRawBytes.load(std::memory_order_relaxed);
+                if(nRaw == 0)
+                    return 1.0;
+                return double(nCompressedBytes.load(std::memory_order_relaxed)) / double(nRaw);
+            }
+        };
+
+        // Owns one deflate and one inflate stream plus a scratch buffer, all reused
+        // across messages. Not thread safe, each connection holds its own.
+        class compressor {
+            public:
+                // refuse to inflate anything claiming to be larger than this
+                static constexpr uint32_t nMaxRawSize = 64u * 1024u * 1024u;
+
+                compressor() = default;
+                compressor(const compressor&) = delete;
+
+                ~compressor() {
+                #ifdef HJW_NET_ZLIB
+                    if(m_bDeflateInit)
+                        deflateEnd(&m_zDeflate);
+                    if(m_bInflateInit)
+                        inflateEnd(&m_zInflate);
+                #endif
+                }
+
+                static constexpr bool Available() {
+                #ifdef HJW_NET_ZLIB
+                    return true;
+                #else
+                    return false;
+                #endif
+                }
+
+                // Replace body with its compressed form, returns false and leaves the
+                // body untouched if it could not be made smaller
+                bool Compress(std::vector<uint8_t>& body, int nLevel, compression_stats& stats) {
+                #ifdef HJW_NET_ZLIB
+                    auto tStart = std::chrono::steady_clock::now();
+
+                    if(!m_bDeflateInit) {
+                        std::memset(&m_zDeflate, 0, sizeof(m_zDeflate));
+                        // negative window bits gives a raw deflate stream, no zlib header or checksum
+                        if(deflateInit2(&m_zDeflate, nLevel, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                            return false;
+                        m_bDeflateInit = true;
+                        m_nLevel = nLevel;
+                    }else {
+                        deflateReset(&m_zDeflate);
+                        if(nLevel != m_nLevel) {
+                            deflateParams(&m_zDeflate, nLevel, Z_DEFAULT_STRATEGY);
+                            m_nLevel = nLevel;
+                        }
+                    }
+
+                    uint32_t nRaw = uint32_t(body.size());
+
+                    // only worth sending if it beats the raw body including the size prefix
+                    size_t nLimit = body.size() - 1;
+                    m_vScratch.resize(std::max(deflateBound(&m_zDeflate, nRaw), uLong(nLimit)) + sizeof(uint32_t));
+                    std::memcpy(m_vScratch.data(), &nRaw, sizeof(uint32_t));
+
+                    m_zDeflate.next_in = body.data();
+                    m_zDeflate.avail_in = nRaw;
+                    m_zDeflate.next_out = m_vScratch.data() + sizeof(uint32_t);
+                    m_zDeflate.avail_out = uInt(m_vScratch.size() - sizeof(uint32_t));
+
+                    int nResult = deflate(&m_zDeflate, Z_FINISH);
+                    size_t nOut = sizeof(uint32_t) + m_zDeflate.total_out;
+
+                    stats.nCompressNs.fetch_add(ElapsedNs(tStart), std::memory_order_relaxed);
+
+                    if(nResult != Z_STREAM_END || nOut > nLimit) {
+                        stats.nSkipped.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    }
+
+                    m_vScratch.resize(nOut);
+
+                    // swap rather than copy, the old body allocation becomes the next scratch buffer
+                    body.swap(m_vScratch);
+
+                    stats.nCompressed.fetch_add(1, std::memory_order_relaxed);
+                    stats.nRawBytes.fetch_add(nRaw, std::memory_order_relaxed);
+                    stats.nCompressedBytes.fetch_add(nOut, std::memory_order_relaxed);
+                    return true;
+                #else
+                    return false;
+                #endif
+                }
+
+                // Replace a compressed body with the original, returns false on corrupt input
+                bool Decompress(std::vector<uint8_t>& body, compression_stats& stats) {
+                #ifdef HJW_NET_ZLIB
+                    if(body.size() < sizeof(uint32_t))
+                        return false;
+
+                    auto tStart = std::chrono::steady_clock::now();
+
+                    if(!m_bInflateInit) {
+                        std::memset(&m_zInflate, 0, sizeof(m_zInflate));
+                        if(inflateInit2(&m_zInflate, -MAX_WBITS) != Z_OK)
+                            return false;
+                        m_bInflateInit = true;
+                    }else {
+                        inflateReset(&m_zInflate);
+                    }
+
+                    uint32_t nRaw = 0;
+                    std::memcpy(&nRaw, body.data(), sizeof(uint32_t));
+                    if(nRaw > nMaxRawSize)
+                        return false;
+
+                    m_vScratch.resize(nRaw);
+
+                    m_zInflate.next_in = body.data() + sizeof(uint32_t);
+                    m_zInflate.avail_in = uInt(body.size() - sizeof(uint32_t));
+                    m_zInflate.next_out = m_vScratch.data();
+                    m_zInflate.avail_out = nRaw;
+
+                    int nResult = inflate(&m_zInflate, Z_FINISH);
+
+                    stats.nDecompressNs.fetch_add(ElapsedNs(tStart), std::memory_order_relaxed);
+
+                    if(nResult != Z_STREAM_END || m_zInflate.total_out != nRaw)
+                        return false;
+
+                    body.swap(m_vScratch);
+
+                    stats.nDecompressed.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                #else
+                    return false;
+                #endif
+                }
+
+            private:
+                static uint64_t ElapsedNs(std::chrono::steady_clock::time_point tStart) {
+                    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                        std::chrono::steady_clock::now() - tStart).count());
+                }
+
+            private:
+            #ifdef HJW_NET_ZLIB
+                z_stream m_zDeflate;
+                z_stream m_zInflate;
+            #endif
+                bool m_bDeflateInit = false;
+                bool m_bInflateInit = false;
+                int m_nLevel = 0;
+
+                // reused output buffer, swapped with message bodies
+                std::vector<uint8_t> m_vScratch;
+        };
+    }
+}
+
+#endif // NET_COMPRESSION_H_
@@ -4,8 +4,20 @@
 #include "net_utils.hpp"
 #include "net_tsQueue.hpp"
 #include "net_message.hpp"
+#include "net_compression.hpp"
+#include "net_transport.hpp"
+#include "net_latency.hpp"
+#include "net_socket_options.hpp"
+#include "net_metrics.hpp"
+#include "net_trace.hpp"
+#include "net_recorder.hpp"
+#include "net_journal.hpp"
+#include <atomic>
 #include <chrono>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 namespace hjw {
 
@@ -15,6 +27,20 @@ namespace hjw {
         template <typename T>
         class server_interface;
 
+        // Exchanged during validation. The server sends its challenge in nValue and the
+        // client returns the scrambled answer, each side also advertises what it supports.
+        // A striping client says how many connections it opens, the first asks for a token the
+        // server issues once it is validated and the rest present it to join the same session.
+        // A client resuming a journaled session sends its token and the last sequence it got.
+        struct handshake {
+            uint64_t nValue = 0;
+            uint32_t nCapabilities = 0; // bits from hjw::net::capability
+            uint32_t nStripes = 0;
+            uint64_t nStripeToken = 0;
+            uint64_t nResumeToken = 0;
+            uint64_t nResumeSequence = 0;
+        };
+
         // enable_shared_from_this allows us to create a shared ptr from within this object,
         // provides a shared pointer to this keyword essentially
         template <typename T>
@@ -22,65 +48,224 @@ namespace hjw {
             public:
                 enum class owner {client, server};
 
-                // We pass the owner of the connectioon, the asio context owned by the owner, the socket owned by the connection,
+                // Receives header_flag::control messages, remote is null on client connections
+                using control_handler = std::function<void(std::shared_ptr<connection<T>>, message<T>&)>;
+
+                // Sees each message before it is queued, returning true consumes it
+                using message_handler = std::function<bool(message<T>&)>;
+
+                // We pass the owner of the connectioon, the asio context owned by the owner, the stream owned by the connection,
                 // and the incoming message queue of the owner
-                connection(owner parent, asio::io_context& asioContext, asio::ip::tcp::socket socket, tsqueue<owned_message<T>>& qIn)
-                    : m_oAsioContext(asioContext), m_oSocket(std::move(socket)), m_qMessagesIn(qIn)
+                connection(owner parent, asio::io_context& asioContext, transport_stream socket, tsqueue<owned_message<T>>& qIn)
+                    : m_oSocket(std::move(socket)), m_pAsioContext(&asioContext), m_qMessagesIn(qIn)
                 {
                     m_nOwnerType = parent;
 
                     // construct validation check data
                     if(m_nOwnerType == owner::server) {
                         // construct random data for client to recieve, transform and send back
-                        m_nHandshakeOut = uint64_t(std::chrono::system_clock::now().time_since_epoch().count());
+                        m_oHandshakeOut.nValue = uint64_t(std::chrono::system_clock::now().time_since_epoch().count());
 
                         // scramble server side to check against client response
-                        m_nHandshakeCheck = Scramble(m_nHandshakeOut);
-                    }else {
-                        // connection is client to server, so dont define anything
-                        m_nHandshakeIn = 0;
-                        m_nHandshakeOut = 0;
+                        m_nHandshakeCheck = Scramble(m_oHandshakeOut.nValue);
                     }
+
+                    // advertise what this side can decode
+                    if(compressor::Available())
+                        m_oHandshakeOut.nCapabilities |= capability::compression;
                 }
 
                 virtual ~connection() {}
 
                 uint32_t GetID() {return id;}
 
+                // Logical session this connection belongs to. Connections striped by one client
+                // share the id of the first of them, otherwise it is the connection's own id.
+                // Valid once validated
+                uint32_t GetSession() const {
+                    return m_nSession ? m_nSession : id;
+                }
+
+                // Set by the server as it validates the connection
+                void SetSession(uint32_t nSession) {
+                    m_nSession = nSession;
+                }
+
+                // Set by a striping client before connecting, nToken of 0 asks the server for one
+                void SetStripe(uint32_t nStripes, uint64_t nToken) {
+                    m_oHandshakeOut.nStripes = nStripes;
+                    m_oHandshakeOut.nStripeToken = nToken;
+                }
+
+                // Set by the owning interface before the connection is started, the config
+                // and stats are owned by the interface and shared by all of its connections
+                void SetCompression(const compression_config<T>* pConfig, compression_stats* pStats) {
+                    m_pCompression = pConfig;
+                    m_pCompressionStats = pStats;
+                }
+
+                // Set by the owning interface, socket options are applied once the connection is up
+                void SetLatency(const latency_config* pConfig) {
+                    m_pLatency = pConfig;
+                }
+
+                void SetSocketOptions(const socket_options* pOptions) {
+                    m_pSocketOptions = pOptions;
+                }
+
+                // Set by the owning interface when metrics are on, the registry is shared by its connections
+                void SetMetrics(metrics_registry* pMetrics) {
+                    m_pMetrics = pMetrics;
+                }
+
+                // Set by the owning interface, messages are recorded while its recorder is open
+                void SetRecorder(message_recorder<T>* pRecorder) {
+                    m_pRecorder = pRecorder;
+                }
+
+                // Set by a client before connecting to ask for a journaled session, nToken of 0
+                // starts a new one, see net_journal.hpp
+                void SetResume(uint64_t nToken, uint64_t nLastSequence) {
+                    m_oHandshakeOut.nCapabilities |= capability::resume;
+                    m_oHandshakeOut.nResumeToken = nToken;
+                    m_oHandshakeOut.nResumeSequence = nLastSequence;
+                    m_nLastSequence = nLastSequence;
+                }
+
+                // what the peer put in its handshake, valid once validated
+                const handshake& PeerHandshake() const {
+                    return m_oHandshakeIn;
+                }
+
+                // Set by the server on the context thread once the session is known, messages
+                // sent from then on are numbered and kept
+                void SetJournal(std::shared_ptr<message_journal<T>> pJournal, uint64_t nToken = 0) {
+                    std::scoped_lock lock(m_muxSendBox);
+                    m_pJournal = std::move(pJournal);
+                    m_nJournalToken = nToken;
+                }
+
+                // token of the journaled session on server connections, 0 when not journaled.
+                // Valid from OnClientValidated, see server_interface::MessageJournaled
+                uint64_t JournalToken() const {
+                    return m_nJournalToken;
+                }
+
+                // last sequenced message received, client connections only
+                uint64_t LastSequence() const {
+                    return m_nLastSequence;
+                }
+
+                // the server started a new session or resumed from nNext, called on the context thread
+                void ResetSequence(uint64_t nNext) {
+                    m_nLastSequence = nNext ? nNext - 1 : 0;
+                }
+
+                // this connection's own totals, only counted while metrics are on
+                const connection_metrics& Metrics() const {
+                    return m_oMetrics;
+                }
+
+                // Set by the owning interface, control messages are dropped when there is no handler
+                void SetControlHandler(control_handler fnHandler) {
+                    m_fnControl = std::move(fnHandler);
+                }
+
+                // Set by the owning interface to dispatch on the context thread instead of queueing
+                void SetMessageHandler(message_handler fnHandler) {
+                    m_fnMessage = std::move(fnHandler);
+                }
+
             public:
                 // called by only clients
                 void ConnectToServer(const asio::ip::tcp::resolver::results_type& endpoints) {
                     // only clients can connect to server
                     if(m_nOwnerType == owner::client) {
+                        // the stream is protocol agnostic, so hand asio generic endpoints
+                        std::vector<asio::generic::stream_protocol::endpoint> vEndpoints;
+                        for(auto& entry : endpoints)
+                            vEndpoints.emplace_back(entry.endpoint());
+
                         // Request asio to attempt to connect to endpoints
                         // connecting endpoint to socket
-                        asio::async_connect(m_oSocket, endpoints,
-                            [this](std::error_code ec, asio::ip::tcp::endpoint endpoint) {
+                        asio::async_connect(m_oSocket.socket(), vEndpoints,
+                            [this](std::error_code ec, asio::generic::stream_protocol::endpoint endpoint) {
                                 if(!ec) {
+                                    ConfigureSocket();
+
                                     // was : ReadHeader();
                                     //
                                     // now we want to read the validation data from the server
                                     // then scramble and send back
                                     ReadValidation();
                                 }else {
-                                    std::cerr << "[" << id << "] Failed to connect to server.\n";
+                                    HJW_LOG_WARN("[{}] Failed to connect to server.", id);
                                     m_oSocket.close();
                                 }
                             });
                     }
                 }
 
+                // called by only clients, for a stream that is already connected such as a local or shm transport
+                void ConnectToServer() {
+                    if(m_nOwnerType == owner::client && m_oSocket.is_open()) {
+                        ConfigureSocket();
+                        ReadValidation();
+                    }
+                }
+
+                // the transport this connection runs over
+                transport GetTransport() const {
+                    return m_oSocket.kind();
+                }
+
                 // called by both clients and server
                 void Disconnect() {
                     if(IsConnected()) {
                         // the asio context will close the socket when it is appropriate
-                        asio::post(m_oAsioContext, [this]() {m_oSocket.close();});
+                        Post([this]() {m_oSocket.close();});
                     }
                 }
 
-                // is the connection open
+                // called by the server when its journaled session resumes on another connection. The
+                // journal is let go on this connection's own context, where its writes read it
+                void DetachJournal() {
+                    Post([this]() {
+                        SetJournal(nullptr);
+                        if(m_oSocket.is_open())
+                            m_oSocket.close();
+                    });
+                }
+
+                // is the connection open, a connection moving between contexts stays open
                 bool IsConnected() const {
-                    return m_oSocket.is_open();
+                    return m_bMigrating.load(std::memory_order_acquire) || m_oSocket.is_open();
+                }
+
+                // the context the connection currently runs on
+                asio::io_context* Context() const {
+                    return m_pAsioContext.load(std::memory_order_acquire);
+                }
+
+                // Move the connection to asioContext, called by the server to balance its threads.
+                // The move happens between two incoming messages once nothing is being written, so
+                // the connection has to receive something first. Shm connections stay put
+                void Migrate(asio::io_context& asioContext) {
+                    Post([this, pTarget = &asioContext]() {
+                        if(!m_bHandshakeDone || pTarget == Context() || m_oSocket.kind() == transport::shm)
+                            return;
+                        m_pMigrateTo = pTarget;
+                    });
+                }
+
+                // messages read and written since the last call, the server's measure of how busy it is
+                uint64_t TakeLoad() {
+                    return m_nLoad.exchange(0, std::memory_order_relaxed);
+                }
+
+                // messages passed to Send that have not been handed to the socket yet
+                size_t Unwritten() const {
+                    return m_nUnwritten.load(std::memory_order_acquire);
                 }
 
                 // is called by the server interface when we create a new connection
@@ -88,6 +273,7 @@ namespace hjw {
                     if(m_nOwnerType == owner::server) {
                         if(m_oSocket.is_open()) {
                             id = uid;
+                            ConfigureSocket();
 
                             // now we want to write validation data to new connections
                             WriteValidation();
@@ -102,21 +288,191 @@ namespace hjw {
             public:
                 // send message over connection
                 bool Send(const message<T>& msg) {
-                    // Send a job to the asio context as a lambda function
-                    asio::post(m_oAsioContext,
-                        [this, msg]() {
-                            // are messages already being written
-                            bool bWritingMessages = !m_qMessagesOut.empty();
-                            m_qMessagesOut.push_back(msg);
-
-                            // if messages arent being written then we can prime asio with writing header
-                            // wanting to avoid multiple write header work load
-                            if(!bWritingMessages)
-                                WriteHeader();
-                        });
+                    HJW_TRACE_INSTANT("send", id);
+                    uint64_t nEnqueued = m_pMetrics ? MetricNow() : 0;
+
+                    // Messages wait here in order and whichever context owns the connection when the
+                    // drain runs takes them, so a migration cannot reorder them. Only the send that
+                    // finds the box empty posts a drain, the rest ride along with it. A journaled session
+                    // numbers the message here, in the same order, so it is kept before Send returns
+                    bool bPostDrain = false;
+                    {
+                        std::scoped_lock lock(m_muxSendBox);
+                        bPostDrain = m_vSendBox.empty();
+                        m_vSendBox.push_back({msg, nEnqueued});
+                        m_nUnwritten.fetch_add(1, std::memory_order_relaxed);
+                        if(m_pJournal)
+                            m_pJournal->Stamp(m_vSendBox.back().msg);
+                    }
+
+                    if(bPostDrain)
+                        Post([this]() {DrainSendBox();});
+
+                    return true;
                 }
 
             private:
+                // Run fn on the connection's context. If the connection moved before fn ran, fn
+                // follows it to the new context
+                template <typename Fn>
+                void Post(Fn&& fn) {
+                    asio::io_context* pContext = Context();
+                    asio::post(*pContext, [this, pContext, fn = std::forward<Fn>(fn)]() mutable {
+                        if(pContext != Context()) {
+                            Post(std::move(fn));
+                            return;
+                        }
+                        fn();
+                    });
+                }
+
+                // context thread, move everything sent so far onto the outgoing queue
+                void DrainSendBox() {
+                    {
+                        std::scoped_lock lock(m_muxSendBox);
+                        m_vSendBox.swap(m_vSending);
+                    }
+
+                    for(auto& pending : m_vSending)
+                        QueueOutgoing(std::move(pending.msg), pending.nEnqueued);
+                    m_vSending.clear();
+                }
+
+                void QueueOutgoing(message<T> msg, uint64_t nEnqueued) {
+                    if(m_pRecorder)
+                        m_pRecorder->Record(id, record_direction::out, msg);
+
+                    // compress here so the connection's zlib streams are only used by the context thread
+                    CompressOutgoing(msg);
+
+                    m_qMessagesOut.push_back(std::move(msg));
+
+                    if(m_pMetrics) {
+                        m_dqEnqueueTimes.push_back(nEnqueued);
+                        m_oMetrics.nOutgoingDepth.fetch_add(1, std::memory_order_relaxed);
+                        m_pMetrics->nOutgoingDepth.Add();
+                    }
+
+                    // if messages arent being written then we can prime asio with writing header
+                    // wanting to avoid multiple write header work load. Until the handshake
+                    // is done messages only queue, so they cannot interleave with it
+                    if(!m_bWriting && m_bHandshakeDone)
+                        BeginWriteBatch();
+                }
+
+                // A message has been delivered, read the next one unless a move is pending. The
+                // move waits for the write in flight, the rest of the queue goes along with it
+                void ReadNextHeader() {
+                    if(m_pMigrateTo) {
+                        m_bReadParked = true;
+                        if(!m_bWriting)
+                            MoveToContext();
+                        return;
+                    }
+                    ReadHeader();
+                }
+
+                // nothing is in flight, hand the socket to the new context and carry on there
+                void MoveToContext() {
+                    asio::io_context* pTarget = m_pMigrateTo;
+                    m_pMigrateTo = nullptr;
+                    m_bReadParked = false;
+
+                    m_bMigrating.store(true, std::memory_order_release);
+                    asio::error_code ec;
+                    bool bMoved = m_oSocket.move_to(*pTarget, ec);
+                    if(bMoved)
+                        m_pAsioContext.store(pTarget, std::memory_order_release);
+                    m_bMigrating.store(false, std::memory_order_release);
+
+                    if(!bMoved) {
+                        HJW_LOG_WARN("[{}] Migrate fail: {}", id, ec.message());
+                        m_oSocket.close();
+                        return;
+                    }
+
+                    HJW_TRACE_INSTANT("migrated", id);
+                    if(m_pMetrics)
+                        m_pMetrics->nMigrations.Add();
+
+                    // anything posted to the old context from here on follows, see Post. A
+                    // DrainSendBox posted straight to the target may run first and already
+                    // have started the write chain
+                    asio::post(*pTarget, [this]() {
+                        ReadHeader();
+                        if(!m_bWriting && !m_qMessagesOut.empty())
+                            BeginWriteBatch();
+                    });
+                }
+
+                // socket options from the interface's profile and latency_config, nothing to do on shm
+                void ConfigureSocket() {
+                    transport eTransport = m_oSocket.kind();
+                    if(eTransport == transport::shm)
+                        return;
+
+                    if(m_pSocketOptions) {
+                        ApplySocketOptions(m_oSocket.socket(), *m_pSocketOptions);
+                        m_bCork = m_pSocketOptions->bCork && eTransport == transport::tcp;
+                    }
+
+                    if(m_pLatency) {
+                        ApplySocketOptions(m_oSocket.socket(), *m_pLatency);
+                        m_bQuickAck = m_pLatency->bQuickAck && eTransport == transport::tcp;
+                    }
+                }
+
+                // the outgoing queue has gone from empty to not empty
+                void BeginWriteBatch() {
+                    // hold segments back until the batch is written
+                    if(m_bCork)
+                        SetCork(m_oSocket.socket(), true);
+                    m_bWriting = true;
+                    WriteHeader();
+                }
+
+                // validation has completed, flush anything sent while it was in progress
+                void HandshakeDone() {
+                    m_bHandshakeDone = true;
+                    if(!m_qMessagesOut.empty())
+                        BeginWriteBatch();
+                }
+
+                // the outgoing queue has drained, let the kernel send what it held back
+                void EndWriteBatch() {
+                    m_bWriting = false;
+                    if(m_bCork)
+                        SetCork(m_oSocket.socket(), false);
+
+                    if(m_pMetrics) {
+                        m_pMetrics->hWriteBatch.Record(m_nBatchMessages);
+                        m_nBatchMessages = 0;
+                    }
+                }
+
+                // the front of the outgoing queue has been handed to the socket
+                void MessageWritten() {
+                    m_nLoad.fetch_add(1, std::memory_order_relaxed);
+                    m_nUnwritten.fetch_sub(1, std::memory_order_release);
+                    if(!m_pMetrics)
+                        return;
+
+                    uint64_t nBytes = sizeof(message_header<T>) + m_qMessagesOut.front().body.size();
+                    m_oMetrics.Add(m_oMetrics.nBytesOut, nBytes);
+                    m_oMetrics.Add(m_oMetrics.nMessagesOut, 1);
+                    m_oMetrics.nOutgoingDepth.fetch_sub(1, std::memory_order_relaxed);
+                    m_pMetrics->nBytesOut.Add(nBytes);
+                    m_pMetrics->nMessagesOut.Add();
+                    m_pMetrics->nOutgoingDepth.Sub();
+                    m_nBatchMessages++;
+
+                    // metrics may have been turned on with messages already queued
+                    if(!m_dqEnqueueTimes.empty()) {
+                        m_pMetrics->hEnqueueToWriteNs.Record(MetricNow() - m_dqEnqueueTimes.front());
+                        m_dqEnqueueTimes.pop_front();
+                    }
+                }
+
                 // ASYNC - Prime context ready to read message header
                 void ReadHeader() {
                     // reading from the particular socket associated with the connection
@@ -124,18 +480,23 @@ namespace hjw {
                     asio::async_read(m_oSocket, asio::buffer(&m_msgTemporaryIn.header, sizeof(message_header<T>)),
                         [this](std::error_code ec, std::size_t length) {
                             if(!ec) {
+                                HJW_TRACE_INSTANT("read_header", id);
+                                if(m_bQuickAck)
+                                    RearmQuickAck(m_oSocket.socket());
+
                                 // Assuming the full message has been read
-                                if(m_msgTemporaryIn.header.size > 8) {
-                                    m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size - 8);
+                                if(m_msgTemporaryIn.header.size > sizeof(message_header<T>)) {
+                                    m_msgTemporaryIn.body.resize(m_msgTemporaryIn.header.size - sizeof(message_header<T>));
                                     ReadBody();
                                 }else {
                                     // if no message body then we pass the message to the incoming queue
+                                    m_msgTemporaryIn.body.clear();
                                     AddToIncomingMessageQueue();
                                 }
                             }else {
                                 // if error occurs then we force close the socket
                                 // therefore closing the connection
-                                std::cout << "[" << id << "] Read header fail.\n";
+                                HJW_LOG_INFO("[{}] Read header fail.", id);
                                 m_oSocket.close();
                             }
                         });
@@ -148,10 +509,11 @@ namespace hjw {
                     asio::async_read(m_oSocket, asio::buffer(m_msgTemporaryIn.body.data(), m_msgTemporaryIn.body.size()),
                         [this](std::error_code ec, std::size_t length) {
                             if(!ec) {
+                                HJW_TRACE_INSTANT("read_body", id);
                                 AddToIncomingMessageQueue();
                             }else {
                                 // force close socket if failed to read body
-                                std::cout << "[" << id << "] Read body fail.\n";
+                                HJW_LOG_INFO("[{}] Read body fail.", id);
                                 m_oSocket.close();
                             }
                         });
@@ -167,19 +529,32 @@ namespace hjw {
                                 if(m_qMessagesOut.front().body.size() > 0) {
                                     WriteBody();
                                 }else {
+                                    HJW_TRACE_INSTANT("write_complete", id);
+                                    MessageWritten();
                                     m_qMessagesOut.pop_front();
-
-                                    if(!m_qMessagesOut.empty())
-                                        WriteHeader();
+                                    WriteNext();
                                 }
                             }else {
                                 // force close socket if write fails
-                                std::cout << "[" << id << "] Write head fail.\n";
+                                HJW_LOG_INFO("[{}] Write head fail.", id);
                                 m_oSocket.close();
                             }
                         });
                 }
 
+                // call WriteHeader if there is another message to be writen, unless the reads are
+                // parked for a move, which this write was holding up
+                void WriteNext() {
+                    if(m_bReadParked) {
+                        EndWriteBatch();
+                        MoveToContext();
+                    }else if(!m_qMessagesOut.empty()) {
+                        WriteHeader();
+                    }else {
+                        EndWriteBatch();
+                    }
+                }
+
                 // ASYNC - Prime conetxt to write message body
                 void WriteBody() {
                     // now writing the body to the socket
@@ -187,34 +562,119 @@ namespace hjw {
                         [this](std::error_code ec, std::size_t length) {
                             if(!ec) {
                                 // after message is read by async_write we will then pop the message
+                                HJW_TRACE_INSTANT("write_complete", id);
+                                MessageWritten();
                                 m_qMessagesOut.pop_front();
-
-                                // call WriteHeader if there is another message to be writen
-                                if(!m_qMessagesOut.empty())
-                                    WriteHeader();
+                                WriteNext();
                             }else {
                                 // force close socket if write fails
-                                std::cout << "[" << id << "] Write body fail.\n";
+                                HJW_LOG_INFO("[{}] Write body fail.", id);
                                 m_oSocket.close();
                             }
                         });
                 }
 
                 void AddToIncomingMessageQueue() {
+                    m_nLoad.fetch_add(1, std::memory_order_relaxed);
+                    uint64_t nReadNs = 0;
+                    if(m_pMetrics) {
+                        nReadNs = MetricNow();
+                        uint64_t nBytes = sizeof(message_header<T>) + m_msgTemporaryIn.body.size();
+                        m_oMetrics.Add(m_oMetrics.nBytesIn, nBytes);
+                        m_oMetrics.Add(m_oMetrics.nMessagesIn, 1);
+                        m_pMetrics->nBytesIn.Add(nBytes);
+                        m_pMetrics->nMessagesIn.Add();
+                    }
+
+                    // restore compressed bodies before anyone else sees the message
+                    if(m_msgTemporaryIn.header.flags & header_flag::compressed) {
+                        if(!m_pCompressionStats || !m_oCompressor.Decompress(m_msgTemporaryIn.body, *m_pCompressionStats)) {
+                            HJW_LOG_WARN("[{}] Decompress fail.", id);
+                            m_oSocket.close();
+                            return;
+                        }
+
+                        m_msgTemporaryIn.header.flags &= ~header_flag::compressed;
+                        m_msgTemporaryIn.header.size = m_msgTemporaryIn.size();
+                    }
+
+                    // strip the session sequence, anything already seen was resent on resume
+                    if(m_msgTemporaryIn.header.flags & header_flag::sequenced) {
+                        if(m_msgTemporaryIn.body.size() < sizeof(uint64_t)) {
+                            HJW_LOG_WARN("[{}] Bad sequenced message.", id);
+                            m_oSocket.close();
+                            return;
+                        }
+
+                        uint64_t nSequence = 0;
+                        m_msgTemporaryIn >> nSequence;
+                        m_msgTemporaryIn.header.flags &= ~header_flag::sequenced;
+
+                        if(nSequence <= m_nLastSequence) {
+                            ReadNextHeader();
+                            return;
+                        }
+                        m_nLastSequence = nSequence;
+                    }
+
+                    if(m_pRecorder)
+                        m_pRecorder->Record(id, record_direction::in, m_msgTemporaryIn);
+
+                    // library messages go to the owner, not the incoming queue
+                    if(m_msgTemporaryIn.header.flags & header_flag::control) {
+                        if(m_fnControl)
+                            m_fnControl(m_nOwnerType == owner::server ? this->shared_from_this() : nullptr, m_msgTemporaryIn);
+
+                        ReadNextHeader();
+                        return;
+                    }
+
+                    // the owner handled it directly, skip the queue
+                    if(m_fnMessage) {
+                        uint64_t nDispatchNs = m_pMetrics ? MetricNow() : 0;
+                        HJW_TRACE_SCOPE("dispatch", id);
+                        if(m_fnMessage(m_msgTemporaryIn)) {
+                            if(m_pMetrics)
+                                m_pMetrics->hReadToDispatchNs.Record(nDispatchNs - nReadNs);
+
+                            ReadNextHeader();
+                            return;
+                        }
+                    }
+
+                    HJW_TRACE_INSTANT("enqueue", id);
+
                     // If the connection owner is a server, then we want to transform the
                     // message into an owned message
                     if(m_nOwnerType == owner::server) {
                         // using an initialiser list with a shared pointer to this connection objject
                         // we can push the message as a owned message
-                        m_qMessagesIn.push_back({this->shared_from_this(), m_msgTemporaryIn});
+                        m_qMessagesIn.push_back({this->shared_from_this(), m_msgTemporaryIn, nReadNs});
                     }else {
                         // if the owner is a client then tagging the message makes no sense
                         // as clients only own one connection
-                        m_qMessagesIn.push_back({nullptr, m_msgTemporaryIn});
+                        m_qMessagesIn.push_back({nullptr, m_msgTemporaryIn, nReadNs});
                     }
 
                     // always called after we read a message, so prime asio again to read
-                    ReadHeader();
+                    ReadNextHeader();
+                }
+
+                // Deflate an outgoing body if the config selects it and the peer can inflate it
+                void CompressOutgoing(message<T>& msg) {
+                    if(!m_pCompression || !m_pCompressionStats)
+                        return;
+
+                    if(!(m_oHandshakeIn.nCapabilities & capability::compression))
+                        return;
+
+                    if(!m_pCompression->ShouldCompress(msg))
+                        return;
+
+                    if(m_oCompressor.Compress(msg.body, m_pCompression->nLevel, *m_pCompressionStats)) {
+                        msg.header.flags |= header_flag::compressed;
+                        msg.header.size = msg.size();
+                    }
                 }
 
                 // Scramble validation data
@@ -227,14 +687,16 @@ namespace hjw {
 
                 // ASYNC - used by both client and server to write validtion data
                 void WriteValidation() {
-                    asio::async_write(m_oSocket, asio::buffer(&m_nHandshakeOut, sizeof(uint64_t)),
+                    asio::async_write(m_oSocket, asio::buffer(&m_oHandshakeOut, sizeof(handshake)),
                         [this](std::error_code ec, std::size_t length) {
                             if(!ec) {
                                 // Validation data sent so clients sit and wait for response
-                                if(m_nOwnerType == owner::client)
+                                if(m_nOwnerType == owner::client) {
+                                    HandshakeDone();
                                     ReadHeader();
+                                }
                             }else {
-                                std::cerr << "[" << id << "] failed to write validation.\n";
+                                HJW_LOG_WARN("[{}] failed to write validation.", id);
                                 m_oSocket.close();
                             }
                         });
@@ -243,41 +705,49 @@ namespace hjw {
                 // ASYNC - used by the server and client
                 // pass server pointer incase we want to check if clinet has been validated
                 void ReadValidation(hjw::net::server_interface<T>* server = nullptr) {
-                    asio::async_read(m_oSocket, asio::buffer(&m_nHandshakeIn, sizeof(uint64_t)),
+                    asio::async_read(m_oSocket, asio::buffer(&m_oHandshakeIn, sizeof(handshake)),
                         [this, server](std::error_code ec, std::size_t length) {
                             if(!ec) {
                                 if(m_nOwnerType == owner::client) {
                                     // client connection so solve data using scramble
-                                    m_nHandshakeOut = Scramble(m_nHandshakeIn);
+                                    m_oHandshakeOut.nValue = Scramble(m_oHandshakeIn.nValue);
 
                                     // write the result
                                     WriteValidation();
                                 }else {
                                     // server connection so check against client data
-                                    if(m_nHandshakeIn == m_nHandshakeCheck) {
-                                        std::cout << "Client validated.\n";
+                                    if(m_oHandshakeIn.nValue == m_nHandshakeCheck && server->JoinSession(this->shared_from_this())) {
+                                        HJW_TRACE_INSTANT("validated", id);
+                                        HJW_LOG_INFO("Client validated.");
+                                        server->BindSession(this->shared_from_this());
+                                        HandshakeDone();
                                         server->OnClientValidated(this->shared_from_this());
 
                                         // now sit waiting the read data
                                         ReadHeader();
                                     }else {
-                                        std::cout << "Client Disconnetced [ReadValidation]\n";
+                                        HJW_TRACE_INSTANT("validation_failed", id);
+                                        HJW_LOG_INFO("Client Disconnetced [ReadValidation]");
+                                        if(m_pMetrics)
+                                            m_pMetrics->nValidationFailures.Add();
                                         m_oSocket.close();
                                     }
                                 }
                             }else {
-                                std::cout << "Client Disconnetced [ReadValidation]\n";
+                                HJW_LOG_INFO("Client Disconnetced [ReadValidation]");
+                                if(m_pMetrics)
+                                    m_pMetrics->nValidationFailures.Add();
                                 m_oSocket.close();
                             }
                         });
                 }
 
             protected:
-                // Each connection has a unique socket
-                asio::ip::tcp::socket m_oSocket;
+                // Each connection has a unique socket, or shared memory rings for the shm transport
+                transport_stream m_oSocket;
 
-                // asio context provided by the client or server interface
-                asio::io_context& m_oAsioContext;
+                // asio context provided by the client or server interface, changes when the server migrates the connection
+                std::atomic<asio::io_context*> m_pAsioContext;
 
                 // Queue for all messages to be sent to remote side of this connection
                 tsqueue<message<T>> m_qMessagesOut;
@@ -293,10 +763,73 @@ namespace hjw {
                 uint32_t id = 0;
 
                 // Handshake validation
-                uint64_t m_nHandshakeOut = 0; // used by the connection to send out
-                uint64_t m_nHandshakeIn = 0; // what the connection has recieved to scramble
+                handshake m_oHandshakeOut; // used by the connection to send out
+                handshake m_oHandshakeIn; // what the connection has recieved to scramble, and the peer's capabilities
+                uint32_t m_nSession = 0; // logical session on server connections, see GetSession
                 uint64_t m_nHandshakeCheck = 0; // what the server uses to validate
 
+                // Payload compression, config and stats are owned by the interface
+                const compression_config<T>* m_pCompression = nullptr;
+                compression_stats* m_pCompressionStats = nullptr;
+                compressor m_oCompressor;
+
+                // owner hook for header_flag::control messages
+                control_handler m_fnControl;
+
+                // owner hook for everything else, empty means queue it
+                message_handler m_fnMessage;
+
+                // registry owned by the interface, null while metrics are off
+                metrics_registry* m_pMetrics = nullptr;
+
+                // capture of everything in and out, owned by the interface
+                message_recorder<T>* m_pRecorder = nullptr;
+                connection_metrics m_oMetrics;
+                std::deque<uint64_t> m_dqEnqueueTimes; // Send() times of queued messages, context thread only
+                uint64_t m_nBatchMessages = 0;
+
+                // latency settings owned by the interface
+                const latency_config* m_pLatency = nullptr;
+                bool m_bQuickAck = false;
+
+                // socket profile owned by the interface
+                const socket_options* m_pSocketOptions = nullptr;
+                bool m_bCork = false;
+
+                // set once validation completes, messages sent before then wait in m_qMessagesOut
+                bool m_bHandshakeDone = false;
+
+                // outbound journal of the session on server connections, null when not journaled.
+                // Guarded by m_muxSendBox, messages are numbered as they are sent
+                std::shared_ptr<message_journal<T>> m_pJournal;
+                uint64_t m_nJournalToken = 0;
+
+                // last session sequence delivered on client connections
+                uint64_t m_nLastSequence = 0;
+
+                // messages from Send() waiting for the context thread, see DrainSendBox
+                struct pending_send {
+                    message<T> msg;
+                    uint64_t nEnqueued = 0;
+                };
+                std::mutex m_muxSendBox;
+                std::vector<pending_send> m_vSendBox;
+                std::vector<pending_send> m_vSending; // context thread only
+
+                // a write chain is running, context thread only
+                bool m_bWriting = false;
+
+                // migration state, context thread only except m_bMigrating
+                asio::io_context* m_pMigrateTo = nullptr;
+                bool m_bReadParked = false;
+                std::atomic<bool> m_bMigrating{false};
+
+                // messages in and out since the server last sampled it
+                std::atomic<uint64_t> m_nLoad{0};
+
+                // sent and not yet written, waited on by client_interface::Flush
+                std::atomic<size_t> m_nUnwritten{0};
+
         };
     }
 }
@@ -0,0 +1,239 @@
+#ifndef NET_JOURNAL_H_
+#define NET_JOURNAL_H_
+
+/**
+ * Sequenced outbound journal, lets a client that drops pick up where it left off.
+ *
+ * A server with EnableJournal gives every client that asks for it a session, named
+ * by a random 64 bit token. Each message the server sends on that session is
+ * numbered (header_flag::sequenced, the sequence rides on the end of the body) and
+ * a copy is kept in the session's message_journal, a bounded byte ring that is
+ * either anonymous memory or a memory mapped file.
+ *
+ * When the client reconnects it puts its token and the last sequence it received in
+ * the validation handshake. The server answers with a session control message and
+ * then resends everything after that sequence still held by the journal, before any
+ * new traffic. The result tells the client what happened:
+ *
+ *  fresh    - no token was presented, a new session was started
+ *  resumed  - every missed message follows
+ *  partial  - the oldest missed messages were evicted, the rest follow
+ *  expired  - the token is unknown, a new session was started
+ *
+ * Only partial and expired need an application level resync. Sessions whose client
+ * has gone are kept for journal_config::tRetention.
+ *
+ * Message flow is one way, server to client, and a session is a single connection,
+ * striped clients are not journaled.
+ */
+
+#include "net_log.hpp"
+#include "net_message.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace hjw {
+
+    namespace net {
+
+        // carried in control_header::nStream of a control_type::session message
+        enum class resume_result : uint32_t {fresh, resumed, partial, expired};
+
+        struct journal_config {
+            // ring size of each session's journal, a message larger than this is never kept
+            size_t nBytes = 4u << 20;
+
+            // empty keeps journals in anonymous memory, otherwise one mapped file per session in this directory
+            std::string sDirectory;
+
+            // how long a session outlives its connection
+            std::chrono::seconds tRetention{30};
+        };
+
+        struct journal_stats {
+            std::atomic<uint64_t> nSessions{0};  // sessions started
+            std::atomic<uint64_t> nJournaled{0}; // messages numbered and kept
+            std::atomic<uint64_t> nResumed{0};   // reconnects that got everything back
+            std::atomic<uint64_t> nPartial{0};   // reconnects that lost part of the gap
+            std::atomic<uint64_t> nExpired{0};   // reconnects with an unknown token
+            std::atomic<uint64_t> nReplayed{0};  // messages resent on reconnect
+        };
+
+        // stored in front of each message in the ring
+        struct journal_entry {
+            uint64_t nSequence = 0;
+            uint32_t nLength = 0; // message header and body
+            uint32_t nReserved = 0;
+        };
+
+        template <typename T>
+        class message_journal {
+            public:
+                message_journal() = default;
+                message_journal(const message_journal&) = delete;
+
+                ~message_journal() {
+                    if(m_pMap)
+                        ::munmap(m_pMap, m_nCapacity);
+                    if(m_nFd >= 0) {
+                        ::close(m_nFd);
+                        ::unlink(m_sPath.c_str());
+                    }
+                }
+
+                // Map nBytes of ring, anonymous when sPath is empty. The file only backs
+                // the ring, it is removed again when the journal is destroyed
+                bool Open(size_t nBytes, const std::string& sPath = "", journal_stats* pStats = nullptr) {
+                    m_pStats = pStats;
+                    size_t nPage = size_t(::sysconf(_SC_PAGESIZE));
+                    m_nCapacity = (nBytes + nPage - 1) / nPage * nPage;
+
+                    void* p = MAP_FAILED;
+                    if(sPath.empty()) {
+                        p = ::mmap(nullptr, m_nCapacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                    }else {
+                        m_nFd = ::open(sPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+                        if(m_nFd < 0) {
+                            HJW_LOG_ERROR("[JOURNAL] Cannot open {}", sPath);
+                            return false;
+                        }
+                        m_sPath = sPath;
+
+                        if(::ftruncate(m_nFd, off_t(m_nCapacity)) == 0)
+                            p = ::mmap(nullptr, m_nCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_nFd, 0);
+                    }
+
+                    if(p == MAP_FAILED) {
+                        HJW_LOG_ERROR("[JOURNAL] Cannot map {} bytes", m_nCapacity);
+                        m_nCapacity = 0;
+                        return false;
+                    }
+
+                    m_pMap = static_cast<uint8_t*>(p);
+                    return true;
+                }
+
+                // Number msg, keep a copy and mark msg as sequenced. Control messages and
+                // messages that already carry a sequence are left alone
+                void Stamp(message<T>& msg) {
+                    if(msg.header.flags & (header_flag::control | header_flag::sequenced))
+                        return;
+
+                    std::lock_guard<std::mutex> lock(m_muxJournal);
+                    uint64_t nSequence = ++m_nLast;
+                    Keep(nSequence, msg);
+                    if(m_pStats)
+                        m_pStats->nJournaled.fetch_add(1, std::memory_order_relaxed);
+
+                    msg << nSequence;
+                    msg.header.flags |= header_flag::sequenced;
+                }
+
+                // last sequence handed out, 0 before the first message
+                uint64_t Last() {
+                    std::lock_guard<std::mutex> lock(m_muxJournal);
+                    return m_nLast;
+                }
+
+                // oldest sequence still held, Last() + 1 when the journal is empty
+                uint64_t Oldest() {
+                    std::lock_guard<std::mutex> lock(m_muxJournal);
+                    return m_nLast + 1 - m_dqOffsets.size();
+                }
+
+                // Call fn with each held message after nAfter, in order and already stamped.
+                // Returns the first sequence passed to fn, or Last() + 1 if there were none
+                uint64_t Replay(uint64_t nAfter, const std::function<void(const message<T>&)>& fn) {
+                    std::lock_guard<std::mutex> lock(m_muxJournal);
+                    uint64_t nOldest = m_nLast + 1 - m_dqOffsets.size();
+                    uint64_t nFirst = std::max(nAfter + 1, nOldest);
+
+                    message<T> msg;
+                    for(uint64_t nSequence = nFirst; nSequence <= m_nLast; nSequence++) {
+                        const uint8_t* p = m_pMap + m_dqOffsets[nSequence - nOldest];
+                        journal_entry entry;
+                        std::memcpy(&entry, p, sizeof(journal_entry));
+                        p += sizeof(journal_entry);
+
+                        std::memcpy(&msg.header, p, sizeof(message_header<T>));
+                        msg.body.assign(p + sizeof(message_header<T>), p + entry.nLength);
+                        msg << nSequence;
+                        msg.header.flags |= header_flag::sequenced;
+                        fn(msg);
+                    }
+                    return nFirst;
+                }
+
+                size_t Capacity() const {return m_nCapacity;}
+
+            private:
+                // Entries never wrap, when one does not fit before the end it goes to the
+                // start of the ring. Everything past the write cursor is older than
+                // anything before it, so eviction is always oldest first
+                void Keep(uint64_t nSequence, const message<T>& msg) {
+                    size_t nLength = sizeof(message_header<T>) + msg.body.size();
+                    size_t nSize = (sizeof(journal_entry) + nLength + 7) & ~size_t(7);
+
+                    // cannot be kept, nothing older may be replayed past the hole either
+                    if(nSize > m_nCapacity) {
+                        m_dqOffsets.clear();
+                        m_nWrite = 0;
+                        return;
+                    }
+
+                    if(m_nWrite + nSize > m_nCapacity) {
+                        while(!m_dqOffsets.empty() && m_dqOffsets.front() >= m_nWrite)
+                            m_dqOffsets.pop_front();
+                        m_nWrite = 0;
+                    }
+
+                    while(!m_dqOffsets.empty() && m_dqOffsets.front() >= m_nWrite && m_dqOffsets.front() < m_nWrite + nSize)
+                        m_dqOffsets.pop_front();
+
+                    journal_entry entry;
+                    entry.nSequence = nSequence;
+                    entry.nLength = uint32_t(nLength);
+
+                    message_header<T> header = msg.header;
+                    header.size = uint32_t(nLength);
+                    header.flags = 0;
+
+                    uint8_t* p = m_pMap + m_nWrite;
+                    std::memcpy(p, &entry, sizeof(journal_entry));
+                    std::memcpy(p + sizeof(journal_entry), &header, sizeof(message_header<T>));
+                    if(!msg.body.empty())
+                        std::memcpy(p + sizeof(journal_entry) + sizeof(message_header<T>), msg.body.data(), msg.body.size());
+
+                    m_dqOffsets.push_back(m_nWrite);
+                    m_nWrite += nSize;
+                }
+
+            private:
+                // a session can move to a new connection while the old one is still sending
+                std::mutex m_muxJournal;
+
+                uint8_t* m_pMap = nullptr;
+                size_t m_nCapacity = 0;
+                int m_nFd = -1;
+                std::string m_sPath;
+                journal_stats* m_pStats = nullptr;
+
+                // ring offsets of the held messages, the front is sequence m_nLast + 1 - size()
+                std::deque<size_t> m_dqOffsets;
+                size_t m_nWrite = 0;
+                uint64_t m_nLast = 0;
+        };
+    }
+}
+
+#endif // NET_JOURNAL_H_
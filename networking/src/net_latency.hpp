@@ -0,0 +1,122 @@
+#ifndef NET_LATENCY_H_
+#define NET_LATENCY_H_
+
+/**
+ * Low latency run mode for context threads.
+ *
+ * By default a context thread calls io_context::run() and sleeps in the reactor
+ * between events, so every message pays a wake-up. With bBusyPoll the thread spins
+ * on io_context::poll() instead and never sleeps, unless tIdleBackoff is set, in
+ * which case a thread that has been idle that long blocks for at most tIdleBackoff
+ * at a time until work shows up again.
+ *
+ * Only depends on the standard library and the socket API so it works with both
+ * standalone asio (hjw::net) and boost::asio (hjw::wss).
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+namespace hjw {
+
+    namespace net {
+
+        struct latency_config {
+            // spin on poll() rather than sleeping in run()
+            bool bBusyPoll = false;
+
+            // once idle this long a spinning thread sleeps in the reactor, zero spins forever
+            std::chrono::microseconds tIdleBackoff{0};
+
+            // context thread i is pinned to vCores[i % size], empty leaves threads unpinned
+            std::vector<int> vCores;
+
+            // SO_BUSY_POLL in microseconds, the kernel polls the device queue on blocking reads, zero leaves it off
+            int nSocketBusyPollUs = 0;
+
+            // TCP_QUICKACK, ack immediately. The kernel clears it so it is re-armed after every read
+            bool bQuickAck = false;
+        };
+
+        // Pin the calling thread to a core, returns false where unsupported
+        inline bool PinThread(int nCore) {
+        #if defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(nCore, &set);
+            return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+        #else
+            (void)nCore;
+            return false;
+        #endif
+        }
+
+        // Apply the socket level options to a connected socket, options the socket does not
+        // support (TCP options on a local socket for example) are ignored
+        template <typename Socket>
+        void ApplySocketOptions(Socket& socket, const latency_config& config) {
+        #if defined(__linux__)
+            int fd = socket.native_handle();
+            int nOn = 1;
+
+            if(config.bQuickAck)
+                ::setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &nOn, sizeof(nOn));
+
+            if(config.nSocketBusyPollUs > 0)
+                ::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &config.nSocketBusyPollUs, sizeof(config.nSocketBusyPollUs));
+        #else
+            (void)socket; (void)config;
+        #endif
+        }
+
+        // re-arm TCP_QUICKACK after a read
+        template <typename Socket>
+        void RearmQuickAck(Socket& socket) {
+        #if defined(__linux__)
+            int nOn = 1;
+            ::setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_QUICKACK, &nOn, sizeof(nOn));
+        #else
+            (void)socket;
+        #endif
+        }
+
+        // Body of a context thread, nIndex picks the core to pin to. Returns when the
+        // context is stopped or runs out of work, like io_context::run()
+        template <typename Context>
+        void RunContext(Context& context, const latency_config& config, size_t nIndex = 0) {
+            if(!config.vCores.empty())
+                PinThread(config.vCores[nIndex % config.vCores.size()]);
+
+            if(!config.bBusyPoll) {
+                context.run();
+                return;
+            }
+
+            auto tLastWork = std::chrono::steady_clock::now();
+            while(!context.stopped()) {
+                if(context.poll() > 0) {
+                    tLastWork = std::chrono::steady_clock::now();
+                    continue;
+                }
+
+                // been quiet for a while, give the core back until the next event
+                if(config.tIdleBackoff.count() > 0 && std::chrono::steady_clock::now() - tLastWork > config.tIdleBackoff) {
+                    if(context.run_one_for(config.tIdleBackoff) > 0)
+                        tLastWork = std::chrono::steady_clock::now();
+                }
+            }
+        }
+    }
+}
+
+#endif // NET_LATENCY_H_
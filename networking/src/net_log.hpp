@@ -0,0 +1,473 @@
+#ifndef NET_LOG_H_
+#define NET_LOG_H_
+
+/**
+ * Asynchronous leveled logger for the library.
+ *
+ * A logging thread never formats or touches a stream. It copies the format string
+ * pointer and its arguments in binary into its own single producer ring, then a
+ * background thread decodes, formats and writes them. If a ring is full the record
+ * is dropped and counted rather than blocking the caller. A thread's ring is freed
+ * once the thread has exited and its last records are written.
+ *
+ * Levels below HJW_NET_LOG_LEVEL (default info) are removed at compile time, the
+ * HJW_LOG_* macros for them compile to nothing. SetLogLevel raises the bar further
+ * at run time.
+ *
+ *  HJW_LOG_INFO("[SERVER] New connection:{}", sEndpoint);
+ *
+ * The format must be a string literal, each {} takes the next argument. Arguments
+ * may be arithmetic, strings (copied, cut at nLogMaxString bytes) or std::error_code,
+ * whose message is looked up on the background thread. warn and error go to
+ * std::cerr, everything else to std::cout.
+ *
+ * Only needs the standard library so the asio and boost::asio parts both use it.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifndef HJW_NET_LOG_LEVEL
+#define HJW_NET_LOG_LEVEL 2
+#endif
+
+namespace hjw {
+
+    namespace net {
+
+        enum class log_level : int {trace = 0, debug = 1, info = 2, warn = 3, error = 4, off = 5};
+
+        constexpr size_t nLogRingSize = 1u << 18;
+        constexpr size_t nLogMaxString = 4096;
+
+        namespace log_detail {
+
+            // how an argument is stored in a record
+            template <typename A>
+            struct codec {
+                static_assert(std::is_arithmetic_v<A>, "log arguments must be arithmetic, strings or std::error_code");
+
+                static size_t Size(const A&) {return sizeof(A);}
+                static uint8_t* Encode(uint8_t* p, const A& a) {std::memcpy(p, &a, sizeof(A)); return p + sizeof(A);}
+                static const uint8_t* Decode(const uint8_t* p, std::string& out) {
+                    A a;
+                    std::memcpy(&a, p, sizeof(A));
+                    if constexpr (std::is_same_v<A, bool>)
+                        out += a ? "true" : "false";
+                    else if constexpr (std::is_same_v<A, char>)
+                        out += a;
+                    else
+                        out += std::to_string(a);
+                    return p + sizeof(A);
+                }
+            };
+
+            struct string_codec {
+                static size_t Length(std::string_view s) {return s.size() < nLogMaxString ? s.size() : nLogMaxString;}
+                static size_t Size(std::string_view s) {return sizeof(uint32_t) + Length(s);}
+                static uint8_t* Encode(uint8_t* p, std::string_view s) {
+                    uint32_t nLength = uint32_t(Length(s));
+                    std::memcpy(p, &nLength, sizeof(nLength));
+                    std::memcpy(p + sizeof(nLength), s.data(), nLength);
+                    return p + sizeof(nLength) + nLength;
+                }
+                static const uint8_t* Decode(const uint8_t* p, std::string& out) {
+                    uint32_t nLength;
+                    std::memcpy(&nLength, p, sizeof(nLength));
+                    out.append(reinterpret_cast<const char*>(p + sizeof(nLength)), nLength);
+                    return p + sizeof(nLength) + nLength;
+                }
+            };
+
+            template <> struct codec<std::string> : string_codec {};
+            template <> struct codec<std::string_view> : string_codec {};
+            template <> struct codec<const char*> : string_codec {};
+            template <> struct codec<char*> : string_codec {};
+
+            // the category is a static object so only its address and the value are kept
+            template <>
+            struct codec<std::error_code> {
+                static size_t Size(const std::error_code&) {return sizeof(int) + sizeof(const std::error_category*);}
+                static uint8_t* Encode(uint8_t* p, const std::error_code& ec) {
+                    int nValue = ec.value();
+                    const std::error_category* pCategory = &ec.category();
+                    std::memcpy(p, &nValue, sizeof(nValue));
+                    std::memcpy(p + sizeof(nValue), &pCategory, sizeof(pCategory));
+                    return p + Size(ec);
+                }
+                static const uint8_t* Decode(const uint8_t* p, std::string& out) {
+                    int nValue;
+                    const std::error_category* pCategory;
+                    std::memcpy(&nValue, p, sizeof(nValue));
+                    std::memcpy(&pCategory, p + sizeof(nValue), sizeof(pCategory));
+                    out += pCategory->message(nValue);
+                    return p + sizeof(nValue) + sizeof(pCategory);
+                }
+            };
+
+            template <typename A>
+            using codec_for = codec<std::conditional_t<std::is_array_v<std::remove_reference_t<A>>, const char*, std::decay_t<A>>>;
+
+            // copy format text up to the next {}, false when there is none
+            inline bool NextField(const char*& sFormat, std::string& out) {
+                const char* p = std::strstr(sFormat, "{}");
+                if(!p) {
+                    out += sFormat;
+                    sFormat += std::strlen(sFormat);
+                    return false;
+                }
+                out.append(sFormat, p - sFormat);
+                sFormat = p + 2;
+                return true;
+            }
+
+            template <typename... Args>
+            void Format(const char* sFormat, [[maybe_unused]] const uint8_t* pArgs, std::string& out) {
+                ((NextField(sFormat, out), pArgs = codec_for<Args>::Decode(pArgs, out)), ...);
+                out += sFormat;
+            }
+
+            using format_fn = void (*)(const char*, const uint8_t*, std::string&);
+
+            struct record_header {
+                uint32_t nSize; // whole record including this header, 0 marks padding to the ring end
+                log_level eLevel;
+                const char* sFormat;
+                format_fn fnFormat;
+            };
+
+            constexpr size_t Align(size_t n) {return (n + 7) & ~size_t(7);}
+        }
+
+        // Byte ring written by one thread and drained by another, used by the logger and the
+        // message recorder. Records start with their uint32_t size and are 8 byte aligned
+        class log_ring {
+            public:
+                // nCapacity must be a power of two, records larger than it never fit
+                // the storage is left uninitialised, its pages are only touched as records reach them
+                explicit log_ring(size_t nCapacity = nLogRingSize) : m_pData(new uint8_t[nCapacity]), m_nCapacity(nCapacity) {}
+
+                // room for nSize bytes, nullptr when full
+                uint8_t* Reserve(size_t nSize) {
+                    uint64_t nHead = m_nHead.load(std::memory_order_relaxed);
+                    uint64_t nTail = m_nTail.load(std::memory_order_acquire);
+                    size_t nOffset = nHead & (m_nCapacity - 1);
+                    size_t nToEnd = m_nCapacity - nOffset;
+
+                    // records never wrap, pad out the end of the ring and start again at 0
+                    size_t nNeeded = nSize <= nToEnd ? nSize : nToEnd + nSize;
+                    if(nNeeded > m_nCapacity - (nHead - nTail))
+                        return nullptr;
+
+                    if(nSize > nToEnd) {
+                        if(nToEnd >= sizeof(uint32_t))
+                            std::memset(&m_pData[nOffset], 0, sizeof(uint32_t));
+                        m_nPending = nToEnd;
+                        return &m_pData[0];
+                    }
+                    m_nPending = 0;
+                    return &m_pData[nOffset];
+                }
+
+                void Commit(size_t nSize) {
+                    m_nHead.store(m_nHead.load(std::memory_order_relaxed) + m_nPending + nSize, std::memory_order_release);
+                }
+
+                // nothing left to drain, reader only
+                bool Empty() const {
+                    return m_nHead.load(std::memory_order_acquire) == m_nTail.load(std::memory_order_relaxed);
+                }
+
+                // everything written up to here is visible to the reader, reader only
+                uint64_t Written() const {
+                    return m_nHead.load(std::memory_order_acquire);
+                }
+
+                // the oldest record written before nHead, nullptr if there is none. Padding at the
+                // end of the ring is skipped on the way, reader only
+                const uint8_t* Front(uint64_t nHead) {
+                    uint64_t nTail = m_nTail.load(std::memory_order_relaxed);
+                    while(nTail != nHead) {
+                        size_t nOffset = nTail & (m_nCapacity - 1);
+                        size_t nToEnd = m_nCapacity - nOffset;
+                        uint32_t nSize = 0;
+                        if(nToEnd >= sizeof(uint32_t))
+                            std::memcpy(&nSize, &m_pData[nOffset], sizeof(nSize));
+
+                        if(nSize != 0) {
+                            m_nTail.store(nTail, std::memory_order_release);
+                            return &m_pData[nOffset];
+                        }
+                        nTail += nToEnd;
+                    }
+
+                    m_nTail.store(nTail, std::memory_order_release);
+                    return nullptr;
+                }
+
+                // hand the record Front returned back to the writer, reader only
+                void Pop() {
+                    uint64_t nTail = m_nTail.load(std::memory_order_relaxed);
+                    uint32_t nSize = 0;
+                    std::memcpy(&nSize, &m_pData[nTail & (m_nCapacity - 1)], sizeof(nSize));
+                    m_nTail.store(nTail + nSize, std::memory_order_release);
+                }
+
+                // call fn(const uint8_t* record) for everything written so far
+                template <typename Fn>
+                size_t Drain(Fn&& fn) {
+                    uint64_t nTail = m_nTail.load(std::memory_order_relaxed);
+                    uint64_t nHead = m_nHead.load(std::memory_order_acquire);
+                    size_t nRecords = 0;
+
+                    while(nTail != nHead) {
+                        size_t nOffset = nTail & (m_nCapacity - 1);
+                        size_t nToEnd = m_nCapacity - nOffset;
+                        uint32_t nSize = 0;
+                        if(nToEnd >= sizeof(uint32_t))
+                            std::memcpy(&nSize, &m_pData[nOffset], sizeof(nSize));
+
+                        if(nSize == 0) {
+                            nTail += nToEnd;
+                            continue;
+                        }
+
+                        fn(&m_pData[nOffset]);
+                        nTail += nSize;
+                        nRecords++;
+                    }
+
+                    m_nTail.store(nTail, std::memory_order_release);
+                    return nRecords;
+                }
+
+            private:
+                std::unique_ptr<uint8_t[]> m_pData;
+                size_t m_nCapacity;
+                alignas(64) std::atomic<uint64_t> m_nHead{0};
+                alignas(64) std::atomic<uint64_t> m_nTail{0};
+                size_t m_nPending = 0; // padding skipped by the reservation in progress, writer only
+        };
+
+        class logger {
+            public:
+                static logger& Get() {
+                    static logger instance;
+                    return instance;
+                }
+
+                ~logger() {
+                    {
+                        std::scoped_lock lock(m_oMuxWake);
+                        m_bRunning = false;
+                    }
+                    m_cvWake.notify_one();
+                    if(m_tThread.joinable())
+                        m_tThread.join();
+                }
+
+                void SetLevel(log_level eLevel) {
+                    m_eLevel.store(eLevel, std::memory_order_relaxed);
+                }
+
+                bool Enabled(log_level eLevel) const {
+                    return eLevel >= m_eLevel.load(std::memory_order_relaxed);
+                }
+
+                template <typename... Args>
+                void Write(log_level eLevel, const char* sFormat, const Args&... args) {
+                    using log_detail::codec_for;
+                    size_t nSize = log_detail::Align(sizeof(log_detail::record_header) + (size_t(0) + ... + codec_for<Args>::Size(args)));
+
+                    log_ring& ring = ThreadRing();
+                    uint8_t* p = ring.Reserve(nSize);
+                    if(!p) {
+                        m_nDropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+
+                    log_detail::record_header header{uint32_t(nSize), eLevel, sFormat, &log_detail::Format<Args...>};
+                    std::memcpy(p, &header, sizeof(header));
+                    [[maybe_unused]] uint8_t* pArgs = p + sizeof(header);
+                    ((pArgs = codec_for<Args>::Encode(pArgs, args)), ...);
+                    ring.Commit(nSize);
+
+                    // pairs with the fence in Run, either the logger sees the record or we see it asleep
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if(m_bSleeping.load(std::memory_order_relaxed) && m_bSleeping.exchange(false)) {
+                        std::scoped_lock lock(m_oMuxWake);
+                        m_cvWake.notify_one();
+                    }
+                }
+
+                // Block until everything logged before the call has been written
+                void Flush() {
+                    std::unique_lock<std::mutex> ul(m_oMuxWake);
+                    uint64_t nTarget = ++m_nFlushRequested;
+                    m_cvWake.notify_one();
+                    m_cvFlushed.wait(ul, [&]() {return m_nFlushed >= nTarget || !m_bRunning;});
+                }
+
+                // records lost to full rings
+                uint64_t Dropped() const {
+                    return m_nDropped.load(std::memory_order_relaxed);
+                }
+
+            private:
+                logger() {
+                    m_tThread = std::thread([this]() {Run();});
+                }
+
+                // A logging thread's ring, retired when the thread exits and freed by the
+                // logger once what the thread wrote has been drained
+                struct thread_ring {
+                    log_ring oRing;
+                    std::atomic<bool> bRetired{false};
+                };
+
+                // retires the thread's ring from its thread_local destructor
+                struct ring_owner {
+                    thread_ring* pRing = nullptr;
+
+                    ~ring_owner() {
+                        if(pRing)
+                            pRing->bRetired.store(true, std::memory_order_release);
+                    }
+                };
+
+                log_ring& ThreadRing() {
+                    thread_local ring_owner owner;
+                    if(!owner.pRing) {
+                        std::scoped_lock lock(m_oMuxRings);
+                        m_vRings.push_back(std::make_unique<thread_ring>());
+                        owner.pRing = m_vRings.back().get();
+                    }
+                    return owner.pRing->oRing;
+                }
+
+                size_t DrainAll() {
+                    size_t nRecords = 0;
+                    std::scoped_lock lock(m_oMuxRings);
+                    for(auto& pRing : m_vRings) {
+                        // read before draining, a retired ring's thread has written its last record
+                        bool bRetired = pRing->bRetired.load(std::memory_order_acquire);
+                        nRecords += pRing->oRing.Drain([this](const uint8_t* p) {
+                            log_detail::record_header header;
+                            std::memcpy(&header, p, sizeof(header));
+
+                            m_sLine.clear();
+                            header.fnFormat(header.sFormat, p + sizeof(header), m_sLine);
+                            m_sLine += '\n';
+
+                            std::ostream& os = header.eLevel >= log_level::warn ? std::cerr : std::cout;
+                            os.write(m_sLine.data(), std::streamsize(m_sLine.size()));
+                        });
+
+                        if(bRetired)
+                            pRing.reset();
+                    }
+
+                    m_vRings.erase(std::remove(m_vRings.begin(), m_vRings.end(), nullptr), m_vRings.end());
+                    if(nRecords)
+                        std::cout.flush();
+                    return nRecords;
+                }
+
+                bool RingsEmpty() {
+                    std::scoped_lock lock(m_oMuxRings);
+                    return std::all_of(m_vRings.begin(), m_vRings.end(),
+                                       [](const std::unique_ptr<thread_ring>& pRing) {return pRing->oRing.Empty();});
+                }
+
+                void Run() {
+                    while(true) {
+                        bool bRunning = m_bRunning.load();
+                        uint64_t nRequested;
+                        {
+                            std::scoped_lock lock(m_oMuxWake);
+                            nRequested = m_nFlushRequested;
+                        }
+
+                        size_t nRecords = DrainAll();
+
+                        {
+                            std::unique_lock<std::mutex> ul(m_oMuxWake);
+                            if(m_nFlushed < nRequested) {
+                                m_nFlushed = nRequested;
+                                m_cvFlushed.notify_all();
+                            }
+
+                            if(!bRunning)
+                                break;
+
+                            // sleep until the next record, Flush or shutdown. Only the first writer
+                            // to find the logger asleep takes the lock to wake it
+                            if(nRecords == 0) {
+                                m_bSleeping.store(true);
+                                std::atomic_thread_fence(std::memory_order_seq_cst);
+                                if(RingsEmpty()) {
+                                    m_cvWake.wait(ul, [this]() {
+                                        return !m_bSleeping.load() || m_nFlushRequested > m_nFlushed || !m_bRunning.load();
+                                    });
+                                }
+                                m_bSleeping.store(false);
+                            }
+                        }
+                    }
+
+                    std::scoped_lock lock(m_oMuxWake);
+                    m_cvFlushed.notify_all();
+                }
+
+            private:
+                std::atomic<log_level> m_eLevel{log_level(HJW_NET_LOG_LEVEL)};
+                std::atomic<uint64_t> m_nDropped{0};
+
+                std::mutex m_oMuxRings;
+                std::vector<std::unique_ptr<thread_ring>> m_vRings;
+                std::string m_sLine;
+
+                std::mutex m_oMuxWake;
+                std::condition_variable m_cvWake;
+                std::condition_variable m_cvFlushed;
+                uint64_t m_nFlushRequested = 0;
+                uint64_t m_nFlushed = 0;
+
+                std::atomic<bool> m_bSleeping{false}; // Run is waiting for a writer to wake it
+                std::atomic<bool> m_bRunning{true};
+                std::thread m_tThread;
+        };
+
+        inline void SetLogLevel(log_level eLevel) {logger::Get().SetLevel(eLevel);}
+        inline void FlushLog() {logger::Get().Flush();}
+    }
+}
+
+#define HJW_LOG(level, ...) \
+    do { \
+        if constexpr (int(level) >= HJW_NET_LOG_LEVEL) { \
+            if(::hjw::net::logger::Get().Enabled(level)) \
+                ::hjw::net::logger::Get().Write(level, __VA_ARGS__); \
+        } \
+    } while(0)
+
+#define HJW_LOG_TRACE(...) HJW_LOG(::hjw::net::log_level::trace, __VA_ARGS__)
+#define HJW_LOG_DEBUG(...) HJW_LOG(::hjw::net::log_level::debug, __VA_ARGS__)
+#define HJW_LOG_INFO(...) HJW_LOG(::hjw::net::log_level::info, __VA_ARGS__)
+#define HJW_LOG_WARN(...) HJW_LOG(::hjw::net::log_level::warn, __VA_ARGS__)
+#define HJW_LOG_ERROR(...) HJW_LOG(::hjw::net::log_level::error, __VA_ARGS__)
+
+#endif // NET_LOG_H_
@@ -15,6 +15,32 @@ namespace hjw {
         struct message_header {
             T id{};
             uint32_t size = 0; // use unsigned int as size_t could vary on different systems
+            uint32_t flags = 0; // transport flags set and cleared by the connection, see header_flag
+        };
+
+        // bits carried in message_header::flags
+        // these describe how the body travelled over the wire, user code never sees them set
+        namespace header_flag {
+            constexpr uint32_t compressed = 1u << 0; // body is deflated, see net_compression.hpp
+            constexpr uint32_t control = 1u << 1; // library message, body ends with a control_header
+            constexpr uint32_t sequenced = 1u << 2; // body ends with a uint64_t session sequence, see net_journal.hpp
+        }
+
+        enum class control_type : uint32_t {
+            gap_request, // client asks for [nFirst, nLast] of a multicast stream
+            retransmit,  // server resends sequence nFirst, body is the original message body
+            gap_lost,    // server no longer holds [nFirst, nLast]
+            session,     // server names the session, nStream is a resume_result, nFirst the token and nLast the next sequence
+            stripe       // server issues a striped session, nStream is its id and nFirst the token the other stripes join with
+        };
+
+        // Pushed onto the end of a control message body, so it is the first thing popped.
+        // Control messages are consumed by the connection owner and never reach Incoming()
+        struct control_header {
+            control_type nType = control_type::gap_request;
+            uint32_t nStream = 0;
+            uint64_t nFirst = 0;
+            uint64_t nLast = 0;
         };
 
         // message struct containing message header and message body
@@ -100,6 +126,9 @@ namespace hjw {
             std::shared_ptr<connection<T>> remote = nullptr;
             message<T> msg;
 
+            // MetricNow() when it was read off the socket, zero when metrics are off
+            uint64_t nReadNs = 0;
+
             // Overload the output stream operator
             friend std::ostream& operator << (std::ostream& os, owned_message<T>& msg) {
                 os << msg.msg;
@@ -0,0 +1,237 @@
+#ifndef NET_METRICS_H_
+#define NET_METRICS_H_
+
+/**
+ * Metrics for hjw::net servers and clients.
+ *
+ * Counters, gauges and histograms are split into per-thread shards, each thread
+ * adds into its own cache line with a relaxed atomic so the hot path never
+ * contends. Reading sums the shards, which is only done by Snapshot().
+ *
+ * Histograms are log-linear, each power of two is split into 8 linear buckets so
+ * any recorded value is within 12.5% of the bucket it lands in.
+ *
+ * Each interface owns a metrics_registry shared by its connections, connections
+ * also keep their own connection_metrics. Nothing is recorded unless the owner
+ * turned metrics on with EnableMetrics.
+ */
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+namespace hjw {
+
+    namespace net {
+
+        constexpr size_t nMetricShards = 16;
+
+        // shard for the calling thread, threads are handed out shards in turn
+        inline size_t MetricShard() {
+            static std::atomic<size_t> nNext{0};
+            thread_local size_t nShard = nNext.fetch_add(1, std::memory_order_relaxed) % nMetricShards;
+            return nShard;
+        }
+
+        inline uint64_t MetricNow() {
+            return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        // Monotonic count, or with Sub a gauge such as a queue depth
+        class metric_counter {
+            public:
+                void Add(int64_t n = 1) {
+                    m_aShards[MetricShard()].nValue.fetch_add(n, std::memory_order_relaxed);
+                }
+
+                void Sub(int64_t n = 1) {
+                    Add(-n);
+                }
+
+                int64_t Value() const {
+                    int64_t nTotal = 0;
+                    for(auto& shard : m_aShards)
+                        nTotal += shard.nValue.load(std::memory_order_relaxed);
+                    return nTotal;
+                }
+
+            private:
+                struct alignas(64) shard {
+                    std::atomic<int64_t> nValue{0};
+                };
+
+                std::array<shard, nMetricShards> m_aShards;
+        };
+
+        using metric_gauge = metric_counter;
+
+        // Merged view of a histogram
+        struct histogram_snapshot {
+            static constexpr size_t nSubBits = 3;
+            static constexpr size_t nSub = 1u << nSubBits;
+            static constexpr size_t nBuckets = (64 - nSubBits + 1) * nSub;
+
+            std::array<uint64_t, nBuckets> aBuckets{};
+            uint64_t nCount = 0;
+            uint64_t nSum = 0;
+
+            // values below nSub get a bucket each, above that 8 buckets per power of two
+            static size_t Bucket(uint64_t nValue) {
+                if(nValue < nSub)
+                    return size_t(nValue);
+                size_t nExp = 63 - size_t(__builtin_clzll(nValue));
+                size_t nMantissa = size_t(nValue >> (nExp - nSubBits)) & (nSub - 1);
+                return (nExp - nSubBits + 1) * nSub + nMantissa;
+            }
+
+            // smallest value that lands in a bucket
+            static uint64_t BucketFloor(size_t nBucket) {
+                if(nBucket < nSub)
+                    return nBucket;
+                size_t nExp = nBucket / nSub + nSubBits - 1;
+                return (uint64_t(nSub) | (nBucket & (nSub - 1))) << (nExp - nSubBits);
+            }
+
+            // p in [0, 1], returns the floor of the bucket holding that rank
+            uint64_t Percentile(double p) const {
+                if(nCount == 0)
+                    return 0;
+                uint64_t nRank = uint64_t(p * double(nCount - 1)) + 1;
+                uint64_t nSeen = 0;
+                for(size_t i = 0; i < nBuckets; i++) {
+                    nSeen += aBuckets[i];
+                    if(nSeen >= nRank)
+                        return BucketFloor(i);
+                }
+                return BucketFloor(nBuckets - 1);
+            }
+
+            double Mean() const {
+                return nCount ? double(nSum) / double(nCount) : 0.0;
+            }
+        };
+
+        class metric_histogram {
+            public:
+                void Record(uint64_t nValue) {
+                    shard& s = m_aShards[MetricShard()];
+                    s.aBuckets[histogram_snapshot::Bucket(nValue)].fetch_add(1, std::memory_order_relaxed);
+                    s.nSum.fetch_add(nValue, std::memory_order_relaxed);
+                }
+
+                histogram_snapshot Snapshot() const {
+                    histogram_snapshot snap;
+                    for(auto& s : m_aShards) {
+                        for(size_t i = 0; i < histogram_snapshot::nBuckets; i++) {
+                            uint64_t n = s.aBuckets[i].load(std::memory_order_relaxed);
+                            snap.aBuckets[i] += n;
+                            snap.nCount += n;
+                        }
+                        snap.nSum += s.nSum.load(std::memory_order_relaxed);
+                    }
+                    return snap;
+                }
+
+            private:
+                struct alignas(64) shard {
+                    std::array<std::atomic<uint64_t>, histogram_snapshot::nBuckets> aBuckets{};
+                    std::atomic<uint64_t> nSum{0};
+                };
+
+                std::array<shard, nMetricShards> m_aShards;
+        };
+
+        // Per connection totals, only written by the connection's context thread
+        struct connection_metrics {
+            std::atomic<uint64_t> nBytesIn{0};
+            std::atomic<uint64_t> nBytesOut{0};
+            std::atomic<uint64_t> nMessagesIn{0};
+            std::atomic<uint64_t> nMessagesOut{0};
+            std::atomic<int64_t> nOutgoingDepth{0};
+
+            void Add(std::atomic<uint64_t>& counter, uint64_t n) {
+                counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+        };
+
+        // Plain copy of a registry, safe to keep and print
+        struct metrics_snapshot {
+            int64_t nBytesIn = 0;
+            int64_t nBytesOut = 0;
+            int64_t nMessagesIn = 0;
+            int64_t nMessagesOut = 0;
+            int64_t nAccepts = 0;
+            int64_t nRejects = 0;
+            int64_t nValidationFailures = 0;
+            int64_t nMigrations = 0;
+            int64_t nIncomingDepth = 0;
+            int64_t nOutgoingDepth = 0;
+            histogram_snapshot hWriteBatch;
+            histogram_snapshot hEnqueueToWriteNs;
+            histogram_snapshot hReadToDispatchNs;
+
+            friend std::ostream& operator << (std::ostream& os, const metrics_snapshot& s) {
+                os << "bytes_in=" << s.nBytesIn << " bytes_out=" << s.nBytesOut
+                   << " msgs_in=" << s.nMessagesIn << " msgs_out=" << s.nMessagesOut
+                   << " accepts=" << s.nAccepts << " rejects=" << s.nRejects
+                   << " validation_failures=" << s.nValidationFailures
+                   << " migrations=" << s.nMigrations
+                   << " in_depth=" << s.nIncomingDepth << " out_depth=" << s.nOutgoingDepth
+                   << " write_batch_p50=" << s.hWriteBatch.Percentile(0.5)
+                   << " write_batch_max=" << s.hWriteBatch.Percentile(1.0);
+                PrintLatency(os, " enqueue_to_write", s.hEnqueueToWriteNs);
+                PrintLatency(os, " read_to_dispatch", s.hReadToDispatchNs);
+                return os;
+            }
+
+            static void PrintLatency(std::ostream& os, const char* sName, const histogram_snapshot& h) {
+                os << sName << "_ns{n=" << h.nCount << " p50=" << h.Percentile(0.5)
+                   << " p99=" << h.Percentile(0.99) << " p999=" << h.Percentile(0.999)
+                   << " max=" << h.Percentile(1.0) << "}";
+            }
+        };
+
+        // Totals for one interface and all of its connections
+        struct metrics_registry {
+            metric_counter nBytesIn;
+            metric_counter nBytesOut;
+            metric_counter nMessagesIn;
+            metric_counter nMessagesOut;
+            metric_counter nAccepts;
+            metric_counter nRejects;
+            metric_counter nValidationFailures;
+            metric_counter nMigrations; // connections moved between context threads
+            metric_gauge nOutgoingDepth;
+
+            // messages written per drain of a connection's outgoing queue
+            metric_histogram hWriteBatch;
+            // Send() to the last byte of the message handed to the socket
+            metric_histogram hEnqueueToWriteNs;
+            // message read off the socket to OnMessage / handler
+            metric_histogram hReadToDispatchNs;
+
+            // incoming depth lives in the owner's queue, it fills that in
+            metrics_snapshot Snapshot() const {
+                metrics_snapshot s;
+                s.nBytesIn = nBytesIn.Value();
+                s.nBytesOut = nBytesOut.Value();
+                s.nMessagesIn = nMessagesIn.Value();
+                s.nMessagesOut = nMessagesOut.Value();
+                s.nAccepts = nAccepts.Value();
+                s.nRejects = nRejects.Value();
+                s.nValidationFailures = nValidationFailures.Value();
+                s.nMigrations = nMigrations.Value();
+                s.nOutgoingDepth = nOutgoingDepth.Value();
+                s.hWriteBatch = hWriteBatch.Snapshot();
+                s.hEnqueueToWriteNs = hEnqueueToWriteNs.Snapshot();
+                s.hReadToDispatchNs = hReadToDispatchNs.Snapshot();
+                return s;
+            }
+        };
+    }
+}
+
+#endif // NET_METRICS_H_
@@ -0,0 +1,477 @@
+#ifndef NET_MULTICAST_H_
+#define NET_MULTICAST_H_
+
+/**
+ * Multicast fan out with gap recovery over the existing TCP connection.
+ *
+ * A multicast_publisher owned by the server sends every message once to a group,
+ * so the publish cost does not grow with the number of subscribers. Each datagram
+ * holds one message<T> prefixed by a multicast_header carrying the stream id and a
+ * per stream sequence number. The publisher keeps the last nCacheSize messages.
+ *
+ * A multicast_subscriber owned by the client delivers messages in sequence order.
+ * When it sees a jump it holds back the newer messages and sends a gap_request
+ * control message over its connection<T>. The server answers from the publisher's
+ * cache with retransmit control messages, or with gap_lost if the range has already
+ * been evicted, in which case the subscriber skips it and counts the loss.
+ *
+ * A request or its reply can go missing, the connection may be down or the reply
+ * dropped, so an unfilled gap is asked for again every tGapRetry. After nGapAttempts
+ * requests, or once more than nMaxHeld messages wait behind gaps, the subscriber
+ * gives up on the oldest gap the same way as on gap_lost.
+ */
+
+#include "net_utils.hpp"
+#include "net_message.hpp"
+#include "net_tsQueue.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace hjw {
+
+    namespace net {
+
+        struct multicast_header {
+            uint32_t nMagic = 0x484A574D; // "HJWM"
+            uint32_t nStream = 0;
+            uint64_t nSequence = 0; // starts at 1, one per message
+        };
+
+        struct multicast_stats {
+            std::atomic<uint64_t> nPublished{0};
+            std::atomic<uint64_t> nRetransmitted{0}; // messages resent over TCP
+            std::atomic<uint64_t> nDelivered{0};
+            std::atomic<uint64_t> nDuplicates{0}; // already delivered, dropped
+            std::atomic<uint64_t> nGapsRequested{0}; // gap_request messages sent
+            std::atomic<uint64_t> nRecovered{0}; // messages filled in by retransmit
+            std::atomic<uint64_t> nLost{0}; // messages skipped after gap_lost or giving up
+            std::atomic<uint64_t> nGapsAbandoned{0}; // gaps given up on without a reply
+        };
+
+        struct multicast_config {
+            // an unfilled gap is requested again this often
+            std::chrono::milliseconds tGapRetry{100};
+
+            // requests for one gap before it is skipped as lost
+            uint32_t nGapAttempts = 5;
+
+            // messages held behind gaps before the oldest gap is skipped as lost
+            size_t nMaxHeld = 65536;
+        };
+
+        template <typename T>
+        class multicast_publisher {
+            public:
+                multicast_publisher(asio::io_context& asioContext, uint32_t nStream, size_t nCacheSize = 4096)
+                    : m_oAsioContext(asioContext), m_oSocket(asioContext), m_nStream(nStream), m_vCache(nCacheSize)
+                {
+
+                }
+
+                multicast_publisher(const multicast_publisher&) = delete;
+
+                // Open the sending socket, nHops of 1 keeps traffic on the local network
+                bool Open(const std::string& group, uint16_t port, int nHops = 1, bool bLoopback = true) {
+                    try {
+                        m_oGroup = asio::ip::udp::endpoint(asio::ip::make_address(group), port);
+                        m_oSocket.open(m_oGroup.protocol());
+                        m_oSocket.set_option(asio::ip::multicast::hops(nHops));
+                        m_oSocket.set_option(asio::ip::multicast::enable_loopback(bLoopback));
+                    }catch(std::exception& e) {
+                        HJW_LOG_ERROR("[MULTICAST] Open exception: {}", e.what());
+                        return false;
+                    }
+                    return true;
+                }
+
+                uint32_t GetStream() const {return m_nStream;}
+
+                const multicast_stats& Stats() const {return m_oStats;}
+
+                // send message to every subscriber of the group
+                void Publish(const message<T>& msg) {
+                    asio::post(m_oAsioContext,
+                        [this, msg]() {
+                            uint64_t nSequence = ++m_nSequence;
+
+                            // keep a copy for gap recovery, the slot is reused once the ring wraps
+                            cache_entry& entry = m_vCache[nSequence % m_vCache.size()];
+                            entry.nSequence = nSequence;
+                            entry.msg = msg;
+                            entry.msg.header.size = uint32_t(entry.msg.size());
+                            entry.msg.header.flags = 0;
+
+                            multicast_header header;
+                            header.nStream = m_nStream;
+                            header.nSequence = nSequence;
+
+                            m_vDatagram.resize(sizeof(multicast_header) + entry.msg.size());
+                            std::memcpy(m_vDatagram.data(), &header, sizeof(multicast_header));
+                            std::memcpy(m_vDatagram.data() + sizeof(multicast_header), &entry.msg.header, sizeof(message_header<T>));
+                            if(!entry.msg.body.empty())
+                                std::memcpy(m_vDatagram.data() + sizeof(multicast_header) + sizeof(message_header<T>),
+                                            entry.msg.body.data(), entry.msg.body.size());
+
+                            // a lost datagram is recovered by the subscriber, errors are not fatal
+                            asio::error_code ec;
+                            m_oSocket.send_to(asio::buffer(m_vDatagram), m_oGroup, 0, ec);
+                            m_oStats.nPublished.fetch_add(1, std::memory_order_relaxed);
+                        });
+                }
+
+                // Answer a gap_request, send is called with each reply. Must run on the
+                // context thread, which is where connection control handlers are called
+                void Recover(const control_header& request, const std::function<void(const message<T>&)>& send) {
+                    uint64_t nLast = std::min(request.nLast, m_nSequence);
+                    uint64_t nFirst = std::max<uint64_t>(request.nFirst, 1);
+                    uint64_t nLostFrom = 0;
+
+                    // anything older than the ring is gone, report it without walking the range
+                    uint64_t nOldest = m_nSequence >= m_vCache.size() ? m_nSequence - m_vCache.size() + 1 : 1;
+                    if(nFirst < nOldest && nFirst <= nLast) {
+                        send(MakeControl(control_type::gap_lost, nFirst, std::min(nOldest - 1, nLast)));
+                        nFirst = nOldest;
+                    }
+
+                    for(uint64_t nSequence = nFirst; nSequence <= nLast; nSequence++) {
+                        const cache_entry& entry = m_vCache[nSequence % m_vCache.size()];
+                        if(entry.nSequence != nSequence) {
+                            if(nLostFrom == 0)
+                                nLostFrom = nSequence;
+                            continue;
+                        }
+
+                        if(nLostFrom != 0) {
+                            send(MakeControl(control_type::gap_lost, nLostFrom, nSequence - 1));
+                            nLostFrom = 0;
+                        }
+
+                        message<T> msg = entry.msg;
+                        control_header reply{control_type::retransmit, m_nStream, nSequence, nSequence};
+                        msg << reply;
+                        msg.header.flags |= header_flag::control;
+                        send(msg);
+                        m_oStats.nRetransmitted.fetch_add(1, std::memory_order_relaxed);
+                    }
+
+                    if(nLostFrom != 0)
+                        send(MakeControl(control_type::gap_lost, nLostFrom, nLast));
+                }
+
+            private:
+                struct cache_entry {
+                    uint64_t nSequence = 0;
+                    message<T> msg;
+                };
+
+                message<T> MakeControl(control_type nType, uint64_t nFirst, uint64_t nLast) {
+                    message<T> msg;
+                    msg << control_header{nType, m_nStream, nFirst, nLast};
+                    msg.header.flags |= header_flag::control;
+                    return msg;
+                }
+
+            protected:
+                asio::io_context& m_oAsioContext;
+                asio::ip::udp::socket m_oSocket;
+                asio::ip::udp::endpoint m_oGroup;
+
+                uint32_t m_nStream = 0;
+                uint64_t m_nSequence = 0;
+
+                // retransmission ring indexed by sequence number
+                std::vector<cache_entry> m_vCache;
+
+                // reused datagram buffer
+                std::vector<uint8_t> m_vDatagram;
+
+                multicast_stats m_oStats;
+        };
+
+        template <typename T>
+        class multicast_subscriber {
+            public:
+                // Used to send gap_request messages to the server, normally connection<T>::Send
+                using request_sender = std::function<void(const message<T>&)>;
+
+                multicast_subscriber(asio::io_context& asioContext, tsqueue<owned_message<T>>& qIn,
+                                     uint32_t nStream, request_sender fnRequest, multicast_config config = {})
+                    : m_oAsioContext(asioContext), m_oSocket(asioContext), m_qMessagesIn(qIn),
+                      m_nStream(nStream), m_fnRequest(std::move(fnRequest)), m_oConfig(config), m_oGapTimer(asioContext)
+                {
+
+                }
+
+                multicast_subscriber(const multicast_subscriber&) = delete;
+
+                // Join the group and start receiving
+                bool Join(const std::string& group, uint16_t port) {
+                    try {
+                        asio::ip::address oGroup = asio::ip::make_address(group);
+                        asio::ip::udp::endpoint listen(oGroup.is_v6() ? asio::ip::address(asio::ip::address_v6::any())
+                                                                      : asio::ip::address(asio::ip::address_v4::any()), port);
+
+                        m_oSocket.open(listen.protocol());
+                        // several subscribers on one host share the port
+                        m_oSocket.set_option(asio::ip::udp::socket::reuse_address(true));
+                        m_oSocket.bind(listen);
+                        m_oSocket.set_option(asio::ip::multicast::join_group(oGroup));
+                    }catch(std::exception& e) {
+                        HJW_LOG_ERROR("[MULTICAST] Join exception: {}", e.what());
+                        return false;
+                    }
+
+                    m_vBuffer.resize(65536);
+                    ReadDatagram();
+                    return true;
+                }
+
+                void Leave() {
+                    asio::post(m_oAsioContext, [this]() {
+                        m_oSocket.close();
+                        m_oGapTimer.cancel();
+                    });
+                }
+
+                uint32_t GetStream() const {return m_nStream;}
+
+                const multicast_stats& Stats() const {return m_oStats;}
+
+                // Called by the owner's control handler on the context thread
+                void OnControl(const control_header& control, message<T>& msg) {
+                    if(control.nType == control_type::retransmit) {
+                        msg.header.flags = 0;
+                        msg.header.size = uint32_t(msg.size());
+                        if(Accept(control.nFirst, msg))
+                            m_oStats.nRecovered.fetch_add(1, std::memory_order_relaxed);
+                    }else if(control.nType == control_type::gap_lost) {
+                        // the server cannot fill this range, skip past it and stop asking
+                        SkipLost(control.nFirst, control.nLast);
+                        for(auto it = m_mapGaps.lower_bound(control.nFirst); it != m_mapGaps.end() && it->second.nLast <= control.nLast; )
+                            it = m_mapGaps.erase(it);
+                    }
+                }
+
+            private:
+                // ASYNC - prime context to read the next datagram
+                void ReadDatagram() {
+                    m_oSocket.async_receive_from(asio::buffer(m_vBuffer), m_oSender,
+                        [this](std::error_code ec, std::size_t length) {
+                            if(!ec) {
+                                Unpack(length);
+                                ReadDatagram();
+                            }else if(ec != asio::error::operation_aborted) {
+                                HJW_LOG_INFO("[MULTICAST] Read fail.");
+                            }
+                        });
+                }
+
+                void Unpack(size_t nLength) {
+                    multicast_header header;
+                    if(nLength < sizeof(multicast_header) + sizeof(message_header<T>))
+                        return;
+
+                    std::memcpy(&header, m_vBuffer.data(), sizeof(multicast_header));
+                    if(header.nMagic != multicast_header().nMagic || header.nStream != m_nStream)
+                        return;
+
+                    message<T> msg;
+                    std::memcpy(&msg.header, m_vBuffer.data() + sizeof(multicast_header), sizeof(message_header<T>));
+                    size_t nBody = nLength - sizeof(multicast_header) - sizeof(message_header<T>);
+                    if(msg.header.size != sizeof(message_header<T>) + nBody)
+                        return;
+
+                    const uint8_t* pBody = m_vBuffer.data() + sizeof(multicast_header) + sizeof(message_header<T>);
+                    msg.body.assign(pBody, pBody + nBody);
+
+                    // a late joiner starts from the first sequence it hears
+                    if(m_nExpected == 0)
+                        m_nExpected = header.nSequence;
+
+                    // a jump past the newest datagram seen so far is a gap, late or reordered
+                    // datagrams below it were either requested already or are still held
+                    uint64_t nFirst = std::max(m_nExpected, m_nHighest + 1);
+                    if(header.nSequence > nFirst)
+                        RequestGap(nFirst, header.nSequence - 1);
+                    m_nHighest = std::max(m_nHighest, header.nSequence);
+
+                    Accept(header.nSequence, msg);
+                }
+
+                // Deliver in order, hold anything ahead of the next expected sequence
+                bool Accept(uint64_t nSequence, message<T>& msg) {
+                    if(nSequence < m_nExpected || m_mapHeld.count(nSequence)) {
+                        m_oStats.nDuplicates.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    }
+
+                    if(nSequence > m_nExpected) {
+                        m_mapHeld.emplace(nSequence, std::move(msg));
+
+                        // too much waiting behind the oldest gap, give up on it
+                        if(m_mapHeld.size() > m_oConfig.nMaxHeld) {
+                            auto it = m_mapGaps.begin();
+                            uint64_t nLast = m_mapHeld.begin()->first - 1;
+                            if(it != m_mapGaps.end() && it->first <= m_nExpected)
+                                nLast = std::min(nLast, it->second.nLast);
+                            m_oStats.nGapsAbandoned.fetch_add(1, std::memory_order_relaxed);
+                            SkipLost(m_nExpected, nLast);
+                        }
+                        return true;
+                    }
+
+                    Deliver(msg);
+                    m_nExpected++;
+                    DeliverHeld();
+                    return true;
+                }
+
+                void DeliverHeld() {
+                    for(;;) {
+                        // jump over ranges the server reported lost
+                        auto itLost = m_mapLost.find(m_nExpected);
+                        if(itLost != m_mapLost.end()) {
+                            m_nExpected = itLost->second + 1;
+                            m_mapLost.erase(itLost);
+                            continue;
+                        }
+
+                        auto it = m_mapHeld.find(m_nExpected);
+                        if(it == m_mapHeld.end())
+                            break;
+
+                        Deliver(it->second);
+                        m_mapHeld.erase(it);
+                        m_nExpected++;
+                    }
+
+                    // anything held below the next expected sequence fell inside a lost range
+                    while(!m_mapHeld.empty() && m_mapHeld.begin()->first < m_nExpected)
+                        m_mapHeld.erase(m_mapHeld.begin());
+                }
+
+                void Deliver(message<T>& msg) {
+                    m_qMessagesIn.push_back({nullptr, std::move(msg)});
+                    m_oStats.nDelivered.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                // Skip [nFirst, nLast], counting what was never received as lost
+                void SkipLost(uint64_t nFirst, uint64_t nLast) {
+                    if(nLast < m_nExpected)
+                        return;
+
+                    for(uint64_t nSequence = std::max(nFirst, m_nExpected); nSequence <= nLast; nSequence++) {
+                        if(m_mapHeld.count(nSequence) == 0)
+                            m_oStats.nLost.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    if(nFirst <= m_nExpected)
+                        m_nExpected = nLast + 1;
+                    else
+                        m_mapLost[nFirst] = nLast;
+                    DeliverHeld();
+                }
+
+                // Ask for [nFirst, nLast] and keep asking until it is filled or given up on
+                void RequestGap(uint64_t nFirst, uint64_t nLast) {
+                    m_mapGaps[nFirst] = pending_gap{nLast, 1};
+                    SendGapRequest(nFirst, nLast);
+
+                    if(!m_bGapTimer) {
+                        m_bGapTimer = true;
+                        ScheduleGapRetry();
+                    }
+                }
+
+                void SendGapRequest(uint64_t nFirst, uint64_t nLast) {
+                    if(!m_fnRequest)
+                        return;
+
+                    message<T> msg;
+                    msg << control_header{control_type::gap_request, m_nStream, nFirst, nLast};
+                    msg.header.flags |= header_flag::control;
+                    m_fnRequest(msg);
+                    m_oStats.nGapsRequested.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                // ASYNC - ask again for the gaps still open, runs while there are any
+                void ScheduleGapRetry() {
+                    m_oGapTimer.expires_after(m_oConfig.tGapRetry);
+                    m_oGapTimer.async_wait([this](std::error_code ec) {
+                        if(ec)
+                            return;
+
+                        for(auto it = m_mapGaps.begin(); it != m_mapGaps.end(); ) {
+                            // filled, or skipped past since
+                            if(it->second.nLast < m_nExpected) {
+                                it = m_mapGaps.erase(it);
+                                continue;
+                            }
+
+                            uint64_t nFirst = std::max(it->first, m_nExpected);
+                            uint64_t nLast = it->second.nLast;
+                            if(it->second.nAttempts >= m_oConfig.nGapAttempts) {
+                                it = m_mapGaps.erase(it);
+                                m_oStats.nGapsAbandoned.fetch_add(1, std::memory_order_relaxed);
+                                SkipLost(nFirst, nLast);
+                                continue;
+                            }
+
+                            it->second.nAttempts++;
+                            SendGapRequest(nFirst, nLast);
+                            ++it;
+                        }
+
+                        m_bGapTimer = !m_mapGaps.empty();
+                        if(m_bGapTimer)
+                            ScheduleGapRetry();
+                    });
+                }
+
+            protected:
+                asio::io_context& m_oAsioContext;
+                asio::ip::udp::socket m_oSocket;
+                asio::ip::udp::endpoint m_oSender;
+
+                // Queue messages are delivered to, owned by the client
+                tsqueue<owned_message<T>>& m_qMessagesIn;
+
+                uint32_t m_nStream = 0;
+                request_sender m_fnRequest;
+                multicast_config m_oConfig;
+
+            private:
+                struct pending_gap {
+                    uint64_t nLast = 0;
+                    uint32_t nAttempts = 0; // requests sent so far
+                };
+
+                std::vector<uint8_t> m_vBuffer;
+
+                // next sequence to deliver, 0 until the first datagram arrives
+                uint64_t m_nExpected = 0;
+
+                // newest sequence received by multicast, so a gap is only requested once
+                uint64_t m_nHighest = 0;
+
+                // messages received ahead of a gap
+                std::map<uint64_t, message<T>> m_mapHeld;
+
+                // ranges reported lost that start after m_nExpected, first -> last
+                std::map<uint64_t, uint64_t> m_mapLost;
+
+                // gaps requested and not yet filled, first -> state, retried by m_oGapTimer
+                std::map<uint64_t, pending_gap> m_mapGaps;
+                asio::steady_timer m_oGapTimer;
+                bool m_bGapTimer = false;
+
+                multicast_stats m_oStats;
+        };
+    }
+}
+
+#endif // NET_MULTICAST_H_
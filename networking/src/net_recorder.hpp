@@ -0,0 +1,500 @@
+#ifndef NET_RECORDER_H_
+#define NET_RECORDER_H_
+
+/**
+ * Capture and replay of the messages a server or client exchanges.
+ *
+ * message_recorder taps every connection of its interface. Messages are recorded
+ * as the application sees them, after decompression on the way in and before
+ * compression on the way out. The context thread only copies the message into its
+ * own ring (the log_ring from net_log.hpp) and never waits. A writer thread
+ * appends the rings to a memory mapped, append only file, growing it as it goes. A
+ * full ring drops the message and counts it.
+ *
+ * File layout, everything little endian as written by the host:
+ *
+ *  record_file_header
+ *  record_frame, message_header<T>, body, padding to 8 bytes
+ *  record_frame, ...
+ *
+ * Frame times are steady_clock nanoseconds. The writer merges the thread rings by
+ * time as it drains them, but a frame committed just after a drain can still land
+ * behind newer frames from other threads, so the file is only roughly in order. nEnd in
+ * the header is filled in when the recording is closed. A file that was never
+ * closed ends at the first frame with nSize 0.
+ *
+ * message_replayer maps a recording and walks it in order. Pages are read as they
+ * are reached and released behind the cursor, so a recording larger than memory
+ * replays fine. Speed 1 keeps the original gaps between frames, 2 halves them,
+ * 0 replays as fast as the callback takes them.
+ *
+ *  // drive a server with the traffic clients sent it, one stripe per recorded connection
+ *  replayer.Replay([&](const record_frame& f, message<T>& msg) {client.Send(msg, f.nConnection);},
+ *                  1.0, record_direction::in);
+ *
+ *  // push a client's recorded input through its handlers again, the client must be connected
+ *  replayer.Replay([&](const record_frame&, message<T>& msg) {client.Inject(std::move(msg));},
+ *                  0.0, record_direction::in);
+ */
+
+#include "net_log.hpp"
+#include "net_message.hpp"
+#include "net_metrics.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace hjw {
+
+    namespace net {
+
+        constexpr size_t nRecorderRingSize = 1u << 22;
+        constexpr size_t nRecorderFileChunk = 64u << 20;
+
+        enum class record_direction : uint32_t {in, out};
+
+        struct record_file_header {
+            char sMagic[8] = {'H', 'J', 'W', 'N', 'R', 'E', 'C', '1'};
+            uint32_t nVersion = 1;
+            uint32_t nMessageHeaderSize = 0; // sizeof(message_header<T>), replay needs the same T
+            uint64_t nStartNs = 0;           // steady clock when the recording opened
+            uint64_t nStartWallNs = 0;       // system clock at the same moment
+            uint64_t nEnd = 0;               // bytes in use, 0 until closed
+            uint8_t aReserved[24] = {};
+        };
+
+        struct record_frame {
+            uint32_t nSize = 0; // whole frame padded to 8 bytes, first so the frame doubles as a log_ring record
+            uint32_t nConnection = 0;
+            uint64_t nTimeNs = 0;
+            record_direction nDirection = record_direction::in;
+            uint32_t nBodySize = 0;
+        };
+
+        template <typename T>
+        class message_recorder {
+            public:
+                // nRingSize is per recording thread and must be a power of two
+                explicit message_recorder(size_t nRingSize = nRecorderRingSize)
+                    : m_nSerial(NextSerial()), m_nRingSize(nRingSize) {}
+
+                ~message_recorder() {
+                    Close();
+                }
+
+                // Start a new recording at sPath, replacing any file there
+                bool Open(const std::string& sPath) {
+                    Close();
+
+                    int fd = ::open(sPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+                    if(fd < 0) {
+                        HJW_LOG_ERROR("[RECORDER] Cannot open {}", sPath);
+                        return false;
+                    }
+
+                    m_nFd = fd;
+                    m_nMapped = 0;
+                    m_pMap = nullptr;
+                    if(!Grow(nRecorderFileChunk)) {
+                        CloseFile();
+                        return false;
+                    }
+
+                    record_file_header header;
+                    header.nMessageHeaderSize = uint32_t(sizeof(message_header<T>));
+                    header.nStartNs = MetricNow();
+                    header.nStartWallNs = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count());
+                    std::memcpy(m_pMap, &header, sizeof(header));
+                    m_nWritten = sizeof(header);
+
+                    // anything left over from an earlier recording belongs to no file
+                    {
+                        std::scoped_lock lock(m_oMuxRings);
+                        AdoptRings();
+                        for(auto& pRing : m_vRings)
+                            pRing->Drain([](const uint8_t*) {});
+                    }
+
+                    m_bWriting = true;
+                    m_tWriter = std::thread([this]() {WriterLoop();});
+                    m_bOpen.store(true, std::memory_order_release);
+                    return true;
+                }
+
+                // Stop recording, write out what the rings hold and finish the file
+                void Close() {
+                    if(m_nFd < 0)
+                        return;
+
+                    m_bOpen.store(false, std::memory_order_release);
+                    {
+                        std::scoped_lock lock(m_oMuxWake);
+                        m_bWriting = false;
+                    }
+                    m_cvWake.notify_one();
+                    if(m_tWriter.joinable())
+                        m_tWriter.join();
+
+                    DrainRings();
+
+                    record_file_header header;
+                    std::memcpy(&header, m_pMap, sizeof(header));
+                    header.nEnd = m_nWritten;
+                    std::memcpy(m_pMap, &header, sizeof(header));
+
+                    CloseFile();
+                }
+
+                bool IsOpen() const {
+                    return m_bOpen.load(std::memory_order_relaxed);
+                }
+
+                // Called on a context thread for every message in or out, never blocks. A journaled
+                // message is recorded without its sequence, the same as the application sent it
+                void Record(uint32_t nConnection, record_direction eDirection, const message<T>& msg) {
+                    if(!m_bOpen.load(std::memory_order_relaxed))
+                        return;
+
+                    message_header<T> header = msg.header;
+                    size_t nBody = msg.body.size();
+                    if((header.flags & header_flag::sequenced) && nBody >= sizeof(uint64_t)) {
+                        nBody -= sizeof(uint64_t);
+                        header.size = uint32_t(sizeof(message_header<T>) + nBody);
+                        header.flags &= ~header_flag::sequenced;
+                    }
+
+                    size_t nSize = log_detail::Align(sizeof(record_frame) + sizeof(message_header<T>) + nBody);
+                    log_ring& ring = ThreadRing();
+                    uint8_t* p = nSize <= m_nRingSize ? ring.Reserve(nSize) : nullptr;
+                    if(!p) {
+                        m_nDropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+
+                    record_frame frame;
+                    frame.nSize = uint32_t(nSize);
+                    frame.nConnection = nConnection;
+                    frame.nTimeNs = MetricNow();
+                    frame.nDirection = eDirection;
+                    frame.nBodySize = uint32_t(nBody);
+
+                    std::memcpy(p, &frame, sizeof(frame));
+                    std::memcpy(p + sizeof(frame), &header, sizeof(message_header<T>));
+                    if(nBody)
+                        std::memcpy(p + sizeof(frame) + sizeof(message_header<T>), msg.body.data(), nBody);
+                    ring.Commit(nSize);
+                    m_nRecorded.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                // messages taken and messages lost to a full ring, since construction
+                uint64_t Recorded() const {return m_nRecorded.load(std::memory_order_relaxed);}
+                uint64_t Dropped() const {return m_nDropped.load(std::memory_order_relaxed);}
+
+            private:
+                static uint64_t NextSerial() {
+                    static std::atomic<uint64_t> nSerial{1};
+                    return nSerial.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                // the calling thread's ring for this recorder, created on first use. Keyed by a
+                // serial rather than the address so a later recorder at the same address misses.
+                // The ring is allocated before any lock is taken and handed over on m_oMuxNewRings,
+                // which only ever guards a push, so a context thread never waits on a drain
+                log_ring& ThreadRing() {
+                    thread_local std::vector<std::pair<uint64_t, log_ring*>> vRings;
+                    for(auto& entry : vRings)
+                        if(entry.first == m_nSerial)
+                            return *entry.second;
+
+                    auto pRing = std::make_unique<log_ring>(m_nRingSize);
+                    log_ring& ring = *pRing;
+                    {
+                        std::scoped_lock lock(m_oMuxNewRings);
+                        m_vNewRings.push_back(std::move(pRing));
+                    }
+                    vRings.emplace_back(m_nSerial, &ring);
+                    return ring;
+                }
+
+                // move rings created since the last drain into m_vRings, m_oMuxRings held
+                void AdoptRings() {
+                    std::scoped_lock lock(m_oMuxNewRings);
+                    for(auto& pRing : m_vNewRings)
+                        m_vRings.push_back(std::move(pRing));
+                    m_vNewRings.clear();
+                }
+
+                void WriterLoop() {
+                    std::unique_lock<std::mutex> ul(m_oMuxWake);
+                    while(m_bWriting) {
+                        ul.unlock();
+                        DrainRings();
+                        ul.lock();
+                        m_cvWake.wait_for(ul, std::chrono::milliseconds(1), [this]() {return !m_bWriting;});
+                    }
+                }
+
+                // only the writer thread, or Close once it has stopped, gets here. Each ring is in
+                // time order, so taking the oldest front of all of them merges what this pass sees
+                // into one timeline. Records committed after the pass starts wait for the next one
+                void DrainRings() {
+                    std::scoped_lock lock(m_oMuxRings);
+                    AdoptRings();
+
+                    m_vDrainHeads.resize(m_vRings.size());
+                    for(size_t i = 0; i < m_vRings.size(); i++)
+                        m_vDrainHeads[i] = m_vRings[i]->Written();
+
+                    for(;;) {
+                        const uint8_t* pOldest = nullptr;
+                        size_t nOldest = 0;
+                        uint64_t nOldestNs = 0;
+                        for(size_t i = 0; i < m_vRings.size(); i++) {
+                            const uint8_t* pRecord = m_vRings[i]->Front(m_vDrainHeads[i]);
+                            if(!pRecord)
+                                continue;
+
+                            uint64_t nTimeNs = 0;
+                            std::memcpy(&nTimeNs, pRecord + offsetof(record_frame, nTimeNs), sizeof(nTimeNs));
+                            if(!pOldest || nTimeNs < nOldestNs) {
+                                pOldest = pRecord;
+                                nOldest = i;
+                                nOldestNs = nTimeNs;
+                            }
+                        }
+
+                        if(!pOldest)
+                            return;
+                        WriteFrame(pOldest);
+                        m_vRings[nOldest]->Pop();
+                    }
+                }
+
+                void WriteFrame(const uint8_t* pRecord) {
+                    uint32_t nSize = 0;
+                    std::memcpy(&nSize, pRecord, sizeof(nSize));
+
+                    // keep a zero word after the last frame so an unclosed file still ends cleanly
+                    if(m_nWritten + nSize + sizeof(uint32_t) > m_nMapped && !Grow(m_nWritten + nSize + sizeof(uint32_t))) {
+                        m_nDropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                    std::memcpy(m_pMap + m_nWritten, pRecord, nSize);
+                    m_nWritten += nSize;
+                }
+
+                // extend the file and the mapping to at least nNeeded bytes
+                bool Grow(size_t nNeeded) {
+                    size_t nSize = m_nMapped ? m_nMapped : nRecorderFileChunk;
+                    while(nSize < nNeeded)
+                        nSize *= 2;
+
+                    if(::ftruncate(m_nFd, off_t(nSize)) != 0) {
+                        HJW_LOG_ERROR("[RECORDER] Cannot grow recording to {} bytes", nSize);
+                        return false;
+                    }
+
+                    void* p = MAP_FAILED;
+                #if defined(__linux__)
+                    if(m_pMap)
+                        p = ::mremap(m_pMap, m_nMapped, nSize, MREMAP_MAYMOVE);
+                    else
+                        p = ::mmap(nullptr, nSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_nFd, 0);
+                #else
+                    if(m_pMap)
+                        ::munmap(m_pMap, m_nMapped);
+                    p = ::mmap(nullptr, nSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_nFd, 0);
+                #endif
+                    if(p == MAP_FAILED) {
+                        HJW_LOG_ERROR("[RECORDER] Cannot map recording");
+                        m_pMap = nullptr;
+                        m_nMapped = 0;
+                        return false;
+                    }
+
+                    m_pMap = static_cast<uint8_t*>(p);
+                    m_nMapped = nSize;
+                    return true;
+                }
+
+                // trim the file to what was written and let it go
+                void CloseFile() {
+                    if(m_pMap)
+                        ::munmap(m_pMap, m_nMapped);
+                    if(m_nFd >= 0) {
+                        if(m_nWritten && ::ftruncate(m_nFd, off_t(m_nWritten)) != 0)
+                            HJW_LOG_WARN("[RECORDER] Cannot trim recording to {} bytes", m_nWritten);
+                        ::close(m_nFd);
+                    }
+                    m_pMap = nullptr;
+                    m_nMapped = 0;
+                    m_nWritten = 0;
+                    m_nFd = -1;
+                }
+
+            private:
+                const uint64_t m_nSerial;
+                std::atomic<bool> m_bOpen{false};
+                std::atomic<uint64_t> m_nRecorded{0};
+                std::atomic<uint64_t> m_nDropped{0};
+
+                // per thread rings, they live as long as the recorder
+                std::mutex m_oMuxRings;
+                std::vector<std::unique_ptr<log_ring>> m_vRings;
+                std::mutex m_oMuxNewRings;
+                std::vector<std::unique_ptr<log_ring>> m_vNewRings;
+                std::vector<uint64_t> m_vDrainHeads; // writer only
+                const size_t m_nRingSize;
+
+                // writer thread and the file it appends to
+                std::thread m_tWriter;
+                std::mutex m_oMuxWake;
+                std::condition_variable m_cvWake;
+                bool m_bWriting = false;
+                int m_nFd = -1;
+                uint8_t* m_pMap = nullptr;
+                size_t m_nMapped = 0;
+                size_t m_nWritten = 0;
+        };
+
+        template <typename T>
+        class message_replayer {
+            public:
+                ~message_replayer() {
+                    Close();
+                }
+
+                // Map a recording, false if it is missing or was made with a different message_header
+                bool Open(const std::string& sPath) {
+                    Close();
+
+                    int fd = ::open(sPath.c_str(), O_RDONLY);
+                    if(fd < 0) {
+                        HJW_LOG_ERROR("[REPLAY] Cannot open {}", sPath);
+                        return false;
+                    }
+
+                    struct stat st;
+                    if(::fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(record_file_header)) {
+                        HJW_LOG_ERROR("[REPLAY] {} is not a recording", sPath);
+                        ::close(fd);
+                        return false;
+                    }
+
+                    void* p = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                    ::close(fd);
+                    if(p == MAP_FAILED) {
+                        HJW_LOG_ERROR("[REPLAY] Cannot map {}", sPath);
+                        return false;
+                    }
+
+                    m_pMap = static_cast<const uint8_t*>(p);
+                    m_nMapped = size_t(st.st_size);
+                    ::madvise(p, m_nMapped, MADV_SEQUENTIAL);
+
+                    std::memcpy(&m_oHeader, m_pMap, sizeof(m_oHeader));
+                    if(std::memcmp(m_oHeader.sMagic, record_file_header{}.sMagic, sizeof(m_oHeader.sMagic)) != 0 ||
+                       m_oHeader.nMessageHeaderSize != sizeof(message_header<T>)) {
+                        HJW_LOG_ERROR("[REPLAY] {} was not recorded with this message type", sPath);
+                        Close();
+                        return false;
+                    }
+
+                    m_nEnd = m_oHeader.nEnd && m_oHeader.nEnd <= m_nMapped ? size_t(m_oHeader.nEnd) : m_nMapped;
+                    return true;
+                }
+
+                void Close() {
+                    if(m_pMap)
+                        ::munmap(const_cast<uint8_t*>(m_pMap), m_nMapped);
+                    m_pMap = nullptr;
+                    m_nMapped = 0;
+                    m_nEnd = 0;
+                }
+
+                const record_file_header& Header() const {
+                    return m_oHeader;
+                }
+
+                // Ask a Replay running on another thread to return after the current frame
+                void Stop() {
+                    m_bStop.store(true, std::memory_order_relaxed);
+                }
+
+                // Call fn(const record_frame&, message<T>&) for every frame in order, optionally only
+                // one direction, spaced out by the original gaps divided by fSpeed. fSpeed 0 does not
+                // wait at all. Returns the number of frames handed to fn
+                template <typename Fn>
+                size_t Replay(Fn&& fn, double fSpeed = 1.0, std::optional<record_direction> eDirection = std::nullopt) {
+                    m_bStop.store(false, std::memory_order_relaxed);
+
+                    size_t nOffset = sizeof(record_file_header);
+                    size_t nReleased = 0;
+                    size_t nFrames = 0;
+                    uint64_t nFirstNs = 0;
+                    auto tStart = std::chrono::steady_clock::now();
+                    message<T> msg;
+
+                    while(nOffset + sizeof(record_frame) <= m_nEnd && !m_bStop.load(std::memory_order_relaxed)) {
+                        record_frame frame;
+                        std::memcpy(&frame, m_pMap + nOffset, sizeof(frame));
+                        if(frame.nSize == 0 || nOffset + frame.nSize > m_nEnd ||
+                           sizeof(frame) + sizeof(message_header<T>) + frame.nBodySize > frame.nSize)
+                            break;
+
+                        const uint8_t* pMessage = m_pMap + nOffset + sizeof(frame);
+                        nOffset += frame.nSize;
+
+                        if(eDirection && frame.nDirection != *eDirection)
+                            continue;
+
+                        // hold the frame back until its place on the original timeline. A frame
+                        // from another thread can be older than the first one, it goes straight out
+                        if(nFrames == 0)
+                            nFirstNs = frame.nTimeNs;
+                        else if(fSpeed > 0 && frame.nTimeNs > nFirstNs)
+                            std::this_thread::sleep_until(tStart + std::chrono::nanoseconds(
+                                int64_t(double(frame.nTimeNs - nFirstNs) / fSpeed)));
+
+                        std::memcpy(&msg.header, pMessage, sizeof(message_header<T>));
+                        msg.body.assign(pMessage + sizeof(message_header<T>), pMessage + sizeof(message_header<T>) + frame.nBodySize);
+                        fn(static_cast<const record_frame&>(frame), msg);
+                        nFrames++;
+
+                        // give back pages already replayed so the whole file is never resident
+                        if(nOffset - nReleased >= nRecorderFileChunk) {
+                            size_t nPage = size_t(::sysconf(_SC_PAGESIZE));
+                            size_t nUpTo = (nOffset / nPage) * nPage;
+                            ::madvise(const_cast<uint8_t*>(m_pMap) + nReleased, nUpTo - nReleased, MADV_DONTNEED);
+                            nReleased = nUpTo;
+                        }
+                    }
+
+                    return nFrames;
+                }
+
+            private:
+                const uint8_t* m_pMap = nullptr;
+                size_t m_nMapped = 0;
+                size_t m_nEnd = 0;
+                record_file_header m_oHeader;
+                std::atomic<bool> m_bStop{false};
+        };
+    }
+}
+
+#endif // NET_RECORDER_H_
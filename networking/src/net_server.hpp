@@ -5,9 +5,19 @@
 #include "net_message.hpp"
 #include "net_tsQueue.hpp"
 #include "net_connection.hpp"
+#include "net_multicast.hpp"
+#include <algorithm>
+#include <chrono>
 #include <exception>
+#include <functional>
+#include <map>
+#include <sstream>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <system_error>
+#include <unordered_map>
+#include <vector>
 
 namespace hjw {
 
@@ -32,33 +42,68 @@ namespace hjw {
          *
          * Once the read body task has expired we will add the message to the server's incoming message queue.
          *
+         * With SetWorkers the connections run on a pool of worker contexts instead, one thread each,
+         * while the acceptor, timers and multicast stay on the server's own context. New connections
+         * are dealt out in turn. Every tBalancePeriod the server compares how many messages each
+         * worker moved, and when one is well ahead it migrates a connection from the busiest worker
+         * to the quietest, socket, queues and all, between two of its messages. Per connection
+         * ordering is kept. OnClientValidated and OnControlMessage are then called on worker threads.
          */
 
+        struct worker_config {
+            // worker context threads, 1 keeps everything on the server's own context thread
+            size_t nThreads = 1;
+
+            // how often load is compared, zero never migrates
+            std::chrono::milliseconds tBalancePeriod{250};
+
+            // migrate when the busiest worker moved this many times the messages of the quietest
+            double fImbalance = 1.5;
+
+            // and at least this many messages in the period, below that nothing is moved
+            uint64_t nMinLoad = 1000;
+        };
+
         template <typename T>
         class server_interface {
             public:
                 server_interface(uint16_t port)
                     // address passed to accepter is the one the server will listen to conections on
-                    : m_oAsioAcceptor(m_oContext, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
+                    : m_oAsioAcceptor(m_oContext, asio::generic::stream_protocol::endpoint(asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port)))
+                {
+
+                }
+
+                // Listen on an AF_UNIX socket path for same host clients, with eTransport of
+                // transport::shm each accepted client is moved onto shared memory rings
+                server_interface(const std::string& sPath, transport eTransport = transport::local, shm_config config = {})
+                    : m_oAsioAcceptor(m_oContext, LocalEndpoint(sPath)), m_eTransport(eTransport), m_oShmConfig(config)
                 {
 
                 }
 
                 virtual ~server_interface() {
                     Stop();
+
+                    // connections hold sockets on m_oContext, which is destroyed before this deque
+                    m_mapLiveSessions.clear();
+                    m_dqConnections.clear();
                 }
 
                 bool Start() {
                     try {
+                        ConfigureAcceptor();
+                        StartWorkers();
+                        StartJournal();
                         WaitForClientConnection();
                         // start context thread
-                        m_tContextThread = std::thread([this]() {m_oContext.run(); } );
+                        m_tContextThread = std::thread([this]() {RunContext(m_oContext, m_oLatency); } );
                     }catch(std::exception& e) {
-                        std::cerr << "[SERVER] Exception: " << e.what() << "\n";
+                        HJW_LOG_ERROR("[SERVER] Exception: {}", e.what());
                         return false;
                     }
 
-                    std::cout << "[SERVER] Started. \n";
+                    HJW_LOG_INFO("[SERVER] Started ({}). ", ReactorName());
                     return true;
                 }
 
@@ -70,40 +115,82 @@ namespace hjw {
                     if(m_tContextThread.joinable())
                         m_tContextThread.join();
 
-                    std::cout << "[SERVER] Stopped.\n";
+                    for(auto& pWorker : m_vWorkers)
+                        pWorker->stop();
+                    for(auto& tWorker : m_vWorkerThreads) {
+                        if(tWorker.joinable())
+                            tWorker.join();
+                    }
+
+                    HJW_LOG_INFO("[SERVER] Stopped.");
                 }
 
                 // ASYNC - instruct asio to wait for connections
                 void WaitForClientConnection() {
+                    // the worker the next connection will run on, or the server's own context
+                    asio::io_context& asioContext = NextWorker();
+
                     // lambda function fired when connection is to be made
-                    m_oAsioAcceptor.async_accept(
-                        [this](std::error_code ec, asio::ip::tcp::socket socket)
+                    m_oAsioAcceptor.async_accept(asioContext,
+                        [this, &asioContext](std::error_code ec, stream_socket socket)
                         {
                             if(!ec) {
+                                HJW_TRACE_INSTANT("accept", nIDCounter);
+
                                 // Succesfull connection, print ip of connection
-                                std::cout << "[SERVER] New connection:" << socket.remote_endpoint() << "\n";
+                                HJW_LOG_INFO("[SERVER] New connection:{}", DescribeEndpoint(socket.remote_endpoint()));
+
+                                // same host clients asked for shared memory, give them their rings
+                                std::unique_ptr<shm_stream> pShm;
+                                if(m_eTransport == transport::shm) {
+                                    pShm = shm_stream::Offer(asioContext, socket, m_oShmConfig);
+                                    if(!pShm) {
+                                        HJW_LOG_WARN("[SERVER] Shared memory setup failed.");
+                                        WaitForClientConnection();
+                                        return;
+                                    }
+                                }
+                                transport_stream stream = pShm ? transport_stream(std::move(socket), std::move(pShm))
+                                                               : transport_stream(std::move(socket));
 
                                 // tell new connection it is owned by the server
                                 std::shared_ptr<connection<T>> newConnection =
                                     std::make_shared<connection<T>>(connection<T>::owner::server,
-                                                    m_oContext, std::move(socket), m_qMessagesIn);
+                                                    asioContext, std::move(stream), m_qMessagesIn);
+                                newConnection->SetCompression(&m_oCompression, &m_oCompressionStats);
+                                newConnection->SetLatency(&m_oLatency);
+                                newConnection->SetSocketOptions(&m_oSocketOptions);
+                                if(m_bMetrics)
+                                    newConnection->SetMetrics(&m_oMetrics);
+                                newConnection->SetRecorder(&m_oRecorder);
+                                newConnection->SetControlHandler(
+                                    [this](std::shared_ptr<connection<T>> client, message<T>& msg) {
+                                        OnControlMessage(client, msg);
+                                    });
 
                                 // Chance for user server to deny connection
                                 if(OnClientConnection(newConnection)) {
                                     // connection allowedm push to connection container
-                                    m_dqConnections.push_back(std::move(newConnection));
+                                    {
+                                        std::scoped_lock lock(m_muxConnections);
+                                        m_dqConnections.push_back(newConnection);
+                                    }
 
-                                    m_dqConnections.back()->ConnectToClient(this, nIDCounter++);
+                                    newConnection->ConnectToClient(this, nIDCounter++);
 
-                                    std::cout << "[" << m_dqConnections.back()->GetID() << "] Approved connection\n";
+                                    HJW_LOG_INFO("[{}] Approved connection", newConnection->GetID());
+                                    if(m_bMetrics)
+                                        m_oMetrics.nAccepts.Add();
 
                                 }else {
-                                    std::cout << "Connection denied.\n";
+                                    HJW_LOG_INFO("Connection denied.");
+                                    if(m_bMetrics)
+                                        m_oMetrics.nRejects.Add();
                                 }
 
                             }else {
                                 // Error during acceptance
-                                std::cerr << "[SERVER] Connection error: " << ec.message() << "\n";
+                                HJW_LOG_WARN("[SERVER] Connection error: {}", ec);
                             }
 
                             // Prime asio function with more work
@@ -111,37 +198,184 @@ namespace hjw {
                         });
                 }
 
+                // Configure payload compression, applies to connections accepted afterwards
+                void SetCompression(const compression_config<T>& config) {
+                    m_oCompression = config;
+                }
+
+                // Configure the context thread run mode and socket options, must be called before Start
+                void SetLatency(const latency_config& config) {
+                    m_oLatency = config;
+                }
+
+                // Run connections on a pool of worker threads and balance them, must be called before Start
+                void SetWorkers(const worker_config& config) {
+                    m_oWorkers = config;
+                }
+
+                // Configure the socket profile of accepted connections and the acceptor, must be called before Start
+                void SetSocketOptions(const socket_options& options) {
+                    m_oSocketOptions = options;
+                }
+
+                // Turn on metrics for connections accepted afterwards, call before Start to cover them all
+                void EnableMetrics() {
+                    m_bMetrics = true;
+                }
+
+                // Totals over every connection of this server, cheap enough to call often
+                metrics_snapshot MetricsSnapshot() {
+                    metrics_snapshot snapshot = m_oMetrics.Snapshot();
+                    snapshot.nIncomingDepth = int64_t(m_qMessagesIn.count());
+                    return snapshot;
+                }
+
+                // Hand a snapshot to fnDump every tPeriod from the context thread, logs it by default
+                void DumpMetrics(std::chrono::milliseconds tPeriod,
+                                 std::function<void(const metrics_snapshot&)> fnDump = nullptr) {
+                    if(!fnDump)
+                        fnDump = [](const metrics_snapshot& s) {std::ostringstream os; os << s; HJW_LOG_INFO("[SERVER] {}", os.str());};
+
+                    asio::post(m_oContext, [this, tPeriod, fnDump = std::move(fnDump)]() mutable {
+                        m_pMetricsTimer = std::make_unique<asio::steady_timer>(m_oContext);
+                        ScheduleMetricsDump(tPeriod, std::move(fnDump));
+                    });
+                }
+
+                // Record every message in and out of every connection to sPath until StopRecording,
+                // see net_recorder.hpp. Can be started and stopped while running
+                bool StartRecording(const std::string& sPath) {
+                    return m_oRecorder.Open(sPath);
+                }
+
+                void StopRecording() {
+                    m_oRecorder.Close();
+                }
+
+                const message_recorder<T>& Recorder() const {
+                    return m_oRecorder;
+                }
+
+                // Number and keep what is sent to clients that ask for a journaled session, so
+                // they can reconnect without a full resync, see net_journal.hpp. Call before Start
+                void EnableJournal(const journal_config& config = {}) {
+                    m_bJournal = true;
+                    m_oJournalConfig = config;
+                }
+
+                // Send message to a journaled session by its token, see connection::JournalToken. While
+                // the client is away the message is only kept, and it is sent once the client resumes.
+                // The message is in the journal when this returns, so a client reconnecting at the
+                // same time gets it in its replay
+                void MessageJournaled(uint64_t nToken, const message<T>& msg) {
+                    // BindSession moves the session to a new connection under the same lock
+                    std::scoped_lock lock(m_muxSessions);
+                    auto it = m_mapSessions.find(nToken);
+                    if(it == m_mapSessions.end())
+                        return;
+
+                    // the session's connection numbers it into the journal as it takes it
+                    auto pConnection = it->second.pConnection.lock();
+                    if(pConnection && pConnection->IsConnected()) {
+                        pConnection->Send(msg);
+                    }else {
+                        message<T> stamped = msg;
+                        it->second.pJournal->Stamp(stamped);
+                    }
+                }
+
+                const journal_stats& JournalStats() const {
+                    return m_oJournalStats;
+                }
+
+                // Compression counters summed over every connection of this server
+                const compression_stats& CompressionStats() const {
+                    return m_oCompressionStats;
+                }
+
                 // Send message to specific client
                 void MessageClient(std::shared_ptr<connection<T>> client, const message<T>& msg) {
                     if(client && client->IsConnected()) {
                         client->Send(msg);
                     }else {
                         OnClientDisconnect(client);
-                        client.reset(); // call connection object destructor
-                        m_dqConnections.erease(
+
+                        std::scoped_lock lock(m_muxConnections);
+                        if(client)
+                            LeaveSession(client);
+                        m_dqConnections.erase(
                             std::remove(m_dqConnections.begin(), m_dqConnections.end(), client), m_dqConnections.end());
+                        client.reset(); // call connection object destructor
                     }
                 }
 
                 // Send message to all clients
                 void MessageAllClients(const message<T>& msg, std::shared_ptr<connection<T>> pIgnoreClient = nullptr) {
+                    std::vector<std::shared_ptr<connection<T>>> vInvalid;
                     bool bInvalidConnectionsExist = false;
 
-                    for(auto& client : m_dqConnections) {
-                        if(client && client->IsConnected()) {
-                            if(client != pIgnoreClient)
-                                client->Send(msg);
-                        }else {
-                            // client cannot be conntacted so must be disconnected
-                            OnClientDisconnect(client);
-                            client.reset();
-                            bInvalidConnectionsExist = true;
+                    {
+                        std::scoped_lock lock(m_muxConnections);
+                        for(auto& client : m_dqConnections) {
+                            if(client && client->IsConnected()) {
+                                if(client != pIgnoreClient)
+                                    client->Send(msg);
+                            }else {
+                                if(client)
+                                    LeaveSession(client);
+                                vInvalid.push_back(std::move(client));
+                                bInvalidConnectionsExist = true;
+                            }
                         }
+
+                        if(bInvalidConnectionsExist)
+                            m_dqConnections.erase(
+                                std::remove(m_dqConnections.begin(), m_dqConnections.end(), nullptr), m_dqConnections.end());
                     }
 
-                    if(bInvalidConnectionsExist)
-                        m_dqConnections.erase(
-                            std::remove(m_dqConnections.begin(), m_dqConnections.end(), nullptr), m_dqConnections.end());
+                    // client cannot be conntacted so must be disconnected, told outside the lock
+                    // so the handler is free to message other clients
+                    for(auto& client : vInvalid)
+                        OnClientDisconnect(client);
+                }
+
+                // Send message to a logical session, for a striped client this picks one of its
+                // connections round robin, all of them deliver into the client's Incoming()
+                void MessageSession(uint32_t nSession, const message<T>& msg) {
+                    std::scoped_lock lock(m_muxConnections);
+                    auto it = m_mapLiveSessions.find(nSession);
+                    if(it == m_mapLiveSessions.end())
+                        return;
+
+                    // stripes that dropped leave the session as they are found
+                    live_session& session = it->second;
+                    session.vConnections.erase(std::remove_if(session.vConnections.begin(), session.vConnections.end(),
+                        [](const std::shared_ptr<connection<T>>& client) {return !client->IsConnected();}), session.vConnections.end());
+                    if(session.vConnections.empty()) {
+                        EndSession(it);
+                        return;
+                    }
+
+                    session.vConnections[session.nCursor++ % session.vConnections.size()]->Send(msg);
+                }
+
+                // Open a multicast stream, must be called before Start. Subscribers recover
+                // lost datagrams from the last nCacheSize messages over their TCP connection
+                multicast_publisher<T>* OpenMulticast(uint32_t nStream, const std::string& group, uint16_t port, size_t nCacheSize = 4096) {
+                    auto pPublisher = std::make_unique<multicast_publisher<T>>(m_oContext, nStream, nCacheSize);
+                    if(!pPublisher->Open(group, port))
+                        return nullptr;
+
+                    auto& slot = m_mapPublishers[nStream];
+                    slot = std::move(pPublisher);
+                    return slot.get();
+                }
+
+                // Send message to all subscribers of a multicast stream, one datagram whatever the subscriber count
+                void MulticastAll(const message<T>& msg, uint32_t nStream = 0) {
+                    auto it = m_mapPublishers.find(nStream);
+                    if(it != m_mapPublishers.end())
+                        it->second->Publish(msg);
                 }
 
             protected:
@@ -156,9 +390,165 @@ namespace hjw {
                         // grab the front message
                         auto msg = m_qMessagesIn.pop_front();
 
+                        if(msg.nReadNs)
+                            m_oMetrics.hReadToDispatchNs.Record(MetricNow() - msg.nReadNs);
+
+                        [[maybe_unused]] uint32_t nRemote = msg.remote ? msg.remote->GetID() : 0;
+                        HJW_TRACE_INSTANT("dequeue", nRemote);
+
                         // pass to message handler
+                        HJW_TRACE_BEGIN("OnMessage", nRemote);
                         OnMessage(msg.remote, msg.msg); // remote is a shared pointer to the connection of the client
+                        HJW_TRACE_END("OnMessage", nRemote);
+                    }
+                }
+
+            private:
+                // worker contexts are kept alive by a work guard until Stop
+                void StartWorkers() {
+                    if(m_oWorkers.nThreads <= 1 || !m_vWorkers.empty())
+                        return;
+
+                    for(size_t i = 0; i < m_oWorkers.nThreads; i++) {
+                        m_vWorkers.push_back(std::make_unique<asio::io_context>());
+                        m_vWorkGuards.push_back(asio::make_work_guard(*m_vWorkers.back()));
+                    }
+
+                    // thread 0 is the server's own, workers pin from vCores[1] on
+                    for(size_t i = 0; i < m_vWorkers.size(); i++)
+                        m_vWorkerThreads.emplace_back([this, i]() {RunContext(*m_vWorkers[i], m_oLatency, i + 1);});
+
+                    if(m_oWorkers.tBalancePeriod.count() > 0) {
+                        m_pBalanceTimer = std::make_unique<asio::steady_timer>(m_oContext);
+                        ScheduleBalance();
+                    }
+                }
+
+                // sessions whose client went away are dropped by a timer as well as when clients bind,
+                // so a server nobody reconnects to still lets go of their journals
+                void StartJournal() {
+                    if(!m_bJournal || m_pJournalTimer)
+                        return;
+
+                    m_pJournalTimer = std::make_unique<asio::steady_timer>(m_oContext);
+                    ScheduleExpiry();
+                }
+
+                // ASYNC - re-arms itself until the context stops
+                void ScheduleExpiry() {
+                    m_pJournalTimer->expires_after(std::max<std::chrono::steady_clock::duration>(
+                        m_oJournalConfig.tRetention / 2, std::chrono::seconds(1)));
+                    m_pJournalTimer->async_wait(
+                        [this](std::error_code ec) {
+                            if(ec)
+                                return;
+                            {
+                                std::scoped_lock lock(m_muxSessions);
+                                ExpireSessions();
+                            }
+                            ScheduleExpiry();
+                        });
+                }
+
+                asio::io_context& NextWorker() {
+                    if(m_vWorkers.empty())
+                        return m_oContext;
+                    return *m_vWorkers[m_nNextWorker++ % m_vWorkers.size()];
+                }
+
+                // ASYNC - re-arms itself until the context stops
+                void ScheduleBalance() {
+                    m_pBalanceTimer->expires_after(m_oWorkers.tBalancePeriod);
+                    m_pBalanceTimer->async_wait(
+                        [this](std::error_code ec) {
+                            if(ec)
+                                return;
+                            Balance();
+                            ScheduleBalance();
+                        });
+                }
+
+                // Sum the load of each worker's connections over the last period. If the busiest is
+                // well ahead of the quietest, move the connection that best evens them out, one per period
+                void Balance() {
+                    std::vector<uint64_t> vLoad(m_vWorkers.size(), 0);
+                    std::vector<std::pair<std::shared_ptr<connection<T>>, uint64_t>> vSampled;
+
+                    // the update thread drops dead connections as it messages them, sample a copy
+                    std::vector<std::shared_ptr<connection<T>>> vConnections;
+                    {
+                        std::scoped_lock lock(m_muxConnections);
+                        vConnections.assign(m_dqConnections.begin(), m_dqConnections.end());
+                    }
+
+                    for(auto& client : vConnections) {
+                        if(!client || !client->IsConnected())
+                            continue;
+
+                        auto it = std::find_if(m_vWorkers.begin(), m_vWorkers.end(),
+                            [&client](const std::unique_ptr<asio::io_context>& pWorker) {return pWorker.get() == client->Context();});
+                        if(it == m_vWorkers.end())
+                            continue;
+
+                        uint64_t nLoad = client->TakeLoad();
+                        vLoad[size_t(it - m_vWorkers.begin())] += nLoad;
+                        vSampled.emplace_back(client, nLoad);
+                    }
+
+                    size_t nBusiest = size_t(std::max_element(vLoad.begin(), vLoad.end()) - vLoad.begin());
+                    size_t nQuietest = size_t(std::min_element(vLoad.begin(), vLoad.end()) - vLoad.begin());
+                    if(vLoad[nBusiest] < m_oWorkers.nMinLoad || double(vLoad[nBusiest]) <= double(vLoad[nQuietest]) * m_oWorkers.fImbalance)
+                        return;
+
+                    // anything under the whole difference lowers the peak, half of it evens them out
+                    uint64_t nDiff = vLoad[nBusiest] - vLoad[nQuietest];
+                    std::shared_ptr<connection<T>> pMove;
+                    uint64_t nBestDistance = nDiff;
+                    for(auto& [client, nLoad] : vSampled) {
+                        if(client->Context() != m_vWorkers[nBusiest].get() || nLoad == 0 || nLoad >= nDiff)
+                            continue;
+
+                        uint64_t nDistance = nLoad > nDiff / 2 ? nLoad - nDiff / 2 : nDiff / 2 - nLoad;
+                        if(nDistance < nBestDistance) {
+                            nBestDistance = nDistance;
+                            pMove = client;
+                        }
+                    }
+
+                    if(pMove) {
+                        HJW_LOG_INFO("[SERVER] Migrating [{}] from worker {} to {}", pMove->GetID(), nBusiest, nQuietest);
+                        pMove->Migrate(*m_vWorkers[nQuietest]);
+                    }
+                }
+
+                // ASYNC - re-arms itself until the context stops
+                void ScheduleMetricsDump(std::chrono::milliseconds tPeriod, std::function<void(const metrics_snapshot&)> fnDump) {
+                    m_pMetricsTimer->expires_after(tPeriod);
+                    m_pMetricsTimer->async_wait(
+                        [this, tPeriod, fnDump = std::move(fnDump)](std::error_code ec) mutable {
+                            if(ec)
+                                return;
+                            fnDump(MetricsSnapshot());
+                            ScheduleMetricsDump(tPeriod, std::move(fnDump));
+                        });
+                }
+
+                // the acceptor is already listening, listening again updates the backlog. The receive
+                // buffer is set here too so accepted sockets start with it and tcp can scale its window
+                void ConfigureAcceptor() {
+                    if(m_oSocketOptions.nReceiveBuffer > 0) {
+                        int fd = m_oAsioAcceptor.native_handle();
+                        ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &m_oSocketOptions.nReceiveBuffer, sizeof(m_oSocketOptions.nReceiveBuffer));
                     }
+
+                    if(m_oSocketOptions.nBacklog > 0)
+                        m_oAsioAcceptor.listen(m_oSocketOptions.nBacklog);
+                }
+
+                // remove a stale socket file left by a previous run before binding
+                static asio::generic::stream_protocol::endpoint LocalEndpoint(const std::string& sPath) {
+                    ::unlink(sPath.c_str());
+                    return asio::generic::stream_protocol::endpoint(asio::local::stream_protocol::endpoint(sPath));
                 }
 
             protected:
@@ -177,29 +567,278 @@ namespace hjw {
 
                 }
 
+                // Called on the context thread for header_flag::control messages
+                virtual void OnControlMessage(std::shared_ptr<connection<T>> client, message<T>& msg) {
+                    if(msg.body.size() < sizeof(control_header))
+                        return;
+
+                    control_header control;
+                    msg >> control;
+
+                    if(control.nType == control_type::gap_request) {
+                        // the publisher's cache belongs to the server's own context thread
+                        asio::post(m_oContext, [this, client, control]() {
+                            auto it = m_mapPublishers.find(control.nStream);
+                            if(it != m_mapPublishers.end())
+                                it->second->Recover(control, [&client](const message<T>& reply) {client->Send(reply);});
+                        });
+                    }
+                }
+
             public:
                 // Called when a client has been validated
                 virtual void OnClientValidated(std::shared_ptr<connection<T>> client) {
 
                 }
 
+                // Called on the connection's context thread as a client is validated. Puts it in its
+                // logical session, the first connection of a striped client is issued the token its
+                // other stripes join with. Returns false to refuse a token the server did not issue,
+                // or more stripes than the client asked for
+                bool JoinSession(std::shared_ptr<connection<T>> client) {
+                    const handshake& peer = client->PeerHandshake();
+                    uint32_t nSession = client->GetID();
+                    uint64_t nToken = 0;
+
+                    std::scoped_lock lock(m_muxConnections);
+                    if(peer.nStripes > 1 && peer.nStripeToken == 0) {
+                        while(nToken == 0 || m_mapStripeTokens.count(nToken))
+                            nToken = m_oStripeTokenSource();
+                        m_mapStripeTokens[nToken] = nSession;
+
+                        // held until the handshake is done, like the journal's session message
+                        message<T> msg;
+                        msg << control_header{control_type::stripe, nSession, nToken, 0};
+                        msg.header.flags |= header_flag::control;
+                        client->Send(msg);
+                    }else if(peer.nStripes > 1) {
+                        auto it = m_mapStripeTokens.find(peer.nStripeToken);
+                        if(it == m_mapStripeTokens.end()) {
+                            HJW_LOG_WARN("[{}] Unknown stripe token.", client->GetID());
+                            return false;
+                        }
+
+                        nSession = it->second;
+                        if(m_mapLiveSessions[nSession].nJoined >= m_mapLiveSessions[nSession].nStripes) {
+                            HJW_LOG_WARN("[{}] Session {} already has all its stripes.", client->GetID(), nSession);
+                            return false;
+                        }
+                    }
+
+                    client->SetSession(nSession);
+                    live_session& session = m_mapLiveSessions[nSession];
+                    session.vConnections.push_back(client);
+                    session.nJoined++;
+                    if(nToken) {
+                        session.nToken = nToken;
+                        session.nStripes = peer.nStripes;
+                    }
+                    return true;
+                }
+
+                // Called on the context thread once a client is validated, before anything queued for
+                // it is written. Starts or resumes its journaled session when it asked for one
+                void BindSession(std::shared_ptr<connection<T>> client) {
+                    const handshake& peer = client->PeerHandshake();
+                    if(!m_bJournal || !(peer.nCapabilities & capability::resume) || peer.nStripes > 1)
+                        return;
+
+                    // clients bind on whichever worker they run on
+                    std::scoped_lock lock(m_muxSessions);
+                    ExpireSessions();
+
+                    resume_result eResult = resume_result::fresh;
+                    auto it = m_mapSessions.end();
+                    if(peer.nResumeToken) {
+                        it = m_mapSessions.find(peer.nResumeToken);
+                        eResult = it == m_mapSessions.end() ? resume_result::expired : resume_result::resumed;
+                    }
+
+                    if(it == m_mapSessions.end()) {
+                        uint64_t nToken = NewSessionToken();
+                        std::string sPath;
+                        if(!m_oJournalConfig.sDirectory.empty())
+                            sPath = m_oJournalConfig.sDirectory + "/" + std::to_string(nToken) + ".jnl";
+
+                        auto pJournal = std::make_shared<message_journal<T>>();
+                        if(!pJournal->Open(m_oJournalConfig.nBytes, sPath, &m_oJournalStats))
+                            return;
+
+                        it = m_mapSessions.emplace(nToken, journal_session{std::move(pJournal), {}, {}}).first;
+                        m_oJournalStats.nSessions.fetch_add(1, std::memory_order_relaxed);
+                    }else if(auto pOld = it->second.pConnection.lock()) {
+                        // the old connection may not have noticed it is dead yet, it no longer owns the session
+                        pOld->DetachJournal();
+                    }
+
+                    journal_session& session = it->second;
+                    session.pConnection = client;
+                    session.tDetached = {};
+
+                    // the client learns its token, then gets whatever it missed, then new traffic
+                    uint64_t nNext = session.pJournal->Last() + 1;
+                    if(eResult == resume_result::resumed) {
+                        uint64_t nAfter = std::min(peer.nResumeSequence, nNext - 1);
+                        nNext = std::max(nAfter + 1, session.pJournal->Oldest());
+                        if(nNext > nAfter + 1) {
+                            eResult = resume_result::partial;
+                            m_oJournalStats.nPartial.fetch_add(1, std::memory_order_relaxed);
+                        }else {
+                            m_oJournalStats.nResumed.fetch_add(1, std::memory_order_relaxed);
+                        }
+                    }else if(eResult == resume_result::expired) {
+                        m_oJournalStats.nExpired.fetch_add(1, std::memory_order_relaxed);
+                    }
+
+                    message<T> msg;
+                    msg << control_header{control_type::session, uint32_t(eResult), it->first, nNext};
+                    msg.header.flags |= header_flag::control;
+                    client->Send(msg);
+
+                    if(eResult == resume_result::resumed || eResult == resume_result::partial) {
+                        session.pJournal->Replay(nNext - 1, [this, &client](const message<T>& missed) {
+                            client->Send(missed);
+                            m_oJournalStats.nReplayed.fetch_add(1, std::memory_order_relaxed);
+                        });
+                    }
+
+                    client->SetJournal(session.pJournal, it->first);
+                }
+
+            private:
+                // the validated connections of one logical session, a striped client's or a single one
+                struct live_session {
+                    std::vector<std::shared_ptr<connection<T>>> vConnections;
+                    uint64_t nToken = 0;   // stripe token issued to the first connection, 0 when not striped
+                    uint32_t nStripes = 0; // connections the striped client said it would open
+                    uint32_t nJoined = 0;  // connections that have joined, at most nStripes
+                    size_t nCursor = 0;    // next connection MessageSession sends on
+                };
+
+                // Take a dropped connection out of its logical session, the session ends with the
+                // last of them. m_muxConnections is held
+                void LeaveSession(const std::shared_ptr<connection<T>>& client) {
+                    auto it = m_mapLiveSessions.find(client->GetSession());
+                    if(it == m_mapLiveSessions.end())
+                        return;
+
+                    auto& vConnections = it->second.vConnections;
+                    vConnections.erase(std::remove(vConnections.begin(), vConnections.end(), client), vConnections.end());
+                    if(vConnections.empty())
+                        EndSession(it);
+                }
+
+                // forget a session and its stripe token, no later stripe can join it
+                void EndSession(typename std::unordered_map<uint32_t, live_session>::iterator it) {
+                    if(it->second.nToken)
+                        m_mapStripeTokens.erase(it->second.nToken);
+                    m_mapLiveSessions.erase(it);
+                }
+
+                // drop sessions whose client has been gone for longer than tRetention, checked as clients
+                // bind and by the expiry timer, m_muxSessions is held
+                void ExpireSessions() {
+                    auto tNow = std::chrono::steady_clock::now();
+                    for(auto it = m_mapSessions.begin(); it != m_mapSessions.end();) {
+                        auto pConnection = it->second.pConnection.lock();
+                        if(pConnection && pConnection->IsConnected()) {
+                            ++it;
+                            continue;
+                        }
+
+                        if(it->second.tDetached == std::chrono::steady_clock::time_point{})
+                            it->second.tDetached = tNow;
+
+                        if(tNow - it->second.tDetached > m_oJournalConfig.tRetention)
+                            it = m_mapSessions.erase(it);
+                        else
+                            ++it;
+                    }
+                }
+
+                uint64_t NewSessionToken() {
+                    uint64_t nToken = 0;
+                    while(nToken == 0 || m_mapSessions.count(nToken))
+                        nToken = m_oTokenSource();
+                    return nToken;
+                }
+
+                // a journaled session, outlives its connection by journal_config::tRetention
+                struct journal_session {
+                    std::shared_ptr<message_journal<T>> pJournal;
+                    std::weak_ptr<connection<T>> pConnection;
+                    std::chrono::steady_clock::time_point tDetached{};
+                };
+
             protected:
                 // thread safe queue for incoming message packets
                 tsqueue<owned_message<T>> m_qMessagesIn;
 
-                // Container of active connections
+                // worker contexts, declared first so they outlive the connections and any
+                // accept still pending on m_oContext
+                std::vector<std::unique_ptr<asio::io_context>> m_vWorkers;
+                std::vector<asio::executor_work_guard<asio::io_context::executor_type>> m_vWorkGuards;
+
+                // Container of active connections, added to on the context thread and pruned by
+                // the thread messaging clients
+                std::mutex m_muxConnections;
                 std::deque<std::shared_ptr<connection<T>>> m_dqConnections;
 
                 // order of declaration here is also order of initialisation
                 asio::io_context m_oContext; // this context is shared to the connections
                 std::thread m_tContextThread;
 
-                // Used to get the sockets of the clients
-                asio::ip::tcp::acceptor m_oAsioAcceptor;
+                // Used to get the sockets of the clients, tcp or local
+                stream_acceptor m_oAsioAcceptor;
+
+                // what accepted local sockets are turned into
+                transport m_eTransport = transport::tcp;
+                shm_config m_oShmConfig;
 
                 // unique identifier for clients
                 uint32_t nIDCounter = 10000;
 
+                // multicast streams by stream id
+                std::map<uint32_t, std::unique_ptr<multicast_publisher<T>>> m_mapPublishers;
+
+                // payload compression shared by all connections
+                compression_config<T> m_oCompression;
+                compression_stats m_oCompressionStats;
+
+                // context thread run mode and socket options for accepted connections
+                latency_config m_oLatency;
+
+                // socket profile for the acceptor and accepted connections
+                socket_options m_oSocketOptions;
+
+                // validated connections by logical session and the stripe tokens issued, guarded
+                // by m_muxConnections. Connections leave as they are found dropped
+                std::unordered_map<uint32_t, live_session> m_mapLiveSessions;
+                std::unordered_map<uint64_t, uint32_t> m_mapStripeTokens;
+                std::mt19937_64 m_oStripeTokenSource{std::random_device{}()};
+
+                // metrics for all connections, off until EnableMetrics
+                bool m_bMetrics = false;
+                metrics_registry m_oMetrics;
+                std::unique_ptr<asio::steady_timer> m_pMetricsTimer;
+
+                // capture of all connections, idle until StartRecording
+                message_recorder<T> m_oRecorder;
+
+                // connection threads, empty unless SetWorkers asked for more than one
+                worker_config m_oWorkers;
+                std::vector<std::thread> m_vWorkerThreads;
+                size_t m_nNextWorker = 0;
+                std::unique_ptr<asio::steady_timer> m_pBalanceTimer;
+
+                // journaled sessions by token, off until EnableJournal
+                bool m_bJournal = false;
+                journal_config m_oJournalConfig;
+                journal_stats m_oJournalStats;
+                std::mutex m_muxSessions;
+                std::unordered_map<uint64_t, journal_session> m_mapSessions;
+                std::unique_ptr<asio::steady_timer> m_pJournalTimer;
+                std::mt19937_64 m_oTokenSource{std::random_device{}()};
 
         };
     }
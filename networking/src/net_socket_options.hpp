@@ -0,0 +1,91 @@
+#ifndef NET_SOCKET_OPTIONS_H_
+#define NET_SOCKET_OPTIONS_H_
+
+/**
+ * Socket tuning profile for a server or client.
+ *
+ * Applied to every accepted or connected tcp socket, local sockets only take the
+ * buffer sizes. Zero means leave the kernel default.
+ *
+ * With bCork a connection corks its socket when it starts draining the outgoing
+ * queue and uncorks once the queue is empty, so the separate header and body writes
+ * of a batch leave as full segments instead of one small segment per write.
+ */
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+namespace hjw {
+
+    namespace net {
+
+        struct socket_options {
+            // TCP_NODELAY, send small messages straight away rather than waiting to coalesce
+            bool bNoDelay = true;
+
+            // SO_SNDBUF / SO_RCVBUF in bytes, the kernel doubles what is asked for
+            int nSendBuffer = 0;
+            int nReceiveBuffer = 0;
+
+            // SO_KEEPALIVE with the idle time, probe interval and probe count in seconds
+            bool bKeepAlive = false;
+            int nKeepAliveIdle = 0;
+            int nKeepAliveInterval = 0;
+            int nKeepAliveCount = 0;
+
+            // listen backlog for the server acceptor
+            int nBacklog = 0;
+
+            // cork the socket while a batch of queued messages is written
+            bool bCork = false;
+        };
+
+        // Apply a profile to a connected socket, options the socket does not support are ignored
+        template <typename Socket>
+        void ApplySocketOptions(Socket& socket, const socket_options& options) {
+            int fd = socket.native_handle();
+            int nOn = 1;
+
+            if(options.nSendBuffer > 0)
+                ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options.nSendBuffer, sizeof(options.nSendBuffer));
+            if(options.nReceiveBuffer > 0)
+                ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options.nReceiveBuffer, sizeof(options.nReceiveBuffer));
+
+            if(options.bNoDelay)
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nOn, sizeof(nOn));
+
+            if(options.bKeepAlive) {
+                ::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &nOn, sizeof(nOn));
+            #if defined(__linux__)
+                if(options.nKeepAliveIdle > 0)
+                    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &options.nKeepAliveIdle, sizeof(options.nKeepAliveIdle));
+            #elif defined(TCP_KEEPALIVE)
+                if(options.nKeepAliveIdle > 0)
+                    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &options.nKeepAliveIdle, sizeof(options.nKeepAliveIdle));
+            #endif
+            #if defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+                if(options.nKeepAliveInterval > 0)
+                    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &options.nKeepAliveInterval, sizeof(options.nKeepAliveInterval));
+                if(options.nKeepAliveCount > 0)
+                    ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &options.nKeepAliveCount, sizeof(options.nKeepAliveCount));
+            #endif
+            }
+        }
+
+        // TCP_CORK on linux, TCP_NOPUSH on the BSDs. Uncorking flushes whatever is held back
+        template <typename Socket>
+        void SetCork(Socket& socket, bool bCork) {
+            int nValue = bCork ? 1 : 0;
+        #if defined(TCP_CORK)
+            ::setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_CORK, &nValue, sizeof(nValue));
+        #elif defined(TCP_NOPUSH)
+            ::setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_NOPUSH, &nValue, sizeof(nValue));
+        #else
+            (void)socket; (void)nValue;
+        #endif
+        }
+    }
+}
+
+#endif // NET_SOCKET_OPTIONS_H_
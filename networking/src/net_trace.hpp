@@ -0,0 +1,204 @@
+#ifndef NET_TRACE_H_
+#define NET_TRACE_H_
+
+/**
+ * Flight recorder for hjw::net, built when HJW_NET_TRACE is defined (the
+ * HJW_NET_TRACE CMake option). Without it the HJW_TRACE macros expand to
+ * nothing, so there is no cost at all.
+ *
+ * Each thread records into its own ring of nTraceEvents events. Only that thread
+ * writes it, so recording is a few relaxed stores and no locks. The ring keeps the
+ * most recent events and overwrites the oldest. Every slot carries a sequence
+ * number so a dump running next to the writer skips slots it catches half written.
+ *
+ * WriteChromeTrace writes everything still held in the rings as Chrome trace event
+ * JSON, open it in chrome://tracing or ui.perfetto.dev.
+ *
+ *  HJW_TRACE_INSTANT("name", id)   - a point in time
+ *  HJW_TRACE_BEGIN("name", id)     - start of a span on this thread
+ *  HJW_TRACE_END("name", id)       - end of the span
+ *  HJW_TRACE_SCOPE("name", id)     - span for the rest of the enclosing block
+ *
+ * Names must be string literals, id is any integer such as a connection id.
+ */
+
+#if defined(HJW_NET_TRACE)
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace hjw {
+
+    namespace net {
+
+        constexpr size_t nTraceEvents = 1u << 15;
+
+        struct trace_event {
+            const char* sName;
+            uint64_t nTimeNs;
+            uint64_t nId;
+            char cPhase; // 'B', 'E' or 'i' as in the chrome format
+        };
+
+        class trace_buffer {
+            public:
+                explicit trace_buffer(uint32_t nThread) : m_nThread(nThread) {}
+
+                void Record(const char* sName, char cPhase, uint64_t nId) {
+                    uint64_t nIndex = m_nNext++;
+                    slot& s = m_aSlots[nIndex & (nTraceEvents - 1)];
+
+                    // mark the slot as being written before touching the fields
+                    s.nSeq.store(0, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_release);
+
+                    s.sName.store(sName, std::memory_order_relaxed);
+                    s.nTimeNs.store(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count()), std::memory_order_relaxed);
+                    s.nId.store(nId, std::memory_order_relaxed);
+                    s.cPhase.store(cPhase, std::memory_order_relaxed);
+                    s.nSeq.store(nIndex + 1, std::memory_order_release);
+                }
+
+                // copy out every complete slot
+                void Collect(std::vector<trace_event>& vEvents) const {
+                    for(auto& s : m_aSlots) {
+                        uint64_t nBefore = s.nSeq.load(std::memory_order_acquire);
+                        if(nBefore == 0)
+                            continue;
+
+                        trace_event e;
+                        e.sName = s.sName.load(std::memory_order_relaxed);
+                        e.nTimeNs = s.nTimeNs.load(std::memory_order_relaxed);
+                        e.nId = s.nId.load(std::memory_order_relaxed);
+                        e.cPhase = s.cPhase.load(std::memory_order_relaxed);
+
+                        std::atomic_thread_fence(std::memory_order_acquire);
+                        if(s.nSeq.load(std::memory_order_relaxed) == nBefore)
+                            vEvents.push_back(e);
+                    }
+                }
+
+                uint32_t Thread() const {return m_nThread;}
+
+            private:
+                struct slot {
+                    std::atomic<uint64_t> nSeq{0}; // index + 1 of the event held, 0 while empty or being written
+                    std::atomic<const char*> sName{nullptr};
+                    std::atomic<uint64_t> nTimeNs{0};
+                    std::atomic<uint64_t> nId{0};
+                    std::atomic<char> cPhase{0};
+                };
+
+                uint32_t m_nThread;
+                uint64_t m_nNext = 0;
+                std::array<slot, nTraceEvents> m_aSlots;
+        };
+
+        // Owns every thread's ring, rings outlive their threads so a dump still sees them
+        class trace_recorder {
+            public:
+                static trace_recorder& Get() {
+                    static trace_recorder recorder;
+                    return recorder;
+                }
+
+                // the calling thread's ring, registered on first use
+                trace_buffer& ThreadBuffer() {
+                    thread_local trace_buffer* pBuffer = nullptr;
+                    if(!pBuffer) {
+                        std::scoped_lock lock(m_oMux);
+                        m_vBuffers.push_back(std::make_unique<trace_buffer>(uint32_t(m_vBuffers.size() + 1)));
+                        pBuffer = m_vBuffers.back().get();
+                    }
+                    return *pBuffer;
+                }
+
+                // Chrome trace event format, timestamps in microseconds
+                void WriteChromeTrace(std::ostream& os) {
+                    os << "{\"traceEvents\":[";
+                    bool bFirst = true;
+
+                    std::scoped_lock lock(m_oMux);
+                    for(auto& pBuffer : m_vBuffers) {
+                        std::vector<trace_event> vEvents;
+                        pBuffer->Collect(vEvents);
+
+                        for(auto& e : vEvents) {
+                            os << (bFirst ? "" : ",") << "\n{\"name\":\"" << e.sName << "\",\"ph\":\"" << e.cPhase
+                               << "\",\"ts\":" << e.nTimeNs / 1000 << "." << (e.nTimeNs % 1000) / 100 << (e.nTimeNs % 100) / 10 << e.nTimeNs % 10
+                               << ",\"pid\":1,\"tid\":" << pBuffer->Thread();
+                            if(e.cPhase == 'i')
+                                os << ",\"s\":\"t\"";
+                            os << ",\"args\":{\"id\":" << e.nId << "}}";
+                            bFirst = false;
+                        }
+                    }
+                    os << "\n]}\n";
+                }
+
+            private:
+                std::mutex m_oMux;
+                std::vector<std::unique_ptr<trace_buffer>> m_vBuffers;
+        };
+
+        // closes a span when it goes out of scope
+        class trace_scope {
+            public:
+                trace_scope(const char* sName, uint64_t nId) : m_sName(sName), m_nId(nId) {
+                    trace_recorder::Get().ThreadBuffer().Record(m_sName, 'B', m_nId);
+                }
+
+                ~trace_scope() {
+                    trace_recorder::Get().ThreadBuffer().Record(m_sName, 'E', m_nId);
+                }
+
+            private:
+                const char* m_sName;
+                uint64_t m_nId;
+        };
+
+        // Write everything the rings hold, returns false when tracing is compiled out
+        inline bool WriteChromeTrace(std::ostream& os) {
+            trace_recorder::Get().WriteChromeTrace(os);
+            return true;
+        }
+    }
+}
+
+#define HJW_TRACE_CAT2(a, b) a##b
+#define HJW_TRACE_CAT(a, b) HJW_TRACE_CAT2(a, b)
+
+#define HJW_TRACE_INSTANT(name, id) ::hjw::net::trace_recorder::Get().ThreadBuffer().Record(name, 'i', uint64_t(id))
+#define HJW_TRACE_BEGIN(name, id) ::hjw::net::trace_recorder::Get().ThreadBuffer().Record(name, 'B', uint64_t(id))
+#define HJW_TRACE_END(name, id) ::hjw::net::trace_recorder::Get().ThreadBuffer().Record(name, 'E', uint64_t(id))
+#define HJW_TRACE_SCOPE(name, id) ::hjw::net::trace_scope HJW_TRACE_CAT(hjwTraceScope, __LINE__)(name, uint64_t(id))
+
+#else
+
+#include <ostream>
+
+namespace hjw {
+
+    namespace net {
+
+        inline bool WriteChromeTrace(std::ostream&) {
+            return false;
+        }
+    }
+}
+
+#define HJW_TRACE_INSTANT(name, id) ((void)0)
+#define HJW_TRACE_BEGIN(name, id) ((void)0)
+#define HJW_TRACE_END(name, id) ((void)0)
+#define HJW_TRACE_SCOPE(name, id) ((void)0)
+
+#endif
+
+#endif // NET_TRACE_H_
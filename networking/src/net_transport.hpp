@@ -0,0 +1,578 @@
+#ifndef NET_TRANSPORT_H_
+#define NET_TRANSPORT_H_
+
+/**
+ * Byte streams a connection<T> can run over.
+ *
+ * tcp   - the default, any host
+ * local - AF_UNIX stream socket, same host, skips the loopback TCP stack
+ * shm   - a pair of single producer / single consumer byte rings in shared memory,
+ *         same host. Peers only make a syscall to wake the other side when it is
+ *         actually asleep, so a busy stream moves messages without entering the kernel.
+ *
+ * tcp and local both use asio's generic stream socket. The shm transport starts out
+ * as a local connection, the server then passes a memfd holding both rings and four
+ * eventfds over it with SCM_RIGHTS. The socket is kept open so either side notices
+ * when the other goes away.
+ *
+ * transport_stream wraps whichever is in use and provides async_read_some and
+ * async_write_some, so asio::async_read / async_write work on it unchanged.
+ */
+
+#include "net_utils.hpp"
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <sstream>
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#endif
+
+#include <unistd.h>
+
+namespace hjw {
+
+    namespace net {
+
+        enum class transport {tcp, local, shm};
+
+        struct shm_config {
+            // bytes in each direction, must be a power of two
+            size_t nRingSize = 1u << 20;
+        };
+
+        using stream_socket = asio::generic::stream_protocol::socket;
+        using stream_acceptor = asio::basic_socket_acceptor<asio::generic::stream_protocol>;
+
+        // printable form of a generic endpoint, for logging
+        inline std::string DescribeEndpoint(const asio::generic::stream_protocol::endpoint& endpoint) {
+            std::ostringstream os;
+            if(endpoint.protocol().family() == AF_INET) {
+                asio::ip::tcp::endpoint tcp;
+                std::memcpy(tcp.data(), endpoint.data(), endpoint.size());
+                os << tcp;
+            }else if(endpoint.protocol().family() == AF_INET6) {
+                asio::ip::tcp::endpoint tcp(asio::ip::tcp::v6(), 0);
+                std::memcpy(tcp.data(), endpoint.data(), endpoint.size());
+                os << tcp;
+            }else {
+                os << "local";
+            }
+            return os.str();
+        }
+
+    #if defined(__linux__)
+
+        // One direction of a shm_stream. Positions only ever grow, the data offset is
+        // position & (size - 1). Each counter sits on its own cache line so the
+        // producer and consumer do not fight over them.
+        struct shm_ring {
+            alignas(64) std::atomic<uint64_t> nHead{0}; // bytes written, owned by the producer
+            alignas(64) std::atomic<uint64_t> nTail{0}; // bytes read, owned by the consumer
+            alignas(64) std::atomic<uint32_t> bReaderWaiting{0}; // consumer is asleep on its data eventfd
+            alignas(64) std::atomic<uint32_t> bWriterWaiting{0}; // producer is asleep on its space eventfd
+        };
+
+        class shm_stream {
+            public:
+                shm_stream(asio::io_context& asioContext)
+                    : m_oAsioContext(asioContext), m_oDataWake(asioContext), m_oSpaceWake(asioContext)
+                {
+
+                }
+
+                shm_stream(const shm_stream&) = delete;
+
+                ~shm_stream() {
+                    Close();
+                    if(m_pMapping)
+                        ::munmap(m_pMapping, m_nMappingSize);
+                    if(m_nPeerDataFd >= 0)
+                        ::close(m_nPeerDataFd);
+                    if(m_nPeerSpaceFd >= 0)
+                        ::close(m_nPeerSpaceFd);
+                }
+
+                // Server side, create the rings and hand them to the client over a freshly accepted local socket
+                static std::unique_ptr<shm_stream> Offer(asio::io_context& asioContext, stream_socket& control, const shm_config& config) {
+                    size_t nRingSize = config.nRingSize;
+                    if(nRingSize == 0 || (nRingSize & (nRingSize - 1)) != 0)
+                        return nullptr;
+
+                    int nMemFd = ::memfd_create("hjw_net_shm", MFD_CLOEXEC);
+                    if(nMemFd < 0)
+                        return nullptr;
+
+                    size_t nMappingSize = 2 * (sizeof(shm_ring) + nRingSize);
+                    int fds[5] = {nMemFd, -1, -1, -1, -1};
+                    bool bOk = ::ftruncate(nMemFd, off_t(nMappingSize)) == 0;
+
+                    // data and space eventfds for the server (0) and client (1)
+                    for(int i = 1; i < 5 && bOk; i++) {
+                        fds[i] = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                        bOk = fds[i] >= 0;
+                    }
+
+                    std::unique_ptr<shm_stream> pStream;
+                    if(bOk) {
+                        pStream = std::make_unique<shm_stream>(asioContext);
+                        bOk = pStream->Map(nMemFd, nRingSize, true) && SendFds(control, nRingSize, fds);
+                    }
+
+                    if(bOk)
+                        bOk = pStream->Attach(0, fds[1], fds[2], fds[3], fds[4], control);
+
+                    // the mapping keeps the memory alive, every eventfd now belongs to the stream
+                    ::close(nMemFd);
+                    if(!bOk) {
+                        for(int i = 1; i < 5; i++)
+                            if(fds[i] >= 0)
+                                ::close(fds[i]);
+                        return nullptr;
+                    }
+                    return pStream;
+                }
+
+                // Client side, receive the rings over a connected local socket
+                static std::unique_ptr<shm_stream> Join(asio::io_context& asioContext, stream_socket& control) {
+                    uint64_t nRingSize = 0;
+                    int fds[5] = {-1, -1, -1, -1, -1};
+                    if(!RecvFds(control, nRingSize, fds))
+                        return nullptr;
+
+                    auto pStream = std::make_unique<shm_stream>(asioContext);
+                    bool bOk = pStream->Map(fds[0], nRingSize, false) && pStream->Attach(1, fds[3], fds[4], fds[1], fds[2], control);
+                    ::close(fds[0]);
+                    if(!bOk) {
+                        for(int i = 1; i < 5; i++)
+                            ::close(fds[i]);
+                        return nullptr;
+                    }
+                    return pStream;
+                }
+
+                // Stop local operations, anything waiting completes with operation_aborted
+                void Close() {
+                    if(*m_pClosed)
+                        return;
+                    *m_pClosed = true;
+
+                    asio::error_code ec;
+                    m_oDataWake.close(ec);
+                    m_oSpaceWake.close(ec);
+                }
+
+            public:
+                // Asynchronous read, completes as soon as any bytes are available
+                template <typename MutableBufferSequence, typename Handler>
+                void AsyncRead(const MutableBufferSequence& buffers, Handler handler) {
+                    if(*m_pClosed)
+                        return Complete(std::move(handler), asio::error::operation_aborted, 0);
+
+                    size_t nRead = ReadRing(buffers);
+                    if(nRead > 0 || asio::buffer_size(buffers) == 0)
+                        return Complete(std::move(handler), asio::error_code(), nRead);
+
+                    if(m_bPeerClosed)
+                        return Complete(std::move(handler), asio::error::eof, 0);
+
+                    // announce we are going to sleep, then look again so a write that
+                    // raced past the first check is not missed
+                    m_pRx->bReaderWaiting.store(1, std::memory_order_seq_cst);
+                    nRead = ReadRing(buffers);
+                    if(nRead > 0) {
+                        m_pRx->bReaderWaiting.store(0, std::memory_order_relaxed);
+                        return Complete(std::move(handler), asio::error_code(), nRead);
+                    }
+
+                    // reading the eventfd consumes the wake up, a signal sent before this
+                    // is queued still completes it straight away
+                    m_oDataWake.async_read_some(asio::buffer(&m_nDataWake, sizeof(uint64_t)),
+                        [this, pClosed = m_pClosed, buffers, handler = std::move(handler)](asio::error_code, std::size_t) mutable {
+                            if(*pClosed)
+                                return handler(asio::error_code(asio::error::operation_aborted), 0);
+
+                            m_pRx->bReaderWaiting.store(0, std::memory_order_relaxed);
+                            AsyncRead(buffers, std::move(handler));
+                        });
+                }
+
+                // Asynchronous write, completes as soon as any bytes fit in the ring
+                template <typename ConstBufferSequence, typename Handler>
+                void AsyncWrite(const ConstBufferSequence& buffers, Handler handler) {
+                    if(*m_pClosed)
+                        return Complete(std::move(handler), asio::error::operation_aborted, 0);
+
+                    if(m_bPeerClosed)
+                        return Complete(std::move(handler), asio::error::broken_pipe, 0);
+
+                    size_t nWritten = WriteRing(buffers);
+                    if(nWritten > 0 || asio::buffer_size(buffers) == 0)
+                        return Complete(std::move(handler), asio::error_code(), nWritten);
+
+                    m_pTx->bWriterWaiting.store(1, std::memory_order_seq_cst);
+                    nWritten = WriteRing(buffers);
+                    if(nWritten > 0) {
+                        m_pTx->bWriterWaiting.store(0, std::memory_order_relaxed);
+                        return Complete(std::move(handler), asio::error_code(), nWritten);
+                    }
+
+                    m_oSpaceWake.async_read_some(asio::buffer(&m_nSpaceWake, sizeof(uint64_t)),
+                        [this, pClosed = m_pClosed, buffers, handler = std::move(handler)](asio::error_code, std::size_t) mutable {
+                            if(*pClosed)
+                                return handler(asio::error_code(asio::error::operation_aborted), 0);
+
+                            m_pTx->bWriterWaiting.store(0, std::memory_order_relaxed);
+                            AsyncWrite(buffers, std::move(handler));
+                        });
+                }
+
+            private:
+                bool Map(int nMemFd, size_t nRingSize, bool bInitialise) {
+                    m_nRingSize = nRingSize;
+                    m_nMappingSize = 2 * (sizeof(shm_ring) + nRingSize);
+                    void* pMapping = ::mmap(nullptr, m_nMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, nMemFd, 0);
+                    if(pMapping == MAP_FAILED)
+                        return false;
+
+                    m_pMapping = static_cast<uint8_t*>(pMapping);
+                    if(bInitialise) {
+                        new (Ring(0)) shm_ring();
+                        new (Ring(1)) shm_ring();
+                    }
+                    return true;
+                }
+
+                // side 0 is the server, it writes ring 0 and reads ring 1
+                bool Attach(int nSide, int nDataFd, int nSpaceFd, int nPeerDataFd, int nPeerSpaceFd, stream_socket& control) {
+                    m_pTx = Ring(nSide);
+                    m_pRx = Ring(1 - nSide);
+                    m_pTxData = reinterpret_cast<uint8_t*>(m_pTx) + sizeof(shm_ring);
+                    m_pRxData = reinterpret_cast<uint8_t*>(m_pRx) + sizeof(shm_ring);
+
+                    m_oDataWake.assign(nDataFd);
+                    m_oSpaceWake.assign(nSpaceFd);
+                    m_nPeerDataFd = nPeerDataFd;
+                    m_nPeerSpaceFd = nPeerSpaceFd;
+
+                    WatchPeer(control);
+                    return true;
+                }
+
+                shm_ring* Ring(int nIndex) {
+                    return reinterpret_cast<shm_ring*>(m_pMapping + nIndex * (sizeof(shm_ring) + m_nRingSize));
+                }
+
+                // Nothing is ever sent on the local socket once the rings are up, so any
+                // completion on it means the peer has closed. The socket belongs to the
+                // transport_stream and may outlive this stream, its aborted read then finds
+                // the closed flag and leaves this alone
+                void WatchPeer(stream_socket& control) {
+                    control.async_read_some(asio::buffer(&m_nControlByte, 1),
+                        [this, pClosed = m_pClosed](asio::error_code, std::size_t) {
+                            if(*pClosed)
+                                return;
+                            m_bPeerClosed = true;
+
+                            // kick any waiting reader so it can drain the ring and report eof
+                            asio::error_code ignored;
+                            m_oDataWake.cancel(ignored);
+                            m_oSpaceWake.cancel(ignored);
+                        });
+                }
+
+                template <typename MutableBufferSequence>
+                size_t ReadRing(const MutableBufferSequence& buffers) {
+                    uint64_t nTail = m_pRx->nTail.load(std::memory_order_relaxed);
+                    uint64_t nAvailable = m_pRx->nHead.load(std::memory_order_acquire) - nTail;
+                    if(nAvailable == 0)
+                        return 0;
+
+                    size_t nCopied = 0;
+                    for(auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers) && nAvailable > 0; ++it) {
+                        asio::mutable_buffer buffer(*it);
+                        size_t nCount = std::min<size_t>(buffer.size(), nAvailable);
+                        CopyFromRing(static_cast<uint8_t*>(buffer.data()), nTail + nCopied, nCount);
+                        nCopied += nCount;
+                        nAvailable -= nCount;
+                    }
+
+                    m_pRx->nTail.store(nTail + nCopied, std::memory_order_seq_cst);
+
+                    // the producer went to sleep on a full ring, there is room now
+                    if(m_pRx->bWriterWaiting.load(std::memory_order_seq_cst))
+                        Signal(m_nPeerSpaceFd);
+
+                    return nCopied;
+                }
+
+                template <typename ConstBufferSequence>
+                size_t WriteRing(const ConstBufferSequence& buffers) {
+                    uint64_t nHead = m_pTx->nHead.load(std::memory_order_relaxed);
+                    uint64_t nSpace = m_nRingSize - (nHead - m_pTx->nTail.load(std::memory_order_acquire));
+                    if(nSpace == 0)
+                        return 0;
+
+                    size_t nCopied = 0;
+                    for(auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers) && nSpace > 0; ++it) {
+                        asio::const_buffer buffer(*it);
+                        size_t nCount = std::min<size_t>(buffer.size(), nSpace);
+                        CopyToRing(static_cast<const uint8_t*>(buffer.data()), nHead + nCopied, nCount);
+                        nCopied += nCount;
+                        nSpace -= nCount;
+                    }
+
+                    m_pTx->nHead.store(nHead + nCopied, std::memory_order_seq_cst);
+
+                    // only pay for the syscall when the consumer is actually asleep
+                    if(m_pTx->bReaderWaiting.load(std::memory_order_seq_cst))
+                        Signal(m_nPeerDataFd);
+
+                    return nCopied;
+                }
+
+                void CopyFromRing(uint8_t* pOut, uint64_t nPosition, size_t nCount) {
+                    size_t nOffset = size_t(nPosition & (m_nRingSize - 1));
+                    size_t nFirst = std::min(nCount, m_nRingSize - nOffset);
+                    std::memcpy(pOut, m_pRxData + nOffset, nFirst);
+                    std::memcpy(pOut + nFirst, m_pRxData, nCount - nFirst);
+                }
+
+                void CopyToRing(const uint8_t* pIn, uint64_t nPosition, size_t nCount) {
+                    size_t nOffset = size_t(nPosition & (m_nRingSize - 1));
+                    size_t nFirst = std::min(nCount, m_nRingSize - nOffset);
+                    std::memcpy(m_pTxData + nOffset, pIn, nFirst);
+                    std::memcpy(m_pTxData, pIn + nFirst, nCount - nFirst);
+                }
+
+                static void Signal(int nFd) {
+                    uint64_t nOne = 1;
+                    ssize_t nResult = ::write(nFd, &nOne, sizeof(uint64_t));
+                    (void)nResult;
+                }
+
+                // completion handlers are never called from inside the initiating function
+                template <typename Handler>
+                void Complete(Handler handler, asio::error_code ec, std::size_t nLength) {
+                    asio::post(m_oAsioContext,
+                        [handler = std::move(handler), ec, nLength]() mutable {
+                            handler(ec, nLength);
+                        });
+                }
+
+                static bool SendFds(stream_socket& control, uint64_t nRingSize, const int (&fds)[5]) {
+                    iovec iov{&nRingSize, sizeof(uint64_t)};
+                    alignas(cmsghdr) char control_buffer[CMSG_SPACE(sizeof(fds))];
+                    std::memset(control_buffer, 0, sizeof(control_buffer));
+
+                    msghdr msg{};
+                    msg.msg_iov = &iov;
+                    msg.msg_iovlen = 1;
+                    msg.msg_control = control_buffer;
+                    msg.msg_controllen = sizeof(control_buffer);
+
+                    cmsghdr* pHeader = CMSG_FIRSTHDR(&msg);
+                    pHeader->cmsg_level = SOL_SOCKET;
+                    pHeader->cmsg_type = SCM_RIGHTS;
+                    pHeader->cmsg_len = CMSG_LEN(sizeof(fds));
+                    std::memcpy(CMSG_DATA(pHeader), fds, sizeof(fds));
+
+                    return ::sendmsg(control.native_handle(), &msg, MSG_NOSIGNAL) == ssize_t(sizeof(uint64_t));
+                }
+
+                static bool RecvFds(stream_socket& control, uint64_t& nRingSize, int (&fds)[5]) {
+                    iovec iov{&nRingSize, sizeof(uint64_t)};
+                    alignas(cmsghdr) char control_buffer[CMSG_SPACE(sizeof(fds))];
+
+                    msghdr msg{};
+                    msg.msg_iov = &iov;
+                    msg.msg_iovlen = 1;
+                    msg.msg_control = control_buffer;
+                    msg.msg_controllen = sizeof(control_buffer);
+
+                    // the offer is sent as soon as the server accepts, wait for it
+                    if(::recvmsg(control.native_handle(), &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != ssize_t(sizeof(uint64_t)))
+                        return false;
+
+                    cmsghdr* pHeader = CMSG_FIRSTHDR(&msg);
+                    if(!pHeader || pHeader->cmsg_type != SCM_RIGHTS || pHeader->cmsg_len != CMSG_LEN(sizeof(fds)))
+                        return false;
+
+                    std::memcpy(fds, CMSG_DATA(pHeader), sizeof(fds));
+                    return nRingSize != 0 && (nRingSize & (nRingSize - 1)) == 0;
+                }
+
+            private:
+                asio::io_context& m_oAsioContext;
+
+                // our own eventfds, signalled by the peer
+                asio::posix::stream_descriptor m_oDataWake;
+                asio::posix::stream_descriptor m_oSpaceWake;
+                uint64_t m_nDataWake = 0;
+                uint64_t m_nSpaceWake = 0;
+
+                // the peer's eventfds, we signal them
+                int m_nPeerDataFd = -1;
+                int m_nPeerSpaceFd = -1;
+
+                uint8_t* m_pMapping = nullptr;
+                size_t m_nMappingSize = 0;
+                size_t m_nRingSize = 0;
+
+                shm_ring* m_pTx = nullptr;
+                shm_ring* m_pRx = nullptr;
+                uint8_t* m_pTxData = nullptr;
+                uint8_t* m_pRxData = nullptr;
+
+                char m_nControlByte = 0;
+
+                // shared with the handlers still queued on the context, which can run after this
+                // stream is destroyed and must not touch it once it is closed
+                std::shared_ptr<bool> m_pClosed = std::make_shared<bool>(false);
+                bool m_bPeerClosed = false;
+        };
+
+    #else
+
+        // no memfd / eventfd, shared memory setup always fails and callers stay on the socket
+        class shm_stream {
+            public:
+                static std::unique_ptr<shm_stream> Offer(asio::io_context&, stream_socket&, const shm_config&) {
+                    return nullptr;
+                }
+
+                static std::unique_ptr<shm_stream> Join(asio::io_context&, stream_socket&) {
+                    return nullptr;
+                }
+        };
+
+    #endif
+
+        // The byte stream owned by a connection<T>
+        class transport_stream {
+            public:
+                using executor_type = stream_socket::executor_type;
+
+                explicit transport_stream(asio::io_context& asioContext)
+                    : m_oSocket(asioContext)
+                {
+
+                }
+
+                explicit transport_stream(stream_socket socket)
+                    : m_oSocket(std::move(socket))
+                {
+
+                }
+
+                transport_stream(stream_socket socket, std::unique_ptr<shm_stream> pShm)
+                    : m_oSocket(std::move(socket)), m_pShm(std::move(pShm))
+                {
+
+                }
+
+                transport_stream(transport_stream&&) = default;
+                transport_stream& operator=(transport_stream&&) = default;
+
+                // the shm stream is declared after the socket and goes first, so the read
+                // watching the peer is aborted here while the stream is still there
+                ~transport_stream() {
+                    close();
+                }
+
+                executor_type get_executor() {
+                    return m_oSocket.get_executor();
+                }
+
+                // the underlying socket, for a shm stream this is the local socket used to watch the peer
+                stream_socket& socket() {
+                    return m_oSocket;
+                }
+
+                transport kind() const {
+                #if defined(__linux__)
+                    if(m_pShm)
+                        return transport::shm;
+                #endif
+                    asio::error_code ec;
+                    if(m_oSocket.is_open() && m_oSocket.local_endpoint(ec).protocol().family() == AF_UNIX)
+                        return transport::local;
+                    return transport::tcp;
+                }
+
+                bool is_open() const {
+                    return m_oSocket.is_open();
+                }
+
+                // Hand the socket over to another context. Nothing may be in flight on it, shm
+                // streams are tied to their context and cannot move
+                bool move_to(asio::io_context& asioContext, asio::error_code& ec) {
+                #if defined(__linux__)
+                    if(m_pShm)
+                        return false;
+                #endif
+                    auto protocol = m_oSocket.local_endpoint(ec).protocol();
+                    if(ec)
+                        return false;
+
+                    // leaves the old reactor without closing the descriptor
+                    auto fd = m_oSocket.release(ec);
+                    if(ec)
+                        return false;
+
+                    stream_socket moved(asioContext);
+                    moved.assign(protocol, fd, ec);
+                    if(ec) {
+                        ::close(fd);
+                        return false;
+                    }
+
+                    m_oSocket = std::move(moved);
+                    return true;
+                }
+
+                void close() {
+                #if defined(__linux__)
+                    if(m_pShm)
+                        m_pShm->Close();
+                #endif
+                    asio::error_code ec;
+                    m_oSocket.close(ec);
+                }
+
+                template <typename MutableBufferSequence, typename ReadToken>
+                auto async_read_some(const MutableBufferSequence& buffers, ReadToken&& token) {
+                    return asio::async_initiate<ReadToken, void(asio::error_code, std::size_t)>(
+                        [this](auto handler, const MutableBufferSequence& buffers) {
+                        #if defined(__linux__)
+                            if(m_pShm)
+                                return m_pShm->AsyncRead(buffers, std::move(handler));
+                        #endif
+                            m_oSocket.async_read_some(buffers, std::move(handler));
+                        }, token, buffers);
+                }
+
+                template <typename ConstBufferSequence, typename WriteToken>
+                auto async_write_some(const ConstBufferSequence& buffers, WriteToken&& token) {
+                    return asio::async_initiate<WriteToken, void(asio::error_code, std::size_t)>(
+                        [this](auto handler, const ConstBufferSequence& buffers) {
+                        #if defined(__linux__)
+                            if(m_pShm)
+                                return m_pShm->AsyncWrite(buffers, std::move(handler));
+                        #endif
+                            m_oSocket.async_write_some(buffers, std::move(handler));
+                        }, token, buffers);
+                }
+
+            private:
+                stream_socket m_oSocket;
+                std::unique_ptr<shm_stream> m_pShm;
+        };
+    }
+}
+
+#endif // NET_TRANSPORT_H_
@@ -37,23 +37,34 @@ namespace hjw {
 
                 // Add item to back of queue
                 void push_back(const T& item) {
-                    std::scoped_lock lock(m_oMuxQueue);
-                    m_oDeqQueue.emplace_back(std::move(item));
+                    {
+                        std::scoped_lock lock(m_oMuxQueue);
+                        m_oDeqQueue.emplace_back(std::move(item));
+                    }
 
                     // signal condition variable to wake up
-                    // unlocking the mutex protecting m_cvBlocking
-                    std::unique_lock<std::mutex> ul(m_oMuxBlocking);
-                    m_cvBlocking.notify_one();
+                    Notify();
+                }
+
+                // Move item to back of queue
+                void push_back(T&& item) {
+                    {
+                        std::scoped_lock lock(m_oMuxQueue);
+                        m_oDeqQueue.emplace_back(std::move(item));
+                    }
+
+                    Notify();
                 }
 
                 // Add item to the front of queue
                 void push_front(const T& item) {
-                    std::scoped_lock lock(m_oMuxQueue);
-                    m_oDeqQueue.emplace_front(std::move(item));
+                    {
+                        std::scoped_lock lock(m_oMuxQueue);
+                        m_oDeqQueue.emplace_front(std::move(item));
+                    }
 
                     // signal conditon varaible to wake up
-                    std::unique_lock<std::mutex> ul(m_oMuxBlocking);
-                    m_cvBlocking.notify_one();
+                    Notify();
                 }
 
                 // Is queue empty
@@ -91,12 +102,25 @@ namespace hjw {
                 }
 
                 void wait() {
-                    while(empty()) {
-                        // we can use the condition variable to block the server
-                        // Then we can unlock the mutex to wake up the server
-                        std::unique_lock<std::mutex> ul(m_oMuxBlocking);
-                        m_cvBlocking.wait(ul);
-                    }
+                    // we can use the condition variable to block the server
+                    // the emptiness check is made holding m_oMuxBlocking, so a push
+                    // cannot notify between the check and the wait
+                    std::unique_lock<std::mutex> ul(m_oMuxBlocking);
+                    m_cvBlocking.wait(ul, [this]() {return !empty();});
+                }
+
+                // Block until the queue has an item or the timeout passes, true if there is an item
+                template <typename Rep, typename Period>
+                bool wait_for(const std::chrono::duration<Rep, Period>& tTimeout) {
+                    std::unique_lock<std::mutex> ul(m_oMuxBlocking);
+                    return m_cvBlocking.wait_for(ul, tTimeout, [this]() {return !empty();});
+                }
+
+            protected:
+                // the queue lock is released first, waiters take m_oMuxBlocking then m_oMuxQueue
+                void Notify() {
+                    std::unique_lock<std::mutex> ul(m_oMuxBlocking);
+                    m_cvBlocking.notify_one();
                 }
 
             protected:
@@ -0,0 +1,471 @@
+#ifndef NET_UDP_H_
+#define NET_UDP_H_
+
+/**
+ * Datagram channel carrying the same message<T> framing as connection<T>.
+ *
+ * Meant for loss tolerant updates where only the newest value matters, so there is
+ * no retransmission and no ordering beyond dropping stale datagrams.
+ *
+ * Every datagram starts with a datagram_header followed by one or more packed
+ * messages (message_header<T> then body). Messages sent within the same context
+ * turn are packed together up to nMaxPayload bytes, and the finished datagrams are
+ * handed to the kernel with one sendmmsg call. The receive side drains the socket
+ * with recvmmsg and drops any datagram whose sequence number is not newer than the
+ * last one seen from the same sender. Each channel picks a random epoch when it is
+ * made, a sender that restarts on the same endpoint starts a new epoch and is
+ * accepted from its first datagram again. Senders not heard from for tSenderIdle
+ * are forgotten.
+ */
+
+#include "net_utils.hpp"
+#include "net_message.hpp"
+#include "net_tsQueue.hpp"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#endif
+
+namespace hjw {
+
+    namespace net {
+
+        struct udp_config {
+            // largest datagram payload, 1500 byte ethernet MTU minus IPv4 and UDP headers
+            // both ends must agree, larger datagrams are truncated by the receiver and dropped
+            size_t nMaxPayload = 1472;
+
+            // datagrams handed to the kernel per sendmmsg / recvmmsg call
+            size_t nBatch = 32;
+
+            // a sender silent for this long is forgotten, its next datagram is accepted whatever its sequence
+            std::chrono::seconds tSenderIdle{60};
+        };
+
+        struct datagram_header {
+            uint32_t nMagic = 0x484A5755; // "HJWU"
+            uint32_t nCount = 0; // messages packed in this datagram
+            uint64_t nSequence = 0; // per sender, increases by one for every datagram
+            uint64_t nEpoch = 0; // random per sending channel, a new one means the sender restarted
+        };
+
+        struct udp_stats {
+            std::atomic<uint64_t> nMessagesSent{0};
+            std::atomic<uint64_t> nDatagramsSent{0};
+            std::atomic<uint64_t> nSendCalls{0}; // sendmmsg calls, nDatagramsSent / nSendCalls is the batch size
+            std::atomic<uint64_t> nMessagesReceived{0};
+            std::atomic<uint64_t> nDatagramsReceived{0};
+            std::atomic<uint64_t> nStaleDropped{0}; // datagrams older than one already delivered
+            std::atomic<uint64_t> nSenderRestarts{0}; // known senders seen with a new epoch
+            std::atomic<uint64_t> nSendersExpired{0}; // senders forgotten after tSenderIdle
+            std::atomic<uint64_t> nMalformedDropped{0}; // bad magic, truncated or inconsistent sizes
+            std::atomic<uint64_t> nOversizeDropped{0}; // messages that can never fit in one datagram
+        };
+
+        template <typename T>
+        class udp_channel {
+            public:
+                // Incoming messages are pushed to qIn with a null remote, so a client
+                // can share its TCP incoming queue with the channel
+                udp_channel(asio::io_context& asioContext, tsqueue<owned_message<T>>& qIn, udp_config config = {})
+                    : m_oAsioContext(asioContext), m_oSocket(asioContext), m_qMessagesIn(qIn), m_oConfig(config),
+                      m_nEpoch(std::mt19937_64{std::random_device{}()}() | 1)
+                {
+
+                }
+
+                virtual ~udp_channel() {}
+
+                udp_channel(const udp_channel&) = delete;
+
+            public:
+                // Bind to a local port (0 picks any) and start receiving
+                bool Open(uint16_t nLocalPort = 0) {
+                    try {
+                        m_oSocket.open(asio::ip::udp::v4());
+                        m_oSocket.bind(asio::ip::udp::endpoint(asio::ip::udp::v4(), nLocalPort));
+
+                        // all sends and receives are done by hand with the batched syscalls
+                        m_oSocket.non_blocking(true);
+                    }catch(std::exception& e) {
+                        HJW_LOG_ERROR("[UDP] Open exception: {}", e.what());
+                        return false;
+                    }
+
+                    m_vRecvSlots.resize(m_oConfig.nBatch);
+                    for(auto& slot : m_vRecvSlots)
+                        slot.vData.resize(m_oConfig.nMaxPayload);
+
+                    WaitForDatagrams();
+                    return true;
+                }
+
+                // Set the default destination used by Send
+                bool Connect(const std::string& host, const uint16_t port) {
+                    try {
+                        asio::ip::udp::resolver resolver(m_oAsioContext);
+                        m_oRemote = *resolver.resolve(asio::ip::udp::v4(), host, std::to_string(port)).begin();
+                    }catch(std::exception& e) {
+                        HJW_LOG_ERROR("[UDP] Resolve exception: {}", e.what());
+                        return false;
+                    }
+                    return true;
+                }
+
+                void Close() {
+                    asio::post(m_oAsioContext, [this]() {m_oSocket.close();});
+                }
+
+                bool IsOpen() const {
+                    return m_oSocket.is_open();
+                }
+
+                uint16_t LocalPort() const {
+                    return m_oSocket.local_endpoint().port();
+                }
+
+                const udp_stats& Stats() const {
+                    return m_oStats;
+                }
+
+            public:
+                // send message to the default destination
+                void Send(const message<T>& msg) {
+                    SendTo(m_oRemote, msg);
+                }
+
+                // send message to a specific destination
+                void SendTo(const asio::ip::udp::endpoint& remote, const message<T>& msg) {
+                    asio::post(m_oAsioContext,
+                        [this, remote, msg]() {
+                            Pack(remote, msg);
+
+                            // flush once all the sends already queued on the context have been packed
+                            if(!m_bFlushPending) {
+                                m_bFlushPending = true;
+                                asio::post(m_oAsioContext, [this]() {Flush();});
+                            }
+                        });
+                }
+
+            private:
+                struct pending_datagram {
+                    asio::ip::udp::endpoint remote;
+                    std::vector<uint8_t> vData;
+                };
+
+                // what was last delivered from one sender
+                struct sender_state {
+                    uint64_t nEpoch = 0;
+                    uint64_t nLast = 0;
+                    std::chrono::steady_clock::time_point tSeen;
+                };
+
+                struct recv_slot {
+                    std::vector<uint8_t> vData;
+                #if defined(__linux__)
+                    sockaddr_storage oAddr;
+                #endif
+                };
+
+                // Append a message to the open datagram for this destination, or start a new one
+                void Pack(const asio::ip::udp::endpoint& remote, const message<T>& msg) {
+                    size_t nFramed = sizeof(message_header<T>) + msg.body.size();
+                    if(sizeof(datagram_header) + nFramed > m_oConfig.nMaxPayload) {
+                        m_oStats.nOversizeDropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+
+                    pending_datagram* pDatagram = nullptr;
+                    // datagrams before m_nFlushed are already with the kernel
+                    if(m_nPending > m_nFlushed) {
+                        pending_datagram& last = m_vPending[m_nPending - 1];
+                        if(last.remote == remote && last.vData.size() + nFramed <= m_oConfig.nMaxPayload)
+                            pDatagram = &last;
+                    }
+
+                    if(!pDatagram) {
+                        // reuse datagram buffers from earlier flushes where possible
+                        if(m_nPending == m_vPending.size())
+                            m_vPending.emplace_back();
+
+                        pDatagram = &m_vPending[m_nPending++];
+                        pDatagram->remote = remote;
+                        pDatagram->vData.clear();
+                        pDatagram->vData.resize(sizeof(datagram_header));
+                    }
+
+                    // sizes on the wire always describe the message as sent
+                    message_header<T> header = msg.header;
+                    header.size = uint32_t(nFramed);
+                    header.flags = 0;
+
+                    size_t i = pDatagram->vData.size();
+                    pDatagram->vData.resize(i + nFramed);
+                    std::memcpy(pDatagram->vData.data() + i, &header, sizeof(message_header<T>));
+                    if(!msg.body.empty())
+                        std::memcpy(pDatagram->vData.data() + i + sizeof(message_header<T>), msg.body.data(), msg.body.size());
+
+                    datagram_header* pHeader = reinterpret_cast<datagram_header*>(pDatagram->vData.data());
+                    pHeader->nCount++;
+                    m_oStats.nMessagesSent.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                // Stamp sequence numbers and write every pending datagram
+                void Flush() {
+                    m_bFlushPending = false;
+
+                    for(size_t i = m_nFlushed; i < m_nPending; i++) {
+                        datagram_header* pHeader = reinterpret_cast<datagram_header*>(m_vPending[i].vData.data());
+                        if(pHeader->nSequence == 0) {
+                            pHeader->nMagic = datagram_header().nMagic;
+                            pHeader->nSequence = ++m_nSequence;
+                            pHeader->nEpoch = m_nEpoch;
+                        }
+                    }
+
+                    while(m_nFlushed < m_nPending) {
+                        int nSent = SendBatch(m_nFlushed, std::min(m_oConfig.nBatch, m_nPending - m_nFlushed));
+
+                        if(nSent < 0) {
+                            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                                // socket buffer is full, carry on when the kernel has room
+                                m_oSocket.async_wait(asio::ip::udp::socket::wait_write,
+                                    [this](std::error_code ec) {
+                                        if(!ec)
+                                            Flush();
+                                    });
+                                return;
+                            }
+
+                            // unreachable destination and the like, the datagram is lost which udp allows
+                            nSent = 1;
+                        }
+
+                        m_oStats.nSendCalls.fetch_add(1, std::memory_order_relaxed);
+                        m_oStats.nDatagramsSent.fetch_add(nSent, std::memory_order_relaxed);
+                        m_nFlushed += nSent;
+                    }
+
+                    // everything written, buffers stay allocated for the next batch
+                    for(size_t i = 0; i < m_nPending; i++)
+                        m_vPending[i].vData.clear();
+                    m_nPending = 0;
+                    m_nFlushed = 0;
+                }
+
+                // returns datagrams written or -1 with errno set
+                int SendBatch(size_t nFirst, size_t nCount) {
+                #if defined(__linux__)
+                    m_vSendHeaders.resize(nCount);
+                    m_vSendIov.resize(nCount);
+                    for(size_t i = 0; i < nCount; i++) {
+                        pending_datagram& datagram = m_vPending[nFirst + i];
+                        m_vSendIov[i].iov_base = datagram.vData.data();
+                        m_vSendIov[i].iov_len = datagram.vData.size();
+
+                        std::memset(&m_vSendHeaders[i], 0, sizeof(mmsghdr));
+                        m_vSendHeaders[i].msg_hdr.msg_name = datagram.remote.data();
+                        m_vSendHeaders[i].msg_hdr.msg_namelen = socklen_t(datagram.remote.size());
+                        m_vSendHeaders[i].msg_hdr.msg_iov = &m_vSendIov[i];
+                        m_vSendHeaders[i].msg_hdr.msg_iovlen = 1;
+                    }
+                    return ::sendmmsg(m_oSocket.native_handle(), m_vSendHeaders.data(), unsigned(nCount), 0);
+                #else
+                    asio::error_code ec;
+                    pending_datagram& datagram = m_vPending[nFirst];
+                    m_oSocket.send_to(asio::buffer(datagram.vData), datagram.remote, 0, ec);
+                    if(ec) {
+                        errno = (ec == asio::error::would_block) ? EAGAIN : EIO;
+                        return -1;
+                    }
+                    return 1;
+                #endif
+                }
+
+                // ASYNC - wait for the socket to become readable then drain it
+                void WaitForDatagrams() {
+                    m_oSocket.async_wait(asio::ip::udp::socket::wait_read,
+                        [this](std::error_code ec) {
+                            if(!ec) {
+                                ReadDatagrams();
+                                WaitForDatagrams();
+                            }else if(ec != asio::error::operation_aborted) {
+                                HJW_LOG_INFO("[UDP] Read fail.");
+                            }
+                        });
+                }
+
+                void ReadDatagrams() {
+                    m_tNow = std::chrono::steady_clock::now();
+                    ExpireSenders();
+
+                #if defined(__linux__)
+                    size_t nSlots = m_vRecvSlots.size();
+                    m_vRecvHeaders.resize(nSlots);
+                    m_vRecvIov.resize(nSlots);
+
+                    for(;;) {
+                        for(size_t i = 0; i < nSlots; i++) {
+                            m_vRecvIov[i].iov_base = m_vRecvSlots[i].vData.data();
+                            m_vRecvIov[i].iov_len = m_vRecvSlots[i].vData.size();
+
+                            std::memset(&m_vRecvHeaders[i], 0, sizeof(mmsghdr));
+                            m_vRecvHeaders[i].msg_hdr.msg_name = &m_vRecvSlots[i].oAddr;
+                            m_vRecvHeaders[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+                            m_vRecvHeaders[i].msg_hdr.msg_iov = &m_vRecvIov[i];
+                            m_vRecvHeaders[i].msg_hdr.msg_iovlen = 1;
+                        }
+
+                        int nReceived = ::recvmmsg(m_oSocket.native_handle(), m_vRecvHeaders.data(), unsigned(nSlots), MSG_DONTWAIT, nullptr);
+                        if(nReceived <= 0)
+                            return;
+
+                        for(int i = 0; i < nReceived; i++) {
+                            mmsghdr& header = m_vRecvHeaders[i];
+
+                            asio::ip::udp::endpoint remote;
+                            std::memcpy(remote.data(), &m_vRecvSlots[i].oAddr, header.msg_hdr.msg_namelen);
+                            remote.resize(header.msg_hdr.msg_namelen);
+
+                            if(header.msg_hdr.msg_flags & MSG_TRUNC) {
+                                m_oStats.nMalformedDropped.fetch_add(1, std::memory_order_relaxed);
+                                continue;
+                            }
+
+                            Unpack(remote, m_vRecvSlots[i].vData.data(), header.msg_len);
+                        }
+
+                        // a short batch means the socket is drained
+                        if(size_t(nReceived) < nSlots)
+                            return;
+                    }
+                #else
+                    for(;;) {
+                        asio::error_code ec;
+                        asio::ip::udp::endpoint remote;
+                        size_t nLength = m_oSocket.receive_from(asio::buffer(m_vRecvSlots[0].vData), remote, 0, ec);
+                        if(ec)
+                            return;
+                        Unpack(remote, m_vRecvSlots[0].vData.data(), nLength);
+                    }
+                #endif
+                }
+
+                // Split a datagram back into messages and push them to the incoming queue
+                void Unpack(const asio::ip::udp::endpoint& remote, const uint8_t* pData, size_t nLength) {
+                    datagram_header header;
+                    if(nLength < sizeof(datagram_header)) {
+                        m_oStats.nMalformedDropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+
+                    std::memcpy(&header, pData, sizeof(datagram_header));
+                    if(header.nMagic != datagram_header().nMagic) {
+                        m_oStats.nMalformedDropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+
+                    // drop anything not newer than what this sender already delivered, unless the
+                    // sender has restarted since and counts again from 1
+                    auto [it, bNew] = m_mapSenders.try_emplace(remote);
+                    sender_state& sender = it->second;
+                    if(sender.nEpoch != header.nEpoch) {
+                        if(!bNew)
+                            m_oStats.nSenderRestarts.fetch_add(1, std::memory_order_relaxed);
+                        sender.nEpoch = header.nEpoch;
+                        sender.nLast = 0;
+                    }
+                    if(header.nSequence <= sender.nLast) {
+                        m_oStats.nStaleDropped.fetch_add(1, std::memory_order_relaxed);
+                        return;
+                    }
+                    sender.nLast = header.nSequence;
+                    sender.tSeen = m_tNow;
+
+                    m_oStats.nDatagramsReceived.fetch_add(1, std::memory_order_relaxed);
+
+                    size_t i = sizeof(datagram_header);
+                    for(uint32_t n = 0; n < header.nCount; n++) {
+                        owned_message<T> msg;
+                        if(nLength - i < sizeof(message_header<T>))
+                            break;
+
+                        std::memcpy(&msg.msg.header, pData + i, sizeof(message_header<T>));
+                        if(msg.msg.header.size < sizeof(message_header<T>) || msg.msg.header.size > nLength - i)
+                            break;
+
+                        msg.msg.body.assign(pData + i + sizeof(message_header<T>), pData + i + msg.msg.header.size);
+                        i += msg.msg.header.size;
+
+                        m_qMessagesIn.push_back(std::move(msg));
+                        m_oStats.nMessagesReceived.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+
+                // forget senders not heard from for tSenderIdle, checked at most that often
+                void ExpireSenders() {
+                    if(m_tNow - m_tLastExpiry < m_oConfig.tSenderIdle)
+                        return;
+                    m_tLastExpiry = m_tNow;
+
+                    for(auto it = m_mapSenders.begin(); it != m_mapSenders.end(); ) {
+                        if(m_tNow - it->second.tSeen >= m_oConfig.tSenderIdle) {
+                            it = m_mapSenders.erase(it);
+                            m_oStats.nSendersExpired.fetch_add(1, std::memory_order_relaxed);
+                        }else {
+                            ++it;
+                        }
+                    }
+                }
+
+            protected:
+                // asio context provided by the owner, all channel state lives on its thread
+                asio::io_context& m_oAsioContext;
+                asio::ip::udp::socket m_oSocket;
+
+                // Queue messages are delivered to, owned by a server or client
+                tsqueue<owned_message<T>>& m_qMessagesIn;
+
+                udp_config m_oConfig;
+                udp_stats m_oStats;
+
+                // default destination for Send
+                asio::ip::udp::endpoint m_oRemote;
+
+            private:
+                // outgoing datagrams, [m_nFlushed, m_nPending) are waiting for the kernel
+                std::vector<pending_datagram> m_vPending;
+                size_t m_nPending = 0;
+                size_t m_nFlushed = 0;
+                bool m_bFlushPending = false;
+                uint64_t m_nSequence = 0;
+                const uint64_t m_nEpoch;
+
+                // receive buffers, one per datagram in a recvmmsg batch
+                std::vector<recv_slot> m_vRecvSlots;
+
+                // newest sequence number delivered per sender, m_tNow is when the current read began
+                std::map<asio::ip::udp::endpoint, sender_state> m_mapSenders;
+                std::chrono::steady_clock::time_point m_tNow;
+                std::chrono::steady_clock::time_point m_tLastExpiry;
+
+            #if defined(__linux__)
+                std::vector<mmsghdr> m_vSendHeaders;
+                std::vector<iovec> m_vSendIov;
+                std::vector<mmsghdr> m_vRecvHeaders;
+                std::vector<iovec> m_vRecvIov;
+            #endif
+        };
+    }
+}
+
+#endif // NET_UDP_H_
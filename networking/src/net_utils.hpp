@@ -17,5 +17,26 @@
 #include <asio/ts/buffer.hpp>
 #include <asio/ts/internet.hpp>
 
+#include "net_log.hpp"
+
+namespace hjw {
+
+    namespace net {
+
+        // reactor the sockets run on, set with HJW_NET_IO_URING in CMakeLists.txt
+        inline const char* ReactorName() {
+        #if defined(ASIO_HAS_IO_URING) && defined(ASIO_DISABLE_EPOLL)
+            return "io_uring";
+        #elif defined(ASIO_HAS_EPOLL)
+            return "epoll";
+        #elif defined(ASIO_HAS_KQUEUE)
+            return "kqueue";
+        #else
+            return "select";
+        #endif
+        }
+    }
+}
+
 
 #endif // NET_UTILS_H_
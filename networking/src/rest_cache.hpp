@@ -0,0 +1,439 @@
+#ifndef REST_CACHE_H_
+#define REST_CACHE_H_
+
+#include <boost/beast/http.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "rest_compression.hpp"
+#include "rest_response.hpp"
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+
+namespace hjw {
+
+    namespace rest {
+
+        struct CacheOptions {
+            // total body bytes held, least recently used entries go first
+            std::size_t max_bytes = 64u << 20;
+
+            // responses with a larger body are passed through and not kept
+            std::size_t max_entry_bytes = 1u << 20;
+
+            // lifetime of responses whose route gives none, 0 caches only routes with a ttl
+            std::chrono::milliseconds ttl{0};
+
+            // request headers that select between responses for the same target, e.g. Accept
+            std::vector<http::field> vary;
+        };
+
+        struct CacheStats {
+            std::atomic<std::uint64_t> hits{0};          // answered from the cache
+            std::atomic<std::uint64_t> misses{0};        // cacheable but not held, handler called
+            std::atomic<std::uint64_t> stores{0};        // responses kept
+            std::atomic<std::uint64_t> evictions{0};     // dropped to make room
+            std::atomic<std::uint64_t> expirations{0};   // dropped when found past their ttl
+            std::atomic<std::uint64_t> not_modified{0};  // 304s sent for a matching If-None-Match
+        };
+
+        // Cache of GET responses shared by every session of an interface
+        //
+        // Keyed by method, target and the CacheOptions::vary request headers, and by the
+        // request headers named in the Vary of the responses kept for them. Only 200
+        // responses without Cache-Control no-store or private, Set-Cookie or Vary: * are
+        // kept, and a response to a request with Authorization only when it is public or
+        // has s-maxage. The body is flattened once when stored and handed out as a
+        // SharedBody, each hit copies the header only.
+        //
+        // Every kept response carries an ETag, the handler's own or a hash of the
+        // body, and a request whose If-None-Match names it is answered with 304 and no
+        // body, whether it hit or has just been stored
+        //
+        // With a compressor each entry also keeps the gzip and deflate forms of its body
+        // once a client has asked for them, they count towards max_bytes and carry their
+        // own ETag. Every response that leaves the cache, pass throughs included, is
+        // already in the encoding the client negotiated
+        class ResponseCache {
+
+            public:
+
+                using clock = std::chrono::steady_clock;
+
+                explicit ResponseCache(CacheOptions options) : m_Options(std::move(options)) {}
+
+                // Encode responses with compressor, which must outlive the cache
+                void set_compressor(ResponseCompressor const* compressor) {
+                    m_Compressor = compressor;
+                }
+
+                std::string key(http::request<http::dynamic_body> const& req) const {
+                    std::string k(http::to_string(req.method()));
+                    k += ' ';
+                    k.append(req.target().data(), req.target().size());
+                    for (http::field f : m_Options.vary) {
+                        auto value = req[f];
+                        k += '\n';
+                        k.append(value.data(), value.size());
+                    }
+                    return k;
+                }
+
+                // The response held for key, nothing if there is none or it has expired
+                std::optional<Response> find(std::string const& key, http::request<http::dynamic_body> const& req) {
+                    ContentEncoding encoding = m_Compressor ? m_Compressor->negotiate(req) : ContentEncoding::identity;
+
+                    std::shared_ptr<Entry> entry;
+                    std::shared_ptr<const std::string> encoded;
+                    {
+                        std::lock_guard<std::mutex> lock(m_muxCache);
+                        auto it = m_Index.find(variant(key, req));
+                        if (it != m_Index.end()) {
+                            if (it->second->entry->expires <= clock::now()) {
+                                m_Stats.expirations.fetch_add(1, std::memory_order_relaxed);
+                                erase(it->second);
+                            } else {
+                                m_Lru.splice(m_Lru.begin(), m_Lru, it->second);
+                                entry = it->second->entry;
+                                encoded = entry->encoded[static_cast<std::size_t>(encoding)];
+                            }
+                        }
+                    }
+
+                    if (!entry) {
+                        m_Stats.misses.fetch_add(1, std::memory_order_relaxed);
+                        return std::nullopt;
+                    }
+
+                    m_Stats.hits.fetch_add(1, std::memory_order_relaxed);
+                    return respond(req, entry, encoding, std::move(encoded));
+                }
+
+                // Keep res under key for ttl if it can be cached, and hand back what the
+                // client should get: res itself, or 304 if it already holds this version
+                Response store(std::string key, std::chrono::milliseconds ttl,
+                               http::request<http::dynamic_body> const& req, Response res) {
+                    http::response_header<>& header = res.header();
+                    std::vector<std::string> vary;
+                    if (header.result() != http::status::ok || !cacheable(req, header) || !vary_names(header, vary))
+                        return pass(req, std::move(res));
+
+                    auto body = std::make_shared<std::string>();
+                    if (!res.body_bytes(*body) || body->size() > m_Options.max_entry_bytes)
+                        return pass(req, std::move(res));
+
+                    auto entry = std::make_shared<Entry>();
+                    entry->header = header;
+                    entry->header.erase(http::field::connection);
+                    // the body is stored whole, a handler's chunked framing must not sit beside the length
+                    entry->header.erase(http::field::transfer_encoding);
+                    entry->header.set(http::field::content_length, std::to_string(body->size()));
+
+                    auto etag = header[http::field::etag];
+                    entry->etag = etag.empty() ? make_etag(*body) : std::string(etag.data(), etag.size());
+                    entry->header.set(http::field::etag, entry->etag);
+                    entry->compressible = m_Compressor && m_Compressor->eligible(entry->header, body->size());
+                    if (entry->compressible)
+                        ResponseCompressor::add_vary(entry->header);
+                    entry->bytes = body->size();
+                    entry->body = std::move(body);
+                    entry->encoded[static_cast<std::size_t>(ContentEncoding::identity)] = entry->body;
+                    entry->expires = clock::now() + ttl;
+
+                    ContentEncoding encoding = m_Compressor ? m_Compressor->negotiate(req) : ContentEncoding::identity;
+                    std::shared_ptr<const std::string> encoded;
+                    std::string full = extend(key, vary, req);
+                    {
+                        std::lock_guard<std::mutex> lock(m_muxCache);
+                        auto it = m_Index.find(full);
+                        if (it != m_Index.end())
+                            erase(it->second);
+
+                        // later lookups of key add the headers this response varies on
+                        Variants& variants = m_Vary[key];
+                        variants.names = std::move(vary);
+                        variants.entries++;
+
+                        m_Lru.push_front(Node{full, std::move(key), entry});
+                        m_Index.emplace(std::move(full), m_Lru.begin());
+                        m_Bytes += entry->bytes;
+                        m_Stats.stores.fetch_add(1, std::memory_order_relaxed);
+                        evict();
+
+                        // other sessions can see the entry from here on
+                        encoded = entry->encoded[static_cast<std::size_t>(encoding)];
+                    }
+
+                    return respond(req, entry, encoding, std::move(encoded));
+                }
+
+                void clear() {
+                    std::lock_guard<std::mutex> lock(m_muxCache);
+                    while (!m_Lru.empty())
+                        erase(m_Lru.begin());
+                }
+
+                std::size_t bytes() {
+                    std::lock_guard<std::mutex> lock(m_muxCache);
+                    return m_Bytes;
+                }
+
+                CacheStats const& stats() const { return m_Stats; }
+
+                CacheOptions const& options() const { return m_Options; }
+
+            private:
+
+                struct Entry {
+                    // status and fields as sent, Content-Length and ETag set, no Connection
+                    http::response_header<> header;
+                    std::shared_ptr<const std::string> body;
+                    std::string etag;
+                    clock::time_point expires;
+
+                    // the body in each ContentEncoding once made, the identity body itself when
+                    // compressing did not shrink it. Guarded by m_muxCache, as are bytes and held
+                    std::shared_ptr<const std::string> encoded[3];
+                    bool compressible = false;
+                    std::size_t bytes = 0;
+
+                    // still in the cache, not yet evicted, expired or replaced
+                    bool held = true;
+                };
+
+                struct Node {
+                    std::string key;
+                    std::string base; // key() of the request, key without the Vary headers
+                    std::shared_ptr<Entry> entry;
+                };
+
+                // the request headers the responses for one key() vary on, and how many are held
+                struct Variants {
+                    std::vector<std::string> names;
+                    std::size_t entries = 0;
+                };
+
+                using lru_iterator = std::list<Node>::iterator;
+
+                // caller holds m_muxCache
+                void erase(lru_iterator it) {
+                    auto variants = m_Vary.find(it->base);
+                    if (variants != m_Vary.end() && --variants->second.entries == 0)
+                        m_Vary.erase(variants);
+
+                    m_Bytes -= it->entry->bytes;
+                    it->entry->held = false;
+                    m_Index.erase(it->key);
+                    m_Lru.erase(it);
+                }
+
+                // caller holds m_muxCache
+                void evict() {
+                    while (m_Bytes > m_Options.max_bytes && !m_Lru.empty()) {
+                        erase(std::prev(m_Lru.end()));
+                        m_Stats.evictions.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+
+                // Answer req from entry in encoding, compressing it first if no client has
+                // asked for this encoding before. The zlib work is done outside the lock
+                Response respond(http::request<http::dynamic_body> const& req, std::shared_ptr<Entry> const& entry,
+                                 ContentEncoding encoding, std::shared_ptr<const std::string> encoded) {
+                    if (!entry->compressible)
+                        encoding = ContentEncoding::identity;
+
+                    if (encoding != ContentEncoding::identity && !encoded) {
+                        auto out = std::make_shared<std::string>();
+                        if (m_Compressor->compress(encoding, *entry->body, *out))
+                            encoded = std::move(out);
+                        else
+                            encoded = entry->body;
+
+                        std::lock_guard<std::mutex> lock(m_muxCache);
+                        auto& slot = entry->encoded[static_cast<std::size_t>(encoding)];
+                        if (!slot) {
+                            slot = encoded;
+                            // an entry already dropped no longer counts
+                            if (encoded != entry->body && entry->held) {
+                                entry->bytes += encoded->size();
+                                m_Bytes += encoded->size();
+                                evict();
+                            }
+                        }
+                    }
+
+                    if (encoded == entry->body || !encoded)
+                        encoding = ContentEncoding::identity;
+
+                    std::string etag = ResponseCompressor::tag(entry->etag, encoding);
+                    if (not_modified(req, etag))
+                        return respond_not_modified(req, entry->header, etag);
+
+                    http::response<SharedBody> res;
+                    res.base() = entry->header;
+                    res.version(req.version());
+                    if (encoding != ContentEncoding::identity) {
+                        ResponseCompressor::mark(res.base(), encoding, encoded->size());
+                        res.body() = std::move(encoded);
+                    } else {
+                        res.body() = entry->body;
+                    }
+                    return Response(std::move(res));
+                }
+
+                // A response the cache does not keep still goes out in the negotiated encoding
+                Response pass(http::request<http::dynamic_body> const& req, Response res) {
+                    return m_Compressor ? m_Compressor->apply(req, std::move(res)) : std::move(res);
+                }
+
+                static bool cacheable(http::request<http::dynamic_body> const& req, http::response_header<> const& header) {
+                    // a cookie belongs to one client
+                    if (header.find(http::field::set_cookie) != header.end())
+                        return false;
+
+                    auto control = header[http::field::cache_control];
+                    std::string_view value(control.data(), control.size());
+                    if (value.find("no-store") != std::string_view::npos || value.find("private") != std::string_view::npos)
+                        return false;
+
+                    // an answer to an authorised request is shared only when it says it may be
+                    return req.find(http::field::authorization) == req.end()
+                        || value.find("public") != std::string_view::npos
+                        || value.find("s-maxage") != std::string_view::npos;
+                }
+
+                // The request header names in the response's Vary, lower case, false for Vary: *
+                static bool vary_names(http::response_header<> const& header, std::vector<std::string>& names) {
+                    auto vary = header[http::field::vary];
+                    std::string_view list(vary.data(), vary.size());
+                    while (!list.empty()) {
+                        std::size_t comma = std::min(list.find(','), list.size());
+                        std::string_view name = list.substr(0, comma);
+                        list.remove_prefix(std::min(comma + 1, list.size()));
+
+                        while (!name.empty() && (name.front() == ' ' || name.front() == '\t'))
+                            name.remove_prefix(1);
+                        while (!name.empty() && (name.back() == ' ' || name.back() == '\t'))
+                            name.remove_suffix(1);
+                        if (name == "*")
+                            return false;
+                        if (name.empty())
+                            continue;
+
+                        std::string lower(name);
+                        std::transform(lower.begin(), lower.end(), lower.begin(),
+                                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+                        if (std::find(names.begin(), names.end(), lower) == names.end())
+                            names.push_back(std::move(lower));
+                    }
+                    return true;
+                }
+
+                // key followed by the request's value of each of names
+                static std::string extend(std::string key, std::vector<std::string> const& names,
+                                          http::request<http::dynamic_body> const& req) {
+                    for (std::string const& name : names) {
+                        auto value = req[name];
+                        key += '\n';
+                        key += name;
+                        key += ':';
+                        key.append(value.data(), value.size());
+                    }
+                    return key;
+                }
+
+                // caller holds m_muxCache. The index key of the response held for req under key
+                std::string variant(std::string const& key, http::request<http::dynamic_body> const& req) const {
+                    auto it = m_Vary.find(key);
+                    return it == m_Vary.end() ? key : extend(key, it->second.names, req);
+                }
+
+                // If-None-Match uses the weak comparison, a W/ prefix on either side is ignored
+                static bool not_modified(http::request<http::dynamic_body> const& req, std::string_view etag) {
+                    auto header = req[http::field::if_none_match];
+                    std::string_view list(header.data(), header.size());
+                    if (list.empty())
+                        return false;
+
+                    auto strip = [](std::string_view tag) {
+                        while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+                            tag.remove_prefix(1);
+                        while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+                            tag.remove_suffix(1);
+                        if (tag.substr(0, 2) == "W/")
+                            tag.remove_prefix(2);
+                        return tag;
+                    };
+
+                    std::string_view ours = strip(etag);
+                    while (!list.empty()) {
+                        std::size_t comma = std::min(list.find(','), list.size());
+                        std::string_view tag = strip(list.substr(0, comma));
+                        if (tag == "*" || tag == ours)
+                            return true;
+                        list.remove_prefix(std::min(comma + 1, list.size()));
+                    }
+                    return false;
+                }
+
+                Response respond_not_modified(http::request<http::dynamic_body> const& req,
+                                              http::response_header<> const& header, std::string const& etag) {
+                    m_Stats.not_modified.fetch_add(1, std::memory_order_relaxed);
+
+                    http::response<http::empty_body> res(http::status::not_modified, req.version());
+                    res.set(http::field::etag, etag);
+                    for (http::field f : {http::field::cache_control, http::field::expires,
+                                          http::field::vary, http::field::content_location}) {
+                        auto value = header[f];
+                        if (!value.empty())
+                            res.set(f, value);
+                    }
+                    return Response(std::move(res));
+                }
+
+                // FNV-1a over the body, quoted as an entity tag
+                static std::string make_etag(std::string const& body) {
+                    std::uint64_t hash = 14695981039346656037ull;
+                    for (unsigned char c : body) {
+                        hash ^= c;
+                        hash *= 1099511628211ull;
+                    }
+                    char tag[24];
+                    std::snprintf(tag, sizeof(tag), "\"%016llx\"", static_cast<unsigned long long>(hash));
+                    return tag;
+                }
+
+            private:
+
+                CacheOptions m_Options;
+                CacheStats m_Stats;
+                ResponseCompressor const* m_Compressor = nullptr;
+
+                // sessions on every thread share the cache
+                std::mutex m_muxCache;
+
+                // most recently used at the front
+                std::list<Node> m_Lru;
+                std::unordered_map<std::string, lru_iterator> m_Index;
+                std::unordered_map<std::string, Variants> m_Vary;
+                std::size_t m_Bytes = 0;
+        };
+
+    }
+}
+
+#endif // REST_CACHE_H_
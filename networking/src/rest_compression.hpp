@@ -0,0 +1,303 @@
+#ifndef REST_COMPRESSION_H_
+#define REST_COMPRESSION_H_
+
+#include <boost/beast/http.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "rest_response.hpp"
+
+#ifdef HJW_NET_ZLIB
+#include <zlib.h>
+#endif
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+
+namespace hjw {
+
+    namespace rest {
+
+        enum class ContentEncoding {identity, gzip, deflate};
+
+        struct CompressionOptions {
+            // bodies smaller than this go out as they are, compressing them costs more than it saves
+            std::size_t min_size = 1024;
+
+            // zlib level, 1 is fastest, 9 smallest
+            int level = 6;
+
+            // Content-Type prefixes worth compressing, empty compresses every type
+            std::vector<std::string> content_types = {
+                "text/", "application/json", "application/javascript", "application/xml", "image/svg+xml"
+            };
+        };
+
+        // gzip / deflate Content-Encoding for REST responses, negotiated by Accept-Encoding
+        //
+        // A response is compressed when its status has a body, it is at least min_size,
+        // its Content-Type matches one of content_types, it has no Content-Encoding of
+        // its own and no Cache-Control no-transform. gzip wins a tie on q with deflate.
+        // A compressed response that would not be smaller is sent as it was.
+        //
+        // The zlib streams are kept per thread and reset between bodies rather than set
+        // up for each response. The response cache keeps each encoding of an entry once
+        // it has been made, hits of the same encoding are never compressed again.
+        //
+        // zlib is only used when the build defines HJW_NET_ZLIB, otherwise every
+        // response is sent as identity
+        class ResponseCompressor {
+
+            public:
+
+                explicit ResponseCompressor(CompressionOptions options) : m_Options(std::move(options)) {}
+
+                // The encoding to answer req with
+                ContentEncoding negotiate(http::request<http::dynamic_body> const& req) const {
+#ifdef HJW_NET_ZLIB
+                    if (req.method() == http::verb::head)
+                        return ContentEncoding::identity;
+
+                    auto header = req[http::field::accept_encoding];
+                    std::string_view list(header.data(), header.size());
+
+                    // -1 is not mentioned
+                    double gzip = -1, deflate = -1, any = -1;
+                    while (!list.empty()) {
+                        std::size_t comma = std::min(list.find(','), list.size());
+                        std::string_view item = list.substr(0, comma);
+                        list.remove_prefix(std::min(comma + 1, list.size()));
+
+                        std::size_t semi = std::min(item.find(';'), item.size());
+                        std::string_view name = trim(item.substr(0, semi));
+                        double q = quality(item.substr(semi));
+
+                        if (iequals(name, "gzip") || iequals(name, "x-gzip"))
+                            gzip = q;
+                        else if (iequals(name, "deflate"))
+                            deflate = q;
+                        else if (name == "*")
+                            any = q;
+                    }
+
+                    if (gzip < 0)
+                        gzip = any;
+                    if (deflate < 0)
+                        deflate = any;
+
+                    if (gzip > 0 && gzip >= deflate)
+                        return ContentEncoding::gzip;
+                    if (deflate > 0)
+                        return ContentEncoding::deflate;
+#else
+                    (void)req;
+#endif
+                    return ContentEncoding::identity;
+                }
+
+                // Whether a response with this header and body size may be compressed at all
+                bool eligible(http::response_header<> const& header, std::size_t size) const {
+#ifndef HJW_NET_ZLIB
+                    return false;
+#endif
+                    auto status = header.result_int();
+                    if (status < 200 || status == 204 || status == 304 || size < m_Options.min_size)
+                        return false;
+
+                    if (!header[http::field::content_encoding].empty())
+                        return false;
+
+                    auto control = header[http::field::cache_control];
+                    if (std::string_view(control.data(), control.size()).find("no-transform") != std::string_view::npos)
+                        return false;
+
+                    if (m_Options.content_types.empty())
+                        return true;
+
+                    auto type = header[http::field::content_type];
+                    std::string_view value(type.data(), type.size());
+                    return std::any_of(m_Options.content_types.begin(), m_Options.content_types.end(),
+                                       [value](std::string const& prefix) { return value.substr(0, prefix.size()) == prefix; });
+                }
+
+                // Compress in into out with this thread's stream, false if it did not shrink
+                bool compress(ContentEncoding encoding, std::string_view in, std::string& out) const {
+#ifdef HJW_NET_ZLIB
+                    if (encoding == ContentEncoding::identity)
+                        return false;
+
+                    Deflater& d = encoding == ContentEncoding::gzip ? gzip_stream() : deflate_stream();
+                    if (!d.ready(m_Options.level))
+                        return false;
+
+                    out.resize(deflateBound(&d.zs, uLong(in.size())));
+                    d.zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+                    d.zs.avail_in = uInt(in.size());
+                    d.zs.next_out = reinterpret_cast<Bytef*>(out.data());
+                    d.zs.avail_out = uInt(out.size());
+
+                    int result = deflate(&d.zs, Z_FINISH);
+                    out.resize(d.zs.total_out);
+                    deflateReset(&d.zs);
+                    return result == Z_STREAM_END && out.size() < in.size();
+#else
+                    (void)encoding; (void)in; (void)out;
+                    return false;
+#endif
+                }
+
+                // Answer req with res compressed if both sides allow it, res as it is otherwise
+                Response apply(http::request<http::dynamic_body> const& req, Response res) const {
+                    // the size is only known once the body is flat, rule out the rest first
+                    ContentEncoding encoding = negotiate(req);
+                    if (encoding == ContentEncoding::identity || !eligible(res.header(), m_Options.min_size))
+                        return res;
+
+                    // a string body is compressed where it is, anything else is flattened first
+                    std::string flat;
+                    std::string_view body;
+                    if (auto* s = res.get<http::string_body>()) {
+                        body = s->body();
+                    } else {
+                        if (!res.body_bytes(flat))
+                            return res;
+                        body = flat;
+                    }
+
+                    if (!eligible(res.header(), body.size()))
+                        return res;
+
+                    // caches in between must keep the encodings apart
+                    add_vary(res.header());
+
+                    std::string compressed;
+                    if (!compress(encoding, body, compressed))
+                        return res;
+
+                    http::response<http::string_body> out;
+                    out.base() = res.header();
+                    out.body() = std::move(compressed);
+                    mark(out.base(), encoding, out.body().size());
+                    return Response(std::move(out));
+                }
+
+                // Set the headers of a body now in encoding, the ETag gets the encoding
+                // appended so each representation has its own
+                static void mark(http::response_header<>& header, ContentEncoding encoding, std::size_t size) {
+                    header.set(http::field::content_encoding, name(encoding));
+                    header.set(http::field::content_length, std::to_string(size));
+                    header.erase(http::field::transfer_encoding);
+
+                    auto etag = header[http::field::etag];
+                    if (!etag.empty())
+                        header.set(http::field::etag, tag(std::string_view(etag.data(), etag.size()), encoding));
+                }
+
+                static void add_vary(http::response_header<>& header) {
+                    auto vary = header[http::field::vary];
+                    std::string_view value(vary.data(), vary.size());
+                    if (value.empty())
+                        header.set(http::field::vary, "Accept-Encoding");
+                    else if (value.find("Accept-Encoding") == std::string_view::npos && value != "*")
+                        header.set(http::field::vary, std::string(value) + ", Accept-Encoding");
+                }
+
+                // "abc" becomes "abc-gzip"
+                static std::string tag(std::string_view etag, ContentEncoding encoding) {
+                    std::string out(etag);
+                    if (encoding == ContentEncoding::identity)
+                        return out;
+
+                    std::size_t at = !out.empty() && out.back() == '"' ? out.size() - 1 : out.size();
+                    out.insert(at, std::string("-") + name(encoding));
+                    return out;
+                }
+
+                static char const* name(ContentEncoding encoding) {
+                    switch (encoding) {
+                        case ContentEncoding::gzip: return "gzip";
+                        case ContentEncoding::deflate: return "deflate";
+                        default: return "identity";
+                    }
+                }
+
+                CompressionOptions const& options() const { return m_Options; }
+
+            private:
+
+                static std::string_view trim(std::string_view s) {
+                    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+                        s.remove_prefix(1);
+                    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+                        s.remove_suffix(1);
+                    return s;
+                }
+
+                static bool iequals(std::string_view a, std::string_view b) {
+                    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+                        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+                    });
+                }
+
+                // q of ";q=0.5" style parameters, 1 when absent
+                static double quality(std::string_view params) {
+                    std::size_t at = params.find("q=");
+                    if (at == std::string_view::npos)
+                        return 1.0;
+                    std::string value(trim(params.substr(at + 2, params.find(';', at) - at - 2)));
+                    return std::strtod(value.c_str(), nullptr);
+                }
+
+#ifdef HJW_NET_ZLIB
+                // One zlib stream, set up on first use and reset after each body
+                struct Deflater {
+                    explicit Deflater(int windowBits) : windowBits(windowBits) {}
+                    Deflater(const Deflater&) = delete;
+
+                    ~Deflater() {
+                        if (level >= 0)
+                            deflateEnd(&zs);
+                    }
+
+                    bool ready(int wanted) {
+                        if (level < 0) {
+                            if (deflateInit2(&zs, wanted, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                                return false;
+                        } else if (level != wanted && deflateParams(&zs, wanted, Z_DEFAULT_STRATEGY) != Z_OK) {
+                            return false;
+                        }
+                        level = wanted;
+                        return true;
+                    }
+
+                    z_stream zs{};
+                    int windowBits;
+                    int level = -1;
+                };
+
+                // 16 + 15 bits of window writes a gzip wrapper, 15 alone a zlib one
+                static Deflater& gzip_stream() {
+                    static thread_local Deflater d(16 + MAX_WBITS);
+                    return d;
+                }
+
+                static Deflater& deflate_stream() {
+                    static thread_local Deflater d(MAX_WBITS);
+                    return d;
+                }
+#endif
+
+            private:
+
+                CompressionOptions m_Options;
+        };
+
+    }
+}
+
+#endif // REST_COMPRESSION_H_
@@ -1,9 +1,17 @@
 #ifndef REST_INTERFACE_H_
 #define REST_INTERFACE_H_
 
+#include <rest_cache.hpp>
+#include <rest_compression.hpp>
 #include <rest_listener.hpp>
+#include <rest_router.hpp>
+#include <algorithm>
+#include <bitset>
+#include <memory>
 #include <thread>
+#include <vector>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/thread_pool.hpp>
 
 
 namespace beast = boost::beast;
@@ -19,21 +27,88 @@ namespace hjw {
         // To be used as a base class for custom REST API wrapper
         // Child classes should implement all HTTP methods
         // GET, POST, PUT, DELETE
+        //
+        // Routes added with route() are tried first, a request that matches none of
+        // them goes to the handle_ method of its verb as before. The handle_ methods
+        // answer with a dynamic_body, routes and co_handler with a Response, which takes
+        // a response of any body type, see rest_response.hpp
+        //
+        // With enable_cache GET responses are kept for the ttl of their route, or the
+        // cache's default, and repeats are answered without calling the handler
+        //
+        // With enable_compression responses are sent gzip or deflate encoded to clients
+        // that accept it, see rest_compression.hpp
+        //
+        // With more than one thread each thread runs its own io_context and connections
+        // are dealt out between them, a connection stays on one thread for its lifetime.
+        // Handlers are then called from several threads at once and must be thread safe
+        //
+        // Requests go through co_handler, a coroutine run on the connection's thread.
+        // Override it to serve some requests with async I/O, co_await on anything bound
+        // to net::this_coro::executor, and pass the rest on to Interface::co_handler.
+        // A method marked with offload has its handle_ method run on a separate pool
+        // of CPU threads instead, the connection's thread serves other connections
+        // meanwhile and the request carries on there once the handler returns
         class Interface {
 
             public:
 
-                Interface(std::string address, uint16_t port)
+                Interface(std::string address, uint16_t port, std::size_t threads = 1)
                     : m_ioc(),
                       m_ctxGuard(net::make_work_guard(m_ioc)),
                       m_Signals(m_ioc, SIGINT, SIGTERM),
                       m_address(address), m_port(port)
-                {}
+                {
+                    // the first thread runs m_ioc, which also accepts and handles signals
+                    for (std::size_t i = 1; i < threads; i++)
+                        m_Workers.push_back(std::make_unique<Worker>());
+                }
 
                 ~Interface() {
                     // join thread
                     if (m_ctxThread.joinable())
                         m_ctxThread.join();
+
+                    for (auto& worker : m_Workers) {
+                        if (worker->thread.joinable())
+                            worker->thread.join();
+                    }
+                }
+
+                // Keep-alive limits for every connection, call before start
+                void set_session_options(SessionOptions options) {
+                    m_SessionOptions = options;
+                }
+
+                // Mark the handler of method as CPU bound, call before start
+                void offload(http::verb method) {
+                    m_Offload.set(static_cast<std::size_t>(method));
+                }
+
+                // Serve method and pattern with h, see Router for the pattern syntax
+                // An offloaded route runs on the CPU pool, a GET route with a ttl is cached
+                // once the cache is enabled. Call before start
+                bool route(http::verb method, std::string_view pattern, RouteHandler h, bool offload = false,
+                           std::chrono::milliseconds ttl = {}) {
+                    return m_Router.add(method, pattern, std::move(h), offload, ttl);
+                }
+
+                // Put a response cache in front of the handlers, call before start
+                void enable_cache(CacheOptions options) {
+                    m_Cache = std::make_unique<ResponseCache>(std::move(options));
+                }
+
+                // null until enable_cache
+                ResponseCache* cache() { return m_Cache.get(); }
+
+                // Compress responses for clients that accept it, call before start
+                void enable_compression(CompressionOptions options = {}) {
+                    m_Compressor = std::make_unique<ResponseCompressor>(std::move(options));
+                }
+
+                // Size of the CPU pool, 0 is one thread per core, call before start
+                void set_cpu_threads(std::size_t threads) {
+                    m_CpuThreads = threads;
                 }
 
             protected:
@@ -41,35 +116,116 @@ namespace hjw {
                 void start() {
                     // Initialize the listener with the handler
                     tcp::endpoint endpoint(net::ip::make_address(m_address), m_port);
+
+                    // sessions go round every thread's context, m_ioc included
+                    std::vector<net::io_context*> sessionIocs;
+                    if (!m_Workers.empty()) {
+                        sessionIocs.push_back(&m_ioc);
+                        for (auto& worker : m_Workers)
+                            sessionIocs.push_back(&worker->ioc);
+                    }
+
+                    // cached entries keep their encoded bodies
+                    if (m_Cache)
+                        m_Cache->set_compressor(m_Compressor.get());
+
+                    // only started when something is offloaded
+                    if (m_Offload.any() || m_Router.offloads()) {
+                        std::size_t threads = m_CpuThreads ? m_CpuThreads
+                                                           : std::max(1u, std::thread::hardware_concurrency());
+                        m_CpuPool = std::make_unique<net::thread_pool>(threads);
+                    }
+
                     m_Listener = std::make_shared<Listener>(m_ioc, endpoint,
-                                    [this](http::request<http::dynamic_body> const& req) {
-                                        return this->handler(req);
-                                    });
+                                    Listener::AsyncHandler([this](http::request<http::dynamic_body> const& req) {
+                                        return this->co_handler(req);
+                                    }), m_SessionOptions, std::move(sessionIocs));
                     m_Listener->start();
 
                     // Handle CRTL+C to gracefully stop the ioc and call destructor
                     // Signal set listening for crtl+c
                     m_Signals.async_wait([this](beast::error_code const&, int) {
-                            std::cout << "Stopping REST service .... " << std::endl;
+                            HJW_LOG_INFO("Stopping REST service .... ");
                             m_ctxGuard.reset();
                             m_ioc.stop();
+
+                            for (auto& worker : m_Workers) {
+                                worker->guard.reset();
+                                worker->ioc.stop();
+                            }
+
+                            if (m_CpuPool)
+                                m_CpuPool->stop();
                         });
 
                     // Launch dedicated thread for io_context
-                    m_ctxThread = std::thread([this]() {
-                        try {
-                            m_ioc.run();
-                        } catch (std::exception& e) {
-                            std::cerr << "IO context exception: " << e.what() << std::endl;
-                        }
-                    });
+                    m_ctxThread = std::thread([this]() { run_context(m_ioc); });
+
+                    // and one for each further context
+                    for (auto& worker : m_Workers)
+                        worker->thread = std::thread([&ioc = worker->ioc]() { run_context(ioc); });
+                }
+
+            private:
+
+                static void run_context(net::io_context& ioc) {
+                    try {
+                        ioc.run();
+                    } catch (std::exception& e) {
+                        HJW_LOG_ERROR("IO context exception: {}", e.what());
+                    }
                 }
 
             protected:
 
+                // Asynchronous handler, runs on the connection's thread
+                // Offloaded methods suspend here until the CPU pool has run them
+                virtual net::awaitable<Response> co_handler(http::request<http::dynamic_body> const& req) {
+                    RouteMatch match = m_Router.match(req.method(), to_view(req.target()));
+
+                    std::chrono::milliseconds ttl{0};
+                    if (m_Cache && req.method() == http::verb::get)
+                        ttl = match && match.route->ttl.count() ? match.route->ttl : m_Cache->options().ttl;
+                    if (ttl.count() <= 0) {
+                        Response res = co_await co_dispatch(req, match);
+                        if (m_Compressor)
+                            co_return m_Compressor->apply(req, std::move(res));
+                        co_return res;
+                    }
+
+                    std::string key = m_Cache->key(req);
+                    if (std::optional<Response> cached = m_Cache->find(key, req))
+                        co_return std::move(*cached);
+
+                    Response res = co_await co_dispatch(req, match);
+                    co_return m_Cache->store(std::move(key), ttl, req, std::move(res));
+                }
+
+                // Run the matched route or verb handler, on the CPU pool if it is offloaded
+                net::awaitable<Response> co_dispatch(http::request<http::dynamic_body> const& req, RouteMatch const& match) {
+                    bool offload = match ? match.route->offload
+                                         : m_Offload.test(static_cast<std::size_t>(req.method()));
+
+                    if (!m_CpuPool || !offload)
+                        co_return handler(req, match);
+
+                    // the session is suspended until this completes, req and match are not touched meanwhile
+                    co_return co_await net::co_spawn(*m_CpuPool,
+                        [this, &req, &match]() -> net::awaitable<Response> {
+                            co_return this->handler(req, match);
+                        }, net::use_awaitable);
+                }
+
                 // General handler
-                // Will call specific HTTP method handler
-                http::response<http::dynamic_body> handler(http::request<http::dynamic_body> const& req) {
+                // Will call the matching route, or the specific HTTP method handler
+                Response handler(http::request<http::dynamic_body> const& req) {
+                    return handler(req, m_Router.match(req.method(), to_view(req.target())));
+                }
+
+                Response handler(http::request<http::dynamic_body> const& req, RouteMatch const& match) {
+                    if (match)
+                        return match.route->handler(req, match.params);
+
                     switch (req.method()) {
                         case http::verb::get:  return handle_get(req);
                         case http::verb::post: return handle_post(req);
@@ -106,8 +262,12 @@ namespace hjw {
                         case http::verb::notify: return handle_notify(req);
                         case http::verb::purge: return handle_purge(req);
                     }
-                    return http::response<http::dynamic_body>
-                                (http::status::method_not_allowed, req.version());
+                    return http::response<http::empty_body>(http::status::method_not_allowed, req.version());
+                }
+
+                // beast's string_view is boost's before 1.77
+                static std::string_view to_view(beast::string_view s) {
+                    return std::string_view(s.data(), s.size());
                 }
 
             protected:
@@ -177,6 +337,33 @@ namespace hjw {
 
                 // REST Listener
                 std::shared_ptr<Listener> m_Listener;
+
+                // Keep-alive limits handed to the listener
+                SessionOptions m_SessionOptions;
+
+                // A further io_context and the thread running it
+                struct Worker {
+                    net::io_context ioc;
+                    net::executor_work_guard<net::io_context::executor_type> guard{net::make_work_guard(ioc)};
+                    std::thread thread;
+                };
+
+                // Extra threads, empty when running on one thread
+                std::vector<std::unique_ptr<Worker>> m_Workers;
+
+                // Routes tried before the verb handlers
+                Router m_Router;
+
+                // Shared by every thread, null unless enabled
+                std::unique_ptr<ResponseCompressor> m_Compressor;
+                std::unique_ptr<ResponseCache> m_Cache;
+
+                // Methods whose handlers run on the CPU pool, indexed by http::verb
+                std::bitset<64> m_Offload;
+                std::size_t m_CpuThreads = 0;
+
+                // Declared last so it is joined before the contexts its results go back to are destroyed
+                std::unique_ptr<net::thread_pool> m_CpuPool;
         };
 
     }
@@ -4,6 +4,7 @@
 #include <rest_session.hpp>
 #include <boost/asio/co_spawn.hpp>
 #include <boost/asio/detached.hpp>
+#include <vector>
 
 namespace beast = boost::beast;
 namespace http = beast::http;
@@ -15,81 +16,116 @@ namespace hjw {
     namespace rest {
 
         // Accepts incoming connections and spawns sessions for each connection
+        // Sessions are dealt out in turn over the session contexts, each run by its own
+        // thread, or all run on the listener's context when none are given
         class Listener : public std::enable_shared_from_this<Listener> {
 
             public:
 
-                using Handler = std::function<http::response<http::dynamic_body>
-                                              (http::request<http::dynamic_body> const&)>;
+                using Handler = Session::Handler;
+                using AsyncHandler = Session::AsyncHandler;
 
                 // Pass Handler from interface class, to be passed to each sessiono
-                Listener(net::io_context& ioc, tcp::endpoint endpoint, Handler h)
-                    : m_ioc(ioc), m_Acceptor(net::make_strand(ioc)), m_Handler(h)
+                Listener(net::io_context& ioc, tcp::endpoint endpoint, Handler h, SessionOptions options = {},
+                         std::vector<net::io_context*> sessionIocs = {})
+                    : m_ioc(ioc), m_Acceptor(net::make_strand(ioc)), m_Handler(std::move(h)), m_Options(options),
+                      m_SessionIocs(std::move(sessionIocs))
                 {
+                    open(endpoint);
+                }
+
+                Listener(net::io_context& ioc, tcp::endpoint endpoint, AsyncHandler h, SessionOptions options = {},
+                         std::vector<net::io_context*> sessionIocs = {})
+                    : m_ioc(ioc), m_Acceptor(net::make_strand(ioc)), m_AsyncHandler(std::move(h)), m_Options(options),
+                      m_SessionIocs(std::move(sessionIocs))
+                {
+                    open(endpoint);
+                }
+
+                void start() {
+                    // The use of detached means forget about this co_routine
+                    // Ignore all exceptions thrown
+                    net::co_spawn(m_ioc, co_accept(), net::detached);
+                }
+
+            private:
+
+                void open(tcp::endpoint const& endpoint) {
                     beast::error_code ec;
 
                     // Open the endpoint on port provided
                     m_Acceptor.open(endpoint.protocol(), ec);
                     if (ec) {
-                        std::cerr << "Open error: " << ec.message() << std::endl;
+                        HJW_LOG_ERROR("Open error: {}", ec.message());
                         return;
                     }
 
                     // Set socket options
                     m_Acceptor.set_option(net::socket_base::reuse_address(true), ec);
                     if (ec) {
-                        std::cerr << "Set Option error: " << ec.message() << std::endl;
+                        HJW_LOG_ERROR("Set Option error: {}", ec.message());
                         return;
                     }
 
                     // Bind to port
                     m_Acceptor.bind(endpoint, ec);
                     if (ec) {
-                        std::cerr << "Bind error: " << ec.message() << std::endl;
+                        HJW_LOG_ERROR("Bind error: {}", ec.message());
                         return;
                     }
 
                     // Listen on port
                     m_Acceptor.listen(net::socket_base::max_listen_connections, ec);
                     if (ec) {
-                        std::cerr << "Listen error: " << ec.message() << std::endl;
+                        HJW_LOG_ERROR("Listen error: {}", ec.message());
                         return;
                     }
                 }
 
-                void start() {
-                    // The use of detached means forget about this co_routine
-                    // Ignore all exceptions thrown
-                    net::co_spawn(m_ioc, co_accept(), net::detached);
-                }
-
-            private:
-
                 net::awaitable<void> co_accept() {
                     // For loop will not spin as we use co_await for waiting for connections
                     for (;;) {
-                        tcp::socket socket = co_await m_Acceptor.async_accept(net::use_awaitable);
+                        // the socket is created on the context its session will run on
+                        net::io_context& ioc = next_context();
+                        tcp::socket socket = co_await m_Acceptor.async_accept(ioc, net::use_awaitable);
                         // Create session obejct within shared ptr
-                        auto session = std::make_shared<Session>(std::move(socket), m_Handler);
+                        auto session = m_AsyncHandler
+                                       ? std::make_shared<Session>(std::move(socket), m_AsyncHandler, m_Options)
+                                       : std::make_shared<Session>(std::move(socket), m_Handler, m_Options);
 
                         // spawn co_routine to run session
                         // Passing ptr to lambda to keep session alive
-                        net::co_spawn(m_ioc, [session]() -> net::awaitable<void> {
+                        net::co_spawn(ioc, [session]() -> net::awaitable<void> {
                                 co_await session->run();
                             }, net::detached);
                     }
                 }
 
+                // Round robin over the session contexts
+                net::io_context& next_context() {
+                    if (m_SessionIocs.empty())
+                        return m_ioc;
+                    return *m_SessionIocs[m_NextIoc++ % m_SessionIocs.size()];
+                }
+
             private:
 
-                // Asio context to spawn sessions on
+                // Asio context to accept on, and spawn sessions on when there are no others
                 net::io_context& m_ioc;
 
                 // TCP acceptor to maage endpoint
                 tcp::acceptor m_Acceptor;
 
-                // Request handler passed to each session
+                // Request handler passed to each session, only one of the two is set
                 Handler m_Handler;
+                AsyncHandler m_AsyncHandler;
+
+                // Keep-alive limits passed to each session
+                SessionOptions m_Options;
+
+                // Contexts sessions are spread over, only touched by co_accept
+                std::vector<net::io_context*> m_SessionIocs;
+                std::size_t m_NextIoc = 0;
 
         };
     }
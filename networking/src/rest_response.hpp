@@ -0,0 +1,272 @@
+#ifndef REST_RESPONSE_H_
+#define REST_RESPONSE_H_
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+#if BOOST_BEAST_USE_POSIX_FILE && (defined(__linux__) || defined(__APPLE__))
+#define HJW_REST_SENDFILE 1
+#include <cerrno>
+#include <sys/types.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace net = boost::asio;
+using tcp = net::ip::tcp;
+
+namespace hjw {
+
+    namespace rest {
+
+        // hjw::net exists for the logger, keep net:: meaning boost::asio in here
+        namespace net = boost::asio;
+
+        // Body holding immutable bytes shared between responses, written without a copy
+        // Used to send one cached payload to many clients at once
+        struct SharedBody {
+            using value_type = std::shared_ptr<const std::string>;
+
+            static std::uint64_t size(value_type const& body) {
+                return body ? body->size() : 0;
+            }
+
+            class writer {
+                public:
+                    using const_buffers_type = net::const_buffer;
+
+                    template <bool isRequest, class Fields>
+                    writer(http::header<isRequest, Fields> const&, value_type const& body) : m_Body(body) {}
+
+                    void init(beast::error_code& ec) { ec = {}; }
+
+                    boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec) {
+                        ec = {};
+                        if (!m_Body || m_Body->empty())
+                            return boost::none;
+                        return {{net::const_buffer(m_Body->data(), m_Body->size()), false}};
+                    }
+
+                private:
+                    value_type const& m_Body;
+            };
+        };
+
+        // A response of any body type, what handlers hand back to the session
+        //
+        // Built implicitly from an http::response<Body>, so a handler picks the body that
+        // suits it. string_body, vector_body and span_body are written straight from
+        // their contiguous memory, dynamic_body still works for existing handlers and
+        // file_body is sent with sendfile where the platform has it, the file never
+        // passes through user space. The response is moved in, the body is not copied
+        class Response {
+
+            public:
+
+                template <class Body>
+                Response(http::response<Body>&& res)
+                    : m_Impl(std::make_unique<Model<Body>>(std::move(res))) {}
+
+                // holds nothing, only to be assigned to, co_spawn needs it for its result
+                Response() = default;
+
+                Response(Response&&) = default;
+                Response& operator=(Response&&) = default;
+
+                // status line and fields, shared by every body type
+                http::response_header<>& header() { return m_Impl->header(); }
+                http::response_header<> const& header() const { return m_Impl->header(); }
+
+                void keep_alive(bool value) { m_Impl->keep_alive(value); }
+                bool keep_alive() const { return m_Impl->keep_alive(); }
+                bool need_eof() const { return m_Impl->need_eof(); }
+
+                // a kept alive connection needs the body length to find the next response
+                void prepare_payload() { m_Impl->prepare_payload(); }
+
+                // Copy the body into out, false for a file_body which stays on disk
+                bool body_bytes(std::string& out) { return m_Impl->body_bytes(out); }
+
+                // the underlying response, null when it has another body type
+                template <class Body>
+                http::response<Body>* get() {
+                    auto model = dynamic_cast<Model<Body>*>(m_Impl.get());
+                    return model ? &model->m_Res : nullptr;
+                }
+
+                // Write the whole response to stream, ec is set on failure
+                // timeout bounds each wait for the peer, like the stream's own expiry
+                net::awaitable<void> write(beast::tcp_stream& stream, std::chrono::steady_clock::duration timeout,
+                                           beast::error_code& ec) {
+                    return m_Impl->write(stream, timeout, ec);
+                }
+
+            private:
+
+                struct Concept {
+                    virtual ~Concept() = default;
+                    virtual http::response_header<>& header() = 0;
+                    virtual bool keep_alive() const = 0;
+                    virtual void keep_alive(bool value) = 0;
+                    virtual bool need_eof() const = 0;
+                    virtual void prepare_payload() = 0;
+                    virtual bool body_bytes(std::string& out) = 0;
+                    virtual net::awaitable<void> write(beast::tcp_stream& stream, std::chrono::steady_clock::duration timeout,
+                                                       beast::error_code& ec) = 0;
+                };
+
+                template <class Body>
+                struct Model : Concept {
+                    explicit Model(http::response<Body>&& res) : m_Res(std::move(res)) {}
+
+                    http::response_header<>& header() override { return m_Res; }
+                    bool keep_alive() const override { return m_Res.keep_alive(); }
+                    void keep_alive(bool value) override { m_Res.keep_alive(value); }
+                    bool need_eof() const override { return m_Res.need_eof(); }
+
+                    // 1xx, 204 and 304 have no body and must not get a Content-Length of 0,
+                    // a 304 would otherwise tell the client the cached entity is empty
+                    void prepare_payload() override {
+                        auto status = m_Res.result_int();
+                        if (status < 200 || status == 204 || status == 304)
+                            return;
+                        if (!m_Res.has_content_length() && !m_Res.chunked())
+                            m_Res.prepare_payload();
+                    }
+
+                    bool body_bytes(std::string& out) override {
+                        if constexpr (std::is_same_v<Body, http::file_body>) {
+                            return false;
+                        } else {
+                            // the body's own writer, as the serializer would use it
+                            beast::error_code ec;
+                            typename Body::writer writer(m_Res.base(), m_Res.body());
+                            writer.init(ec);
+                            while (!ec) {
+                                auto result = writer.get(ec);
+                                if (ec || !result)
+                                    break;
+                                for (auto buffer : beast::buffers_range_ref(result->first))
+                                    out.append(static_cast<char const*>(buffer.data()), buffer.size());
+                                if (!result->second)
+                                    break;
+                            }
+                            return !ec;
+                        }
+                    }
+
+                    net::awaitable<void> write(beast::tcp_stream& stream, std::chrono::steady_clock::duration timeout,
+                                               beast::error_code& ec) override {
+#ifdef HJW_REST_SENDFILE
+                        if constexpr (std::is_same_v<Body, http::file_body>) {
+                            if (!m_Res.chunked() && m_Res.body().is_open()) {
+                                co_await co_sendfile(stream, timeout, ec);
+                                co_return;
+                            }
+                        }
+#endif
+                        stream.expires_after(timeout);
+                        co_await http::async_write(stream, m_Res, net::redirect_error(net::use_awaitable, ec));
+                    }
+
+#ifdef HJW_REST_SENDFILE
+                    // Header through beast, then the body straight from the file to the socket
+                    net::awaitable<void> co_sendfile(beast::tcp_stream& stream, std::chrono::steady_clock::duration timeout,
+                                                     beast::error_code& ec) {
+                        http::response_serializer<Body> sr(m_Res);
+                        stream.expires_after(timeout);
+                        co_await http::async_write_header(stream, sr, net::redirect_error(net::use_awaitable, ec));
+                        if (ec)
+                            co_return;
+
+                        int fd = m_Res.body().file().native_handle();
+                        auto offset = static_cast<off_t>(m_Res.body().file().pos(ec));
+                        std::uint64_t remain = m_Res.body().size();
+                        if (ec)
+                            co_return;
+
+                        // the stream's expiry only covers its own operations, waits on the
+                        // socket get a timer that cancels them instead. A timer handler may
+                        // still be queued once this returns, state tells it to leave the
+                        // socket alone: 0 waiting, 1 expired, 2 finished
+                        tcp::socket& socket = stream.socket();
+                        net::steady_timer timer(socket.get_executor());
+                        auto state = std::make_shared<int>(0);
+                        socket.native_non_blocking(true, ec);
+                        while (!ec && remain > 0) {
+#if defined(__linux__)
+                            ssize_t sent = ::sendfile(socket.native_handle(), fd, &offset, remain);
+                            if (sent > 0) {
+                                remain -= std::uint64_t(sent);
+                                continue;
+                            }
+                            // the file is shorter than its size said, the length promised
+                            // in the header can no longer be met
+                            if (sent == 0) {
+                                ec = http::error::partial_message;
+                                break;
+                            }
+#else
+                            off_t len = static_cast<off_t>(remain);
+                            int result = ::sendfile(fd, socket.native_handle(), offset, &len, nullptr, 0);
+                            offset += len;
+                            remain -= std::uint64_t(len);
+                            if (result == 0) {
+                                if (remain > 0 && len == 0)
+                                    ec = http::error::partial_message;
+                                if (remain == 0 || len == 0)
+                                    break;
+                                continue;
+                            }
+#endif
+                            if (errno == EINTR)
+                                continue;
+                            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                ec.assign(errno, boost::system::system_category());
+                                break;
+                            }
+
+                            // rearming aborts the previous wait
+                            timer.expires_after(timeout);
+                            timer.async_wait([state, &socket](beast::error_code const& e) {
+                                    if (!e && *state == 0) {
+                                        *state = 1;
+                                        socket.cancel();
+                                    }
+                                });
+                            co_await socket.async_wait(tcp::socket::wait_write, net::redirect_error(net::use_awaitable, ec));
+                        }
+
+                        if (*state == 1)
+                            ec = beast::error::timeout;
+                        *state = 2;
+                        timer.cancel();
+                    }
+#endif
+
+                    http::response<Body> m_Res;
+                };
+
+            private:
+
+                std::unique_ptr<Concept> m_Impl;
+        };
+
+    }
+}
+
+#endif // REST_RESPONSE_H_
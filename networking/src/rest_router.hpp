@@ -0,0 +1,275 @@
+#ifndef REST_ROUTER_H_
+#define REST_ROUTER_H_
+
+#include <boost/beast/http.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "net_log.hpp"
+#include "rest_response.hpp"
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+
+namespace hjw {
+
+    namespace rest {
+
+        // Values captured from the path of a matched route
+        // Names point into the router and values into the request target, so both
+        // stay valid for as long as the request does, nothing is allocated
+        class RouteParams {
+
+            public:
+
+                static constexpr std::size_t max_params = 8;
+
+                // value of {name}, or of the wildcard tail, empty if there is none
+                std::string_view get(std::string_view name) const {
+                    for (std::size_t i = 0; i < m_Count; i++) {
+                        if (m_Params[i].first == name)
+                            return m_Params[i].second;
+                    }
+                    return {};
+                }
+
+                std::string_view operator[](std::string_view name) const {
+                    return get(name);
+                }
+
+                std::size_t size() const { return m_Count; }
+
+                // the rest of the path after a wildcard, without its leading slash
+                std::string_view tail() const { return m_Tail; }
+
+            private:
+
+                friend class Router;
+
+                std::array<std::pair<std::string_view, std::string_view>, max_params> m_Params;
+                std::size_t m_Count = 0;
+                std::string_view m_Tail;
+        };
+
+        // Handler for one route, params are only valid during the call
+        using RouteHandler = std::function<Response(http::request<http::dynamic_body> const&, RouteParams const&)>;
+
+        struct Route {
+            RouteHandler handler;
+
+            // run on the interface's CPU pool instead of the connection's thread
+            bool offload = false;
+
+            // how long a GET response may be served from the response cache, 0 for the cache's default
+            std::chrono::milliseconds ttl{0};
+        };
+
+        // Result of Router::match, route is null when nothing matched
+        struct RouteMatch {
+            Route const* route = nullptr;
+            RouteParams params;
+
+            explicit operator bool() const { return route != nullptr; }
+        };
+
+        // Trie over path segments, one per method
+        //
+        // Patterns are split on '/', each segment is either
+        //  literal  - matched exactly, "users"
+        //  {name}   - any one segment, captured as name
+        //  *name    - last segment only, the rest of the path captured as name, may be empty
+        //
+        // so "/users/{id}/files/*path" matches "/users/7/files/a/b.txt" with id = "7"
+        // and path = "a/b.txt". A literal wins over a parameter, which wins over a
+        // wildcard, and a failed literal branch falls back to the parameter at that
+        // level. The query string is ignored, empty segments are skipped and segments
+        // are compared as they arrive, percent encoding is not decoded.
+        //
+        // Lookup walks the target once, each segment is a binary search over the
+        // literal children of a node, so its cost depends on the path and not on how
+        // many routes there are. Routes are added before the interface starts and
+        // only read afterwards, so matching needs no lock
+        class Router {
+
+            public:
+
+                // Returns false, and the route is not added, if the pattern is malformed
+                bool add(http::verb method, std::string_view pattern, RouteHandler handler, bool offload = false,
+                         std::chrono::milliseconds ttl = {}) {
+                    std::unique_ptr<Node>& root = m_Roots[static_cast<std::size_t>(method)];
+                    if (!root)
+                        root = std::make_unique<Node>();
+
+                    Node* node = root.get();
+                    std::size_t captures = 0;
+
+                    for (std::string_view rest = pattern; !rest.empty(); ) {
+                        std::string_view segment = next_segment(rest);
+                        if (segment.empty())
+                            continue;
+
+                        if (segment.front() == '*') {
+                            if (!rest.empty() || ++captures > RouteParams::max_params) {
+                                HJW_LOG_ERROR("Bad route {}: wildcard must be last", pattern);
+                                return false;
+                            }
+                            if (!node->wildcard)
+                                node->wildcard = std::make_unique<Node>();
+                            node->wildcard->name = std::string(segment.substr(1));
+                            node = node->wildcard.get();
+                            break;
+                        }
+
+                        if (segment.front() == '{') {
+                            if (segment.size() < 3 || segment.back() != '}' || ++captures > RouteParams::max_params) {
+                                HJW_LOG_ERROR("Bad route {}: parameter {}", pattern, segment);
+                                return false;
+                            }
+                            std::string_view name = segment.substr(1, segment.size() - 2);
+
+                            // one parameter per level, two routes naming it differently would be ambiguous
+                            if (node->param && node->param->name != name) {
+                                HJW_LOG_ERROR("Bad route {}: parameter {} clashes with {}", pattern, name, node->param->name);
+                                return false;
+                            }
+                            if (!node->param) {
+                                node->param = std::make_unique<Node>();
+                                node->param->name = std::string(name);
+                            }
+                            node = node->param.get();
+                            continue;
+                        }
+
+                        node = node->child(segment);
+                    }
+
+                    if (node->route.handler)
+                        HJW_LOG_WARN("Route {} {} replaced", std::string(http::to_string(method)), pattern);
+
+                    node->route.handler = std::move(handler);
+                    node->route.offload = offload;
+                    node->route.ttl = ttl;
+                    m_Offload |= offload;
+                    return true;
+                }
+
+                RouteMatch match(http::verb method, std::string_view target) const {
+                    RouteMatch m;
+                    std::size_t index = static_cast<std::size_t>(method);
+                    if (index >= m_Roots.size() || !m_Roots[index])
+                        return m;
+
+                    std::string_view path = target.substr(0, target.find('?'));
+                    if (Node const* node = find(m_Roots[index].get(), path, m.params))
+                        m.route = &node->route;
+                    return m;
+                }
+
+                bool empty() const {
+                    return std::none_of(m_Roots.begin(), m_Roots.end(), [](auto const& root) { return bool(root); });
+                }
+
+                // true if any route is marked offload
+                bool offloads() const { return m_Offload; }
+
+            private:
+
+                struct Node {
+                    // literal children sorted by segment
+                    std::vector<std::pair<std::string, std::unique_ptr<Node>>> children;
+
+                    // the {param} and *wildcard children, name is what this node captures
+                    std::unique_ptr<Node> param;
+                    std::unique_ptr<Node> wildcard;
+                    std::string name;
+
+                    // set when a route ends here
+                    Route route;
+
+                    Node* child(std::string_view segment) {
+                        auto it = std::lower_bound(children.begin(), children.end(), segment,
+                                                   [](auto const& c, std::string_view s) { return c.first < s; });
+                        if (it == children.end() || it->first != segment)
+                            it = children.emplace(it, std::string(segment), std::make_unique<Node>());
+                        return it->second.get();
+                    }
+
+                    Node const* find_child(std::string_view segment) const {
+                        auto it = std::lower_bound(children.begin(), children.end(), segment,
+                                                   [](auto const& c, std::string_view s) { return c.first < s; });
+                        if (it == children.end() || it->first != segment)
+                            return nullptr;
+                        return it->second.get();
+                    }
+                };
+
+                // Pop the next segment off the front of path
+                static std::string_view next_segment(std::string_view& path) {
+                    while (!path.empty() && path.front() == '/')
+                        path.remove_prefix(1);
+
+                    std::size_t end = std::min(path.find('/'), path.size());
+                    std::string_view segment = path.substr(0, end);
+                    path.remove_prefix(end);
+                    return segment;
+                }
+
+                static Node const* find(Node const* node, std::string_view path, RouteParams& params) {
+                    std::string_view rest = path;
+                    std::string_view segment = next_segment(rest);
+
+                    // end of the path, empty segments are skipped so "/a/" is "/a"
+                    if (segment.empty()) {
+                        if (node->route.handler)
+                            return node;
+                        // a wildcard also takes an empty tail
+                        return capture_tail(node, rest, params);
+                    }
+
+                    if (Node const* child = node->find_child(segment)) {
+                        if (Node const* found = find(child, rest, params))
+                            return found;
+                    }
+
+                    if (node->param && params.m_Count < RouteParams::max_params) {
+                        std::size_t count = params.m_Count;
+                        params.m_Params[params.m_Count++] = {node->param->name, segment};
+                        if (Node const* found = find(node->param.get(), rest, params))
+                            return found;
+                        params.m_Count = count;
+                    }
+
+                    // the tail starts at this segment
+                    while (path.front() == '/')
+                        path.remove_prefix(1);
+                    return capture_tail(node, path, params);
+                }
+
+                static Node const* capture_tail(Node const* node, std::string_view tail, RouteParams& params) {
+                    if (!node->wildcard || !node->wildcard->route.handler || params.m_Count >= RouteParams::max_params)
+                        return nullptr;
+
+                    params.m_Params[params.m_Count++] = {node->wildcard->name, tail};
+                    params.m_Tail = tail;
+                    return node->wildcard.get();
+                }
+
+            private:
+
+                // one trie per method, indexed by http::verb
+                std::array<std::unique_ptr<Node>, 64> m_Roots;
+
+                bool m_Offload = false;
+        };
+
+    }
+}
+
+#endif // REST_ROUTER_H_
@@ -5,12 +5,18 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/redirect_error.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/asio/use_awaitable.hpp>
 
 #include <boost/config.hpp>
+#include <chrono>
 #include <functional>
 #include <iostream>
+#include <optional>
+
+#include "net_log.hpp"
+#include "rest_response.hpp"
 
 namespace beast = boost::beast;
 namespace http = beast::http;
@@ -21,58 +27,123 @@ namespace hjw {
 
     namespace rest {
 
+        // hjw::net exists for the logger, keep net:: meaning boost::asio in here
+        namespace net = boost::asio;
+
+        // Per connection limits, shared by every session of a listener
+        struct SessionOptions {
+            // requests served on one connection before it is closed, the last response says Connection: close
+            std::size_t max_requests = 1000;
+
+            // how long a connection may sit between requests, or take over one read or write
+            std::chrono::seconds idle_timeout{30};
+        };
+
         // This class will handle induvidual client sessions over HTTP
         // Using async_read and async_write
         // Enable shared is used to prevent dangling operations if pointer destroyed
+        //
+        // The connection is kept open between requests unless the client asks for
+        // Connection: close, speaks HTTP/1.0 without keep-alive, or reaches max_requests.
+        // Pipelined requests are answered one at a time in the order they arrived, the
+        // next one is often already sitting in m_Buffer and is parsed without a read
+        //
+        // The handler is either plain, run inline on the session's thread, or an
+        // AsyncHandler coroutine run on the session's executor, which may suspend on
+        // its own I/O or on work handed to another thread. The session reads nothing
+        // more until the response is ready, so the request stays valid while it waits
         class Session : public std::enable_shared_from_this<Session> {
 
             public:
 
-                using Handler = std::function<http::response<http::dynamic_body>
-                                              (http::request<http::dynamic_body> const&)>;
+                using Handler = std::function<Response(http::request<http::dynamic_body> const&)>;
+
+                using AsyncHandler = std::function<net::awaitable<Response>
+                                                   (http::request<http::dynamic_body> const&)>;
 
                 // Socket must be passed through constructor
                 // Created by async_accept fucnction that runs session
                 // A request handler is also passed
-                Session(tcp::socket s, Handler h) : m_Socket(std::move(s)), m_Handler(std::move(h)) {}
+                Session(tcp::socket s, Handler h, SessionOptions options = {})
+                    : m_Stream(std::move(s)), m_Handler(std::move(h)), m_Options(options) {}
+
+                Session(tcp::socket s, AsyncHandler h, SessionOptions options = {})
+                    : m_Stream(std::move(s)), m_AsyncHandler(std::move(h)), m_Options(options) {}
 
                 // Run function to start session
                 // Should co_spawn run
-                net::awaitable<void> run() { co_await co_read(); }
+                net::awaitable<void> run() {
+                    auto self(shared_from_this());
+                    beast::error_code ec;
+
+                    for (std::size_t served = 0; ;) {
+                        if (!co_await co_read(ec))
+                            break;
+
+                        std::optional<Response> res;
+                        if (m_AsyncHandler)
+                            res.emplace(co_await m_AsyncHandler(m_Parser->get()));
+                        else
+                            res.emplace(m_Handler(m_Parser->get()));
+
+                        // last request of this connection, tell the client before closing
+                        bool keep_alive = m_Parser->get().keep_alive() && ++served < m_Options.max_requests;
+                        res->keep_alive(keep_alive);
+
+                        if (!co_await co_write(*res, ec) || res->need_eof())
+                            break;
+                    }
+
+                    // peer closed, timed out or was told to close, let it see the end
+                    m_Stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+                }
 
             private:
 
                 // Read
-                net::awaitable<void> co_read() {
-                    auto self(shared_from_this());
-                    co_await http::async_read(m_Socket, m_Buffer, m_Req, net::use_awaitable);
-                    http::response<http::dynamic_body> res = m_Handler(m_Req);
-                    co_await co_write(res);
+                // The parser is rebuilt in place and m_Buffer keeps any bytes of the next
+                // request, so pipelined requests are not lost between reads
+                net::awaitable<bool> co_read(beast::error_code& ec) {
+                    m_Parser.emplace();
+                    m_Stream.expires_after(m_Options.idle_timeout);
+                    co_await http::async_read(m_Stream, m_Buffer, *m_Parser, net::redirect_error(net::use_awaitable, ec));
+
+                    // end_of_stream is the client closing between requests, not worth a log
+                    if (ec && ec != http::error::end_of_stream && ec != beast::error::timeout)
+                        HJW_LOG_INFO("REST read error: {}", ec.message());
+                    co_return !ec;
                 }
 
                 // Write
                 // Shoudl always occur is unison with a read
-                net::awaitable<void> co_write(http::response<http::dynamic_body> res) {
-                    auto self(shared_from_this());
-                    auto sp_res = std::make_shared<http::response<http::dynamic_body>>(std::move(res));
-                    co_await http::async_write(m_Socket, *sp_res, net::use_awaitable);
-                    m_Socket.shutdown(tcp::socket::shutdown_send);
+                net::awaitable<bool> co_write(Response& res, beast::error_code& ec) {
+                    // a kept alive connection needs the body length to find the next response
+                    res.prepare_payload();
+
+                    co_await res.write(m_Stream, m_Options.idle_timeout, ec);
+                    if (ec)
+                        HJW_LOG_INFO("REST write error: {}", ec.message());
+                    co_return !ec;
                 }
 
 
             private:
 
-                // TCP socket used for HTTP messaging
-                tcp::socket m_Socket;
+                // TCP stream used for HTTP messaging, carries the idle timeout
+                beast::tcp_stream m_Stream;
 
-                // Buffer for reading data
+                // Buffer for reading data, lives as long as the connection
                 beast::flat_buffer m_Buffer;
 
-                // HTTP request object
-                http::request<http::dynamic_body> m_Req;
+                // Parser for the request being read, re-emplaced for each request
+                std::optional<http::request_parser<http::dynamic_body>> m_Parser;
 
-                // Handler for requests
+                // Handler for requests, only one of the two is set
                 Handler m_Handler;
+                AsyncHandler m_AsyncHandler;
+
+                // keep-alive limits
+                SessionOptions m_Options;
 
         };
 
@@ -7,6 +7,7 @@
  */
 
 #include "wss_session.hpp"
+#include "net_latency.hpp"
 #include <memory>
 
 namespace hjw {
@@ -29,16 +30,16 @@ namespace hjw {
                 }
 
                 void SetHost(std::string h) {m_sHost = h;}
-                void PrintHost() {std::cout << "Host : " << m_sHost << std::endl;}
+                void PrintHost() {HJW_LOG_INFO("Host : {}", m_sHost);}
 
                 void SetPort(std::string p) {m_sPort = p;}
-                void PrintPort() {std::cout << "Port : " << m_sPort << std::endl;}
+                void PrintPort() {HJW_LOG_INFO("Port : {}", m_sPort);}
 
                 void SetRequest(std::string r) {m_sRequest = r;}
-                void printRequest() {std::cout << "Request : " << m_sRequest << std::endl;}
+                void printRequest() {HJW_LOG_INFO("Request : {}", m_sRequest);}
 
                 void SetEndpoint(std::string e) {m_sEndpoint = e;}
-                void PrintEndpoint() {std::cout << "Endpoint : " << m_sEndpoint << std::endl;}
+                void PrintEndpoint() {HJW_LOG_INFO("Endpoint : {}", m_sEndpoint);}
 
                 void SetThreadCount(int tc) {
                     if(!isOpen()) {
@@ -48,29 +49,41 @@ namespace hjw {
                     }
                 }
 
-                void PrintThreadCount() {std::cout << "Thread count : " << m_nThreadCount << std::endl;}
+                void PrintThreadCount() {HJW_LOG_INFO("Thread count : {}", m_nThreadCount);}
+
+                // context thread run mode and socket options, must be set before Open
+                void SetLatency(const net::latency_config& config) {
+                    if(!isOpen())
+                        m_oLatency = config;
+                }
+
+                // nodelay, buffer sizes and keepalive for the websocket's tcp socket, must be set before Open
+                void SetSocketOptions(const net::socket_options& options) {
+                    if(!isOpen())
+                        m_oSocketOptions = options;
+                }
 
                 void Open() {
                     if(m_bOpenSocket) {
-                        std::cout << "Socket already open.\n";
+                        HJW_LOG_INFO("Socket already open.");
                         return;
                     }
 
                     try {
-                        std::cout << "Openning socket ... \n";
+                        HJW_LOG_INFO("Openning socket ... ");
 
                         // Launch the asynchronous operation
                         // Create instance of sessiona and return shared pointer
-                        m_pSession = std::make_shared<session>(m_oAsioContext, m_oSSlContext);
+                        m_pSession = std::make_shared<session>(m_oAsioContext, m_oSSlContext, m_oLatency, m_oSocketOptions);
                         m_pSession->Run(m_sHost.c_str(), m_sPort.c_str(), m_sRequest.c_str(), m_sEndpoint.c_str());
 
                         // Run the IO service
                         for(int i=0; i < m_nThreadCount; i++) {
-                            m_tvThreads.emplace_back([this](){m_oAsioContext.run();});
+                            m_tvThreads.emplace_back([this, i](){net::RunContext(m_oAsioContext, m_oLatency, i);});
                         }
                         m_bOpenSocket = true;
                     }catch(std::exception& e) {
-                        std::cerr << "Client exception" << e.what() << std::endl;
+                        HJW_LOG_ERROR("Client exception{}", e.what());
                         return;
                     }
                 }
@@ -88,7 +101,7 @@ namespace hjw {
                     }
 
                     m_bOpenSocket = false;
-                    std::cout << "Socket connection closed\n";
+                    HJW_LOG_INFO("Socket connection closed");
                 }
 
             private:
@@ -97,6 +110,8 @@ namespace hjw {
 
                 std::vector<std::thread> m_tvThreads;
                 int m_nThreadCount;
+                net::latency_config m_oLatency;
+                net::socket_options m_oSocketOptions;
 
                 std::shared_ptr<session> m_pSession;
 
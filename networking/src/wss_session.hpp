@@ -11,6 +11,7 @@
 #include <boost/beast/ssl.hpp>
 #include <boost/beast/websocket.hpp>
 #include <boost/beast/websocket/ssl.hpp>
+#include <algorithm>
 #include <chrono>
 #include <memory>
 #include <system_error>
@@ -39,6 +40,10 @@
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
 
+#include "net_latency.hpp"
+#include "net_log.hpp"
+#include "net_socket_options.hpp"
+
 namespace asio = boost::asio;
 namespace beast = boost::beast; // from boost/beast.hpp
 namespace http = beast::http; // from boost/beast/http.hpp
@@ -54,7 +59,7 @@ namespace hjw {
 
         // General function to report failure
         void fail(std::error_code ec, char const* what) {
-            std::cerr << what << ec.message() << "\n";
+            HJW_LOG_ERROR("{}{}", what, ec);
         }
 
         // using enable_shared_from_this o easily initilaise a shared_ptr to a session object
@@ -63,12 +68,15 @@ namespace hjw {
                 // resolver and socket require an io_context
                 // use explicit to prevent unwanted type conversions
                 explicit
-                session(asio::io_context& asio_ioc, ssl::context& ssl_ctx)
+                session(asio::io_context& asio_ioc, ssl::context& ssl_ctx, const hjw::net::latency_config& latency = {},
+                        const hjw::net::socket_options& options = {})
                     // resolver looks up domain name
                     : m_oResolver(asio::make_strand(asio_ioc)), // using make_strand to create a dedicated thread for the resolver that dosnt require the use of mutexs
                       m_oWebSocketStream(asio::make_strand(asio_ioc), ssl_ctx), // pass asio context and ssl context to websocket constructor
                       m_oAsioContext(asio_ioc), // reference to io_context created in wss_client_interface
-                      m_oAsioStrand(asio_ioc.get_executor()) // Get strand from the io context, when work is submitted to a strand it ensures only one thread is running at a time
+                      m_oAsioStrand(asio_ioc.get_executor()), // Get strand from the io context, when work is submitted to a strand it ensures only one thread is running at a time
+                      m_oLatency(latency),
+                      m_oSocketOptions(options)
                 {
 
                 }
@@ -113,6 +121,10 @@ namespace hjw {
                     if(ec)
                         return wss::fail(ec, "connnect");
 
+                    // socket profile, then quick ack and busy poll from the client's latency_config
+                    hjw::net::ApplySocketOptions(beast::get_lowest_layer(m_oWebSocketStream).socket(), m_oSocketOptions);
+                    hjw::net::ApplySocketOptions(beast::get_lowest_layer(m_oWebSocketStream).socket(), m_oLatency);
+
                     // Get the socket associated with the web socket and set a timeout
                     // m_oWebSocketStream is defined as wedsocket::stream<beast::ssl_stream<beast::tcp_stream>>
                     // so get_lowest_layer will return a tcp_stream
@@ -190,9 +202,9 @@ namespace hjw {
                     if(ec)
                         return fail(ec, "read");
 
-                    // print the data recieved from the websocket
-                    // make_printable interprets the bytes as characters
-                    std::cout << beast::make_printable(m_oBuffer.data()) << " By thread ID : " << boost::this_thread::get_id() << std::endl;
+                    // print the data recieved from the websocket, its size and as much as fits a log line
+                    HJW_LOG_INFO("[{} bytes] {} By thread ID : {}", m_oBuffer.size(), Preview(),
+                                 std::hash<std::thread::id>{}(std::this_thread::get_id()));
 
                     // clean the buffer
                     m_oBuffer.consume(m_oBuffer.size());
@@ -209,10 +221,22 @@ namespace hjw {
                         fail(ec, "close");
 
                     // websocket has been closed gracefully
-                    std::cout << beast::make_printable(m_oBuffer.data()) << std::endl;
+                    HJW_LOG_INFO("[{} bytes] {}", m_oBuffer.size(), Preview());
+                }
+
+                // the start of the buffered frame, frames longer than nLogPreview end in "..."
+                std::string Preview() const {
+                    auto data = m_oBuffer.data();
+                    std::string sPreview(static_cast<const char*>(data.data()), std::min(data.size(), nLogPreview));
+                    if(data.size() > nLogPreview)
+                        sPreview += "...";
+                    return sPreview;
                 }
 
             private:
+                // bytes of a frame that are logged, the logger would cut it at nLogMaxString anyway
+                static constexpr size_t nLogPreview = 1024;
+
                 asio::io_context& m_oAsioContext;
                 tcp::resolver m_oResolver;
                 websocket::stream<beast::ssl_stream<beast::tcp_stream>> m_oWebSocketStream;
@@ -221,6 +245,8 @@ namespace hjw {
                 std::string m_sText;
                 std::string m_sEndpoint;
                 strand m_oAsioStrand;
+                hjw::net::latency_config m_oLatency;
+                hjw::net::socket_options m_oSocketOptions;
 
         };
 